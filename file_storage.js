@@ -1,6 +1,3 @@
-import * as std from "std";
-
-
 function KeyPress(key) {
     return key.charCodeAt(0);
 }
@@ -65,15 +62,10 @@ FileStorage.prototype.open = function(terminal, key) {
     let is_success = true;
 
     switch (key) {
-        case KeyPress('o'): // english small o
-            if (terminal.changed) {
-                terminal.echo_status_message("You need to save file first.");
-                is_success = false;
-                break;
-            }
+        case KeyPress('o'): // english small o, buffers keep their edits
         case KeyPress('O'): // english big O
             {
-                let v = terminal.prompt('open: %s');
+                let v = terminal.prompt('open: %s', true);
 
                 if (v) {
                     let exists = this.find(x => x == v);
@@ -82,14 +74,13 @@ FileStorage.prototype.open = function(terminal, key) {
                         this.push(v);
                     }
 
-                    let find_file = std.popen(`find . -name ${v}`, 'r');
-
-                    if (find_file.getline()) {
-                        terminal.file_close();
-                        terminal.file_open(v);
+                    if (terminal.file_exists(v)) {
+                        if (terminal.buffer_open(v) >= 0) {
+                            this.recover(terminal);
+                        }
                     }
                     else {
-                        terminal.file_close();
+                        terminal.buffer_open(null);
                         terminal.filename = v;
                         terminal.file_save();
                     }
@@ -104,6 +95,24 @@ FileStorage.prototype.open = function(terminal, key) {
 }
 
 
+// the file just opened has edits a crash left in its journal
+FileStorage.prototype.recover = function(terminal) {
+    if (!terminal.journal_found()) {
+        return;
+    }
+
+    let v = terminal.prompt('unsaved edits found, replay them? (y/n) %s');
+
+    if (v == 'y' || v == 'Y') {
+        terminal.journal_replay();
+    }
+    else {
+        terminal.journal_discard();
+        terminal.echo_status_message("journal discarded");
+    }
+}
+
+
 FileStorage.prototype.close = function(terminal, key) {
     let is_success = true;
 
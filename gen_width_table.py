@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+#  Print width_table.h, the columns a code point takes on a terminal:
+#  0 for combining marks and format characters, 2 for East Asian Wide
+#  and Fullwidth ones, 1 for the rest. Uses the Unicode data Python
+#  was built with.
+#
+#      python3 gen_width_table.py > width_table.h
+#
+import unicodedata
+
+
+def width(cp):
+    c = chr(cp)
+
+    if 0xd800 <= cp <= 0xdfff or cp == 0xad:
+        return 1
+    if unicodedata.category(c) in ('Mn', 'Me', 'Cf'):
+        return 0
+    if 0x1160 <= cp <= 0x11ff or cp == 0x200b:
+        return 0
+    # unassigned code points are wide only in the ideograph blocks
+    if unicodedata.category(c) == 'Cn':
+        wide = ((0x3400, 0x4dbf), (0x4e00, 0x9fff), (0xf900, 0xfaff),
+                (0x20000, 0x2fffd), (0x30000, 0x3fffd))
+        return 2 if any(lo <= cp <= hi for lo, hi in wide) else 1
+    if unicodedata.east_asian_width(c) in ('W', 'F'):
+        return 2
+    return 1
+
+
+def ranges(w):
+    out = []
+    for cp in range(0x300, 0x110000):
+        if width(cp) != w:
+            continue
+        if out and out[-1][1] == cp - 1:
+            out[-1][1] = cp
+        else:
+            out.append([cp, cp])
+    return out
+
+
+def table(name, rs):
+    print('static const struct width_range %s[] = {' % name)
+    line = '   '
+    for lo, hi in rs:
+        item = ' {0x%X, 0x%X},' % (lo, hi)
+        if len(line) + len(item) > 76:
+            print(line)
+            line = '   '
+        line += item
+    print(line)
+    print('};')
+
+
+print('/*')
+print(' *  Generated by gen_width_table.py from Unicode %s, do not edit.'
+        % unicodedata.unidata_version)
+print(' *  Code points below U+0300 are one column and not listed.')
+print(' */')
+print('#ifndef WIDTH_TABLE_H')
+print('#define WIDTH_TABLE_H')
+print()
+print()
+print('struct width_range {')
+print('    unsigned int lo;')
+print('    unsigned int hi;')
+print('};')
+print()
+print()
+table('width_zero', ranges(0))
+print()
+print()
+table('width_wide', ranges(2))
+print()
+print('#endif')
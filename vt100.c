@@ -2,6 +2,7 @@
 
 
 #include "vt100.h"
+#include "width_table.h"
 
 
 #define countof(x) (sizeof(x) / sizeof((x)[0]))
@@ -9,6 +10,7 @@
 #define CTRL_(k) ((k) & 0x1f)
 #define WOE_VERSION "0.2.0"
 #define WOE_TAB     2
+#define WOE_MSG_TIME 5  // seconds a status message stays up
 
 
 enum editor_key {
@@ -21,24 +23,102 @@ enum editor_key {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_KEY  // a bracketed paste, its text is in paste
 };
 
 /*
  *  Data
  */
 
+/*
+ *  Read-only bytes shared by many rows, e.g. a mapped file. Rows that
+ *  point into a block hold a reference to it instead of owning chars.
+ */
+struct text_block {
+    int refs;
+    int mapped;  // munmap base when done, otherwise free it
+    int slot;    // in map_slots, -1 when not guarded
+    char *base;
+    size_t len;
+};
+
+
+/*
+ *  A row starts as a read-only view of size bytes of a block, the
+ *  mapped file or the append-only add buffer. Its first edit copies it
+ *  into a gap buffer it owns (block is NULL): chars holds the text
+ *  before the gap, gap_len unused bytes, then the rest, and the gap
+ *  follows the cursor so typing only touches bytes next to it.
+ */
 typedef struct erow {
     int size;
-    int rsize;
     char *chars;
-    char *render;
+    struct text_block *block;
+    int gap;
+    int gap_len;
+    unsigned long gen;  // new stamp on every change, keys the render cache
 } erow;
 
 
+/*
+ *  Rows are kept in the leaves of a counted B+ tree. Every node caches
+ *  the number of rows below it, so finding, inserting or deleting the
+ *  row at a line number only walks one root-to-leaf path.
+ */
+#define LINE_LEAF_MAX  64
+#define LINE_NODE_MAX  32
+#define LINE_LEAF_MIN  (LINE_LEAF_MAX / 4)
+#define LINE_NODE_MIN  (LINE_NODE_MAX / 4)
+#define LINE_LEAF_LAZY (LINE_LEAF_MAX / 2)
+
+/*
+ *  A leaf built from a mapped file starts out lazy: rows is NULL and
+ *  its n lines are found at block->base + offset once someone needs
+ *  them.
+ */
+struct line_node {
+    int leaf;
+    int n;      // used slots in rows or child
+    int count;  // rows in this subtree
+    union {
+        erow *rows;
+        struct line_node **child;
+    };
+    struct text_block *block;
+    size_t offset;
+};
+
+
 struct termios origin_termios;
 
 static JSClassID js_vt100_class_id;
+static JSClassID js_regex_class_id;
+
+// keys run by dispatch and the time they took, see Keymap
+struct key_stats {
+    unsigned long keys;
+    unsigned long long ns;
+    unsigned long long max_ns;
+};
+
+
+// the file as last read or written, see Disk changes
+#define STAMP_TAIL 64
+
+struct file_stamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int pending;   // an event named it, not looked at yet
+    int told;      // the user heard it changed under edits or went away
+    int asked;     // file_save asked once before writing over it
+    int cut;       // cut short under unsaved edits, rows read NULs
+    int tail_len;
+    char tail[STAMP_TAIL];  // its last bytes, to tell an append
+};
+
 
 struct editor_config {
     int cx;    // current x
@@ -51,17 +131,107 @@ struct editor_config {
     int numrows;
     int mode;
     int number_command;
-    erow *row_obj;
+    struct line_node *lines;
+    struct text_block *add;  // add buffer chunk being filled
+    size_t add_cap;
+    struct render_line *render_cache;
+    unsigned long render_tick;
+    size_t render_bytes;
+    unsigned long *frame;  // hash of each screen line as last written
+    int frame_rows;        // rows the frame is for, -1 when unknown
+    int frame_cols;
+    int frame_x;           // cursor as last placed
+    int frame_y;
+    int frame_bytes;       // written by the last refresh
+    int frames_dropped;
+    char *out;             // frame the terminal has not taken yet
+    int out_len;
+    int out_sent;
+    char *search;  // pattern of the last search
+    int search_len;
+    int search_y;  // where it last matched
+    int search_x;
+    struct regex *highlight;  // its matches are shown on screen
+    struct match_line *match_cache;
+    struct width_line *width_cache;
+    char *status_format;  // template of the status bar, or NULL
+    char **status_modes;  // what %M shows for each mode
+    int status_nmodes;
+    struct key_binding *keymap;  // open addressed by mode and key
+    int keymap_cap;
+    int keymap_used;
+    struct key_stats key_native;  // keys run by a native action
+    struct key_stats key_js;      // keys that called into JS
+    struct undo_log *undo;
+    size_t undo_limit;  // bytes of history kept
+    struct editor_buffer *buffers;  // open files, see Buffers
+    int nbuffers;
+    int buffer_cap;
+    int buffer;                     // the current one, its slot is empty
+    unsigned long buffer_tick;
+    size_t buffer_budget;
+    int mapped;  // rows borrow a mapping of filename
     int changed;
     char *filename;
+    struct file_stamp disk;
+    int watch_fd;  // inotify on the directories of open files
+    int follow;        // keep reading what is appended, see Disk changes
+    int follow_limit;  // rows kept while following, 0 for all
+    int follow_dropped;  // rows of the file no longer held
+    int save_fsync;      // saves wait until the file is on disk
+    struct save_job *save;  // the save being written, see File i/o
+    int save_again;         // file_save was asked for meanwhile, per buffer
+    int save_fd;            // eventfd the save thread wakes us on
+    int autosave;           // seconds between swap file writes, 0 for none
+    int swap_changed;       // E->changed as last written to the swap file
+    time_t swap_time;
+    struct journal *journal;  // edits since the file was read, see Journal
+    int journal_found;        // file_open found one left by a crash
     char status_msg[80];
     time_t status_msg_time;
 };
 
 
+static void render_cache_free(struct editor_config *E);
+static void match_cache_free(struct editor_config *E);
+static void width_cache_free(struct editor_config *E);
+static void status_clear(struct editor_config *E);
+static void keymap_free(JSRuntime *rt, struct editor_config *E);
+static void js_vt100_mark(JSRuntime *rt, JSValueConst val,
+        JS_MarkFunc *mark_func);
+static void regex_unref(struct regex *re);
+static void undo_clear(struct editor_config *E);
+static void undo_log_free(struct undo_log *u);
+static void buffers_free(struct editor_config *E);
+static void buffer_save_cancel(struct editor_config *E);
+static void journal_free(struct journal *j);
+static void save_wait(struct editor_config *E);
+
+
 static void js_vt100_finalizer(JSRuntime *rt, JSValue val)
 {
     struct editor_config *s = JS_GetOpaque(val, js_vt100_class_id);
+
+    buffer_save_cancel(s);
+    save_wait(s);
+    render_cache_free(s);
+    match_cache_free(s);
+    width_cache_free(s);
+    status_clear(s);
+    keymap_free(rt, s);
+    regex_unref(s->highlight);
+    undo_clear(s);
+    journal_free(s->journal);
+    buffers_free(s);
+    free(s->frame);
+    free(s->out);
+    free(s->search);
+    if (s->watch_fd != -1) {
+        close(s->watch_fd);
+    }
+    if (s->save_fd != -1) {
+        close(s->save_fd);
+    }
     js_free_rt(rt, s);
 }
 
@@ -69,6 +239,7 @@ static void js_vt100_finalizer(JSRuntime *rt, JSValue val)
 static JSClassDef js_vt100_class = {
     "VT100",
     .finalizer = js_vt100_finalizer,
+    .gc_mark = js_vt100_mark,
 };
 
 
@@ -78,12 +249,42 @@ static JSClassDef js_vt100_class = {
 
 static void utf8_fix_cx_position(struct editor_config *E);
 static void move_cursur_right(struct editor_config *E);
+void editor_row_free(erow *row);
+void editor_row_update(erow *row);
 void editor_row_delete(struct editor_config *E, int at);
+void file_save(struct editor_config *E);
 void die(const char *s);
 void editor_row_insert(struct editor_config *E, int at, const char *s, size_t len);
 void c_echo_status_message(struct editor_config *E, const char *fmt, ...);
 int editor_read_key (void);
 static void editor_refresh_screen(struct editor_config *E, const char *str);
+static void frame_invalidate(struct editor_config *E);
+static void frame_send(struct editor_config *E, const char *s, int len);
+JSValue editor_scroll(struct editor_config *s);
+static void undo_insert(struct editor_config *E,
+        int y, int x, const char *s, size_t len);
+static void undo_delete(struct editor_config *E,
+        int y, int x, const char *s, size_t len);
+static void undo_row_add(struct editor_config *E,
+        int y, const char *s, size_t len);
+static void buffer_close(struct editor_config *E);
+static unsigned long frame_hash(const char *s, int len);
+static const char *path_base(const char *path);
+static void file_stamp_take(struct file_stamp *d, int fd);
+static int file_stamp_same(struct file_stamp *d, struct stat *st);
+static void file_watch(struct editor_config *E);
+static void file_reload(struct editor_config *E);
+static void cursor_clamp(struct editor_config *E);
+static void editor_row_link(struct editor_config *E, int at, erow *row);
+static char *file_side_path(const char *filename, const char *ext);
+static void buffer_saved(struct editor_config *E, const char *filename,
+        int fd, int changed, size_t mark);
+static void buffer_save_queued(struct editor_config *E);
+static void journal_drop(struct editor_config *E);
+static void journal_check(struct editor_config *E);
+static size_t journal_mark(struct journal *j);
+static void journal_saved(struct journal **jp, int unchanged, size_t mark,
+        struct file_stamp *d);
 
 
 /*
@@ -116,1532 +317,11618 @@ void abuf_free(struct abuf *ab) {
 
 
 /*
- *  File i/o
+ *  Text block
  */
-void file_open(struct editor_config *E, const char *filename)
-{
-    free(E->filename);
-    E->filename = strdup(filename);
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        die("fopen");
-    }
 
-    char *line = NULL;
-    size_t line_cap = 0;
-    ssize_t line_len;
+/*
+ *  A mapped file cut short under us, e.g. a log truncated in place,
+ *  turns every read past its new end into SIGBUS, from a draw, a search
+ *  or the save thread alike. Mapped blocks are listed in map_slots; a
+ *  fault in one of them maps zero pages over the rest of it, so reads
+ *  go on, marks the slot cut and sets map_cut for file_watch_check,
+ *  which reloads the buffers viewing it or, under unsaved edits, keeps
+ *  them from being saved over their file. Faults that are not ours go
+ *  to whatever handled SIGBUS before.
+ */
+#define MAP_SLOTS 1024
 
-    while ((line_len = getline(&line, &line_cap, fp)) != -1) {
-        while (line_len > 0 && (line[line_len - 1] == '\n' ||
-                                line[line_len - 1] == '\r')) {
-            line_len--;
-        }
 
-        editor_row_insert(E, E->numrows, line, line_len);
-        E->cy = E->numrows;
-    }
+struct map_slot {
+    char *base;  // NULL when free
+    size_t len;
+    volatile sig_atomic_t cut;
+};
 
-    free(line);
-    fclose(fp);
-    E->cy = 0;
-    E->changed = 0;
-}
 
+static struct map_slot map_slots[MAP_SLOTS];
+static volatile sig_atomic_t map_cut;
+static long map_page;
+static struct sigaction map_old;
 
-static JSValue js_file_open(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+
+static void map_fault(int sig, siginfo_t *si, void *uctx)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    JSValue v;
+    char *addr = si->si_addr;
 
-    if (!s) {
-        return JS_EXCEPTION;
-    }
+    for (int i = 0; i < MAP_SLOTS; i++) {
+        char *base = __atomic_load_n(&map_slots[i].base, __ATOMIC_ACQUIRE);
 
-    const char *str = JS_ToCString(ctx, argv[0]);
-    file_open(s, str);
-    JS_FreeCString(ctx, str);
-    return JS_UNDEFINED;
-}
+        if (base == NULL || addr < base || addr >= base + map_slots[i].len) {
+            continue;
+        }
 
+        char *from = addr - (size_t) (addr - base) % map_page;
 
-void file_close(struct editor_config *E) {
-    if (E->row_obj != NULL) {
-        for (int at = E->numrows - 1; at >= 0; at--) {
-            editor_row_delete(E, at);
+        if (mmap(from, base + map_slots[i].len - from, PROT_READ,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+                != MAP_FAILED) {
+            map_slots[i].cut = 1;
+            map_cut = 1;
+            return;
         }
+        break;
     }
-    free(E->filename);
-    E->filename = NULL;
 
-    E->cx              = 0;
-    E->cy              = 0;
-    E->rx              = 0;
-    E->numrows         = 0;
-    E->number_command  = 0;
-    E->row_offset      = 0;
-    E->col_offset      = 0;
-    E->row_obj         = NULL;
-    E->changed         = 0;
-    E->status_msg[0]   = '\0';
-    E->status_msg_time = 0;
+    // pass it on; a default or ignored action faults again and dies
+    if (map_old.sa_flags & SA_SIGINFO) {
+        map_old.sa_sigaction(sig, si, uctx);
+    }
+    else if (map_old.sa_handler != SIG_DFL && map_old.sa_handler != SIG_IGN) {
+        map_old.sa_handler(sig);
+    }
+    else {
+        sigaction(sig, &map_old, NULL);
+    }
 }
 
 
-static JSValue js_file_close(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  Guard len bytes mapped at base, returns its slot or -1.
+ */
+static int map_register(char *base, size_t len)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
+    static int installed;
 
-    if (!s) {
-        return JS_EXCEPTION;
+    if (!installed) {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = map_fault;
+        sa.sa_flags     = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        map_page  = sysconf(_SC_PAGESIZE);
+        installed = sigaction(SIGBUS, &sa, &map_old) == 0;
     }
 
-    file_close(s);
-    return JS_UNDEFINED;
+    // past the last slot a mapping goes unguarded, as before
+    for (int i = 0; installed && i < MAP_SLOTS; i++) {
+        if (map_slots[i].base == NULL) {
+            map_slots[i].len = len;
+            map_slots[i].cut = 0;
+            __atomic_store_n(&map_slots[i].base, base, __ATOMIC_RELEASE);
+            return i;
+        }
+    }
+    return -1;
 }
 
 
-static char * editor_rows_to_string(struct editor_config *E,
-        int *buffer_len)
+static void map_unregister(int slot)
 {
-    int total_len = 0;
-    
-    for (int j = 0; j < E->numrows; j++) {
-        total_len += E->row_obj[j].size + 1;
-    }
-    *buffer_len = total_len;
-
-    char *buf = malloc(total_len);
-    char *p = buf;
-
-    for (int j = 0; j < E->numrows; j++) {
-        memcpy(p, E->row_obj[j].chars, E->row_obj[j].size);
-        p += E->row_obj[j].size;
-        *p = '\n';
-        p++;
+    if (slot >= 0) {
+        __atomic_store_n(&map_slots[slot].base, NULL, __ATOMIC_RELEASE);
     }
-
-    return buf;
 }
 
 
-static char *editor_prompt(struct editor_config *E,
-        const char *prompt)
+struct text_block *text_block_new(char *base, size_t len, int mapped)
 {
-    size_t buf_size = 128;
-    char *buf = malloc(buf_size);
-
-    size_t buf_len = 0;
-    buf[0] = '\0';
-
-    while (1) {
-        c_echo_status_message(E, prompt, buf);
-        editor_refresh_screen(E, "");
+    struct text_block *b = malloc(sizeof(*b));
 
-        int c = editor_read_key();
-        if (c == DEL_KEY || c == CTRL_('h') || c == BACKSPACE) {
-            if (buf_len != 0) {
-                buf_len--;
-                buf[buf_len] = '\0';
-            }
-        }
-        else if (c == '\x1b') {
-            c_echo_status_message(E, "");
-            free(buf);
-            return NULL;
-        }
-        else if (c == '\r') {
-            if (buf_len != 0) {
-                c_echo_status_message(E, "");
-                return buf;
-            }
-        }
-        else if (!iscntrl(c) && c < 128) {
-            if (buf_len == buf_size - 1) {
-                buf_size *= 2;
-                buf = realloc(buf, buf_size);
-            }
-            buf[buf_len++] = c;
-            buf[buf_len] = '\0';
-        }
+    if (b == NULL) {
+        die("malloc");
     }
+    b->refs   = 0;
+    b->mapped = mapped;
+    b->slot   = mapped ? map_register(base, len) : -1;
+    b->base   = base;
+    b->len    = len;
+    return b;
 }
 
 
-static JSValue js_editor_prompt(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+static struct text_block *text_block_ref(struct text_block *b)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    JSValue v;
-
-    if (!s) {
-        return JS_EXCEPTION;
-    }
+    b->refs++;
+    return b;
+}
 
-    const char *str = JS_ToCString(ctx, argv[0]);
 
-    char *result = editor_prompt(s, str);
+static void text_block_unref(struct text_block *b)
+{
+    if (b == NULL || --b->refs > 0) {
+        return;
+    }
 
-    if (result != NULL) {
-        v = JS_NewString(ctx, result);
+    if (b->mapped) {
+        map_unregister(b->slot);
+        munmap(b->base, b->len);
     }
     else {
-        v = JS_UNDEFINED;
+        free(b->base);
     }
+    free(b);
+}
 
-    free(result);
-    JS_FreeCString(ctx, str);
 
-    return v;
-}
+/*
+ *  Row text
+ */
 
-void file_save(struct editor_config *E) {
-    if (E->filename == NULL) {
-        E->filename = editor_prompt(E, "Save as: %s");
-        if (E->filename == NULL) {
-            c_echo_status_message(E, "without filename!");
-            return;
-        }
-    }
 
-    int len;
-    char *buf = editor_rows_to_string(E, &len);
+/*
+ *  New text is appended to chunks of this size and never moved or
+ *  changed afterwards, so rows can point at it.
+ */
+#define ADD_CHUNK (64 << 10)
 
-    int fd = open(E->filename, O_RDWR | O_CREAT, 0644);
 
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                c_echo_status_message(E, "save %s success", E->filename);
-                E->changed = 0;
-            }
+static char *add_buffer_append(struct editor_config *E,
+        const char *s, size_t len)
+{
+    if (E->add == NULL || E->add->len + len > E->add_cap) {
+        size_t cap = len > ADD_CHUNK ? len : ADD_CHUNK;
+        char *base = malloc(cap);
+
+        if (base == NULL) {
+            die("malloc");
         }
-    }
-    else {
-        c_echo_status_message(E,
-                "save %s failed: %s",
-                E->filename,
-                strerror(errno));
+
+        // full chunks live on as long as some row still uses them
+        text_block_unref(E->add);
+        E->add = text_block_ref(text_block_new(base, 0, 0));
+        E->add_cap = cap;
     }
 
-    close(fd);
-    free(buf);
+    char *p = E->add->base + E->add->len;
+
+    memcpy(p, s, len);
+    E->add->len += len;
+    return p;
 }
 
 
-static JSValue js_file_save(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+static int erow_is_gap(erow *row)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-
-    if (!s) {
-        return JS_EXCEPTION;
-    }
-
-    file_save(s);
-    return JS_UNDEFINED;
+    return row->block == NULL && row->chars != NULL;
 }
 
 
 /*
- *  Convert position
+ *  A row's bytes are at most two spans: the whole view, or the text
+ *  before and after the gap.
  */
-int editor_convert_cx_to_rx (erow *row, int cx) {
-    int rx = 0;
-    for (int j = 0; j < cx; j++) {
-        char c = row->chars[j];
-        unsigned char cc = c;
-
-        if (c == '\t') {
-            rx += (WOE_TAB - 1) - (rx % WOE_TAB);
-        }
-        else if (cc > 128 && cc < 192) {
-            continue;
-        }
-        else if (cc > 192) {
-            rx += 1;
-        }
-        rx++;
+static int erow_nspans(erow *row)
+{
+    if (erow_is_gap(row)) {
+        return 2;
     }
-    return rx;
+    return row->size > 0;
 }
 
 
-/*
- *  Terminal
- */
-void die(const char *s) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+static char *erow_span(erow *row, int k, int *len)
+{
+    if (!erow_is_gap(row)) {
+        *len = row->size;
+        return row->chars;
+    }
 
-    perror(s);
-    exit(1);
+    if (k == 0) {
+        *len = row->gap;
+        return row->chars;
+    }
+
+    *len = row->size - row->gap;
+    return row->chars + row->gap + row->gap_len;
 }
 
 
-void disable_rawmode(void)
+static unsigned char erow_char(erow *row, int at)
 {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &origin_termios) == -1) {
-        die("tcsetattr");
+    if (at < 0 || at >= row->size) {
+        return '\0';
     }
+
+    if (erow_is_gap(row) && at >= row->gap) {
+        at += row->gap_len;
+    }
+    return row->chars[at];
 }
 
 
-static JSValue js_disable_rawmode(JSContext *ctx, JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  Make room for n more bytes in the gap, turning a view into a gap
+ *  buffer on its first edit.
+ */
+static void erow_gap_reserve(erow *row, int n)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    if (erow_is_gap(row) && row->gap_len >= n) {
+        return;
     }
 
-    disable_rawmode();
-    return JS_UNDEFINED;
-}
-
+    int cap = (row->size + n) * 2;
 
-void enable_rawmode (void)
-{
-    if (tcgetattr(STDIN_FILENO, &origin_termios) == -1) {
-        die("tcgetattr");
+    if (cap < 16) {
+        cap = 16;
     }
 
-    struct termios raw = origin_termios;
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    raw.c_oflag &= ~(OPOST);
-    raw.c_cflag &= ~(CS8);
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    char *chars = malloc(cap);
 
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-        die("tcsetattr");
+    if (chars == NULL) {
+        die("malloc");
     }
-}
 
+    // the gap stays where it was, at the end for a view
+    int len0 = erow_is_gap(row) ? row->gap : row->size;
+    int len1 = row->size - len0;
 
-static JSValue js_enable_rawmode(JSContext *ctx, JSValueConst this_val,
-        int argc, JSValueConst *argv)
-{
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    if (len0 > 0) {
+        memcpy(chars, row->chars, len0);
+    }
+    if (len1 > 0) {
+        memcpy(chars + cap - len1,
+                row->chars + row->gap + row->gap_len, len1);
     }
 
-    enable_rawmode();
-    return JS_UNDEFINED;
+    if (erow_is_gap(row)) {
+        free(row->chars);
+    }
+    else {
+        text_block_unref(row->block);
+    }
+
+    row->chars   = chars;
+    row->block   = NULL;
+    row->gap     = len0;
+    row->gap_len = cap - row->size;
 }
 
 
-void c_echo_status_message(struct editor_config *E,
-        const char *fmt, ...)
+/*
+ *  Move the gap to byte `at`, only the bytes in between are copied.
+ */
+static void erow_gap_move(erow *row, int at)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E->status_msg, sizeof(E->status_msg), fmt, ap);
-    va_end(ap);
-    E->status_msg_time = time(NULL);
+    if (at < row->gap) {
+        memmove(row->chars + at + row->gap_len, row->chars + at,
+                row->gap - at);
+    }
+    else if (at > row->gap) {
+        memmove(row->chars + row->gap,
+                row->chars + row->gap + row->gap_len,
+                at - row->gap);
+    }
+    row->gap = at;
 }
 
 
-static JSValue js_echo_status_message(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  Line tree
+ */
+
+
+static struct line_node *line_node_new(int leaf)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    struct line_node *node = malloc(sizeof(*node));
+
+    if (node == NULL) {
+        die("malloc");
     }
 
-    const char *str = JS_ToCString(ctx, argv[0]);
-    c_echo_status_message(s, str, NULL);
-    JS_FreeCString(ctx, str);
+    node->leaf   = leaf;
+    node->n      = 0;
+    node->count  = 0;
+    node->block  = NULL;
+    node->offset = 0;
 
-    return JS_UNDEFINED;
+    if (leaf) {
+        node->rows = malloc(sizeof(erow) * LINE_LEAF_MAX);
+    }
+    else {
+        node->child = malloc(sizeof(struct line_node *) * LINE_NODE_MAX);
+    }
+
+    if (node->rows == NULL) {
+        die("malloc");
+    }
+    return node;
 }
 
 
-static JSValue js_clean_screen(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+void line_tree_free(struct line_node *node)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    if (node == NULL) {
+        return;
     }
 
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    return JS_UNDEFINED;
+    if (node->leaf && node->rows == NULL) {
+        text_block_unref(node->block);
+    }
+    else if (node->leaf) {
+        for (int i = 0; i < node->n; i++) {
+            editor_row_free(&node->rows[i]);
+        }
+        free(node->rows);
+    }
+    else {
+        for (int i = 0; i < node->n; i++) {
+            line_tree_free(node->child[i]);
+        }
+        free(node->child);
+    }
+    free(node);
 }
 
 
 /*
- *  Api
+ *  Split the line starting at p off a buffer, like getline and the
+ *  old file_open loop did: trailing '\r' is dropped, and the start of
+ *  the next line is returned.
  */
+static char *line_next(char *p, char *end, int *len)
+{
+    char *nl = memchr(p, '\n', end - p);
+    char *line_end = nl ? nl : end;
 
+    *len = line_end - p;
+    while (*len > 0 && p[*len - 1] == '\r') {
+        (*len)--;
+    }
+    return nl ? nl + 1 : end;
+}
 
-void move_to_line(struct editor_config *E,
-        int at)
+
+/*
+ *  Turn the lines of a lazy leaf into rows borrowing the block.
+ */
+static void line_leaf_load(struct line_node *leaf)
 {
-    at--;
-    if (at <= 0) {
-        at = 0;
+    if (leaf->rows != NULL) {
+        return;
     }
-    else if (at >= E->numrows) {
-        at = E->numrows;
+
+    leaf->rows = malloc(sizeof(erow) * LINE_LEAF_MAX);
+    if (leaf->rows == NULL) {
+        die("malloc");
     }
 
-    E->cy = at;
+    struct text_block *b = leaf->block;
+    char *p   = b->base + leaf->offset;
+    char *end = b->base + b->len;
+
+    for (int i = 0; i < leaf->n; i++) {
+        erow *row = &leaf->rows[i];
+
+        row->chars   = p;
+        row->block   = text_block_ref(b);
+        row->gap     = 0;
+        row->gap_len = 0;
+
+        p = line_next(p, end, &row->size);
+        editor_row_update(row);
+    }
+
+    leaf->block = NULL;
+    text_block_unref(b);
 }
 
 
-static JSValue js_move_to_line(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  Return the leaf holding row `at`, and the row's index inside it,
+ *  without loading it when it is lazy.
+ */
+static struct line_node *line_tree_peek(struct line_node *node,
+        int at, int *index)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    int v;
-
-    if (!s) {
-        return JS_EXCEPTION;
+    if (node == NULL || at < 0 || at >= node->count) {
+        return NULL;
     }
 
-    if (JS_ToInt32(ctx, &v, argv[0])) {
-        return JS_EXCEPTION;
+    while (!node->leaf) {
+        int i = 0;
+
+        while (at >= node->child[i]->count) {
+            at -= node->child[i]->count;
+            i++;
+        }
+        node = node->child[i];
     }
 
-    move_to_line(s, v);
-    return JS_UNDEFINED;
+    *index = at;
+    return node;
 }
 
 
-static void move_to_line_of_end(struct editor_config *E)
+static struct line_node *line_tree_leaf(struct line_node *node,
+        int at, int *index)
 {
-    if (E->row_obj && (&E->row_obj[E->cy] != NULL)) {
-        E->cx = E->row_obj[E->cy].size - 1;
-        utf8_fix_cx_position(E);
+    node = line_tree_peek(node, at, index);
+
+    if (node) {
+        line_leaf_load(node);
     }
+    return node;
 }
 
 
-static JSValue js_move_to_line_of_end(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+erow *line_tree_get(struct line_node *root, int at)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    int index;
+    struct line_node *leaf = line_tree_leaf(root, at, &index);
+
+    if (leaf == NULL) {
+        return NULL;
     }
-    move_to_line_of_end(s);
-    return JS_UNDEFINED;
+    return &leaf->rows[index];
 }
 
 
-static void move_cursur_left_or_previous_line(struct editor_config *E)
+/*
+ *  Rows at..at+*len-1 are contiguous in memory, good for walking the
+ *  whole buffer one leaf at a time.
+ */
+erow *line_tree_span(struct line_node *root, int at, int *len)
 {
-    E->cy--;
-    move_to_line_of_end(E);
+    int index;
+    struct line_node *leaf = line_tree_leaf(root, at, &index);
+
+    if (leaf == NULL) {
+        *len = 0;
+        return NULL;
+    }
+
+    *len = leaf->n - index;
+    return &leaf->rows[index];
 }
 
 
-static JSValue js_move_cursur_left_or_previous_line(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  Split a full node in half, return the new right half.
+ */
+static struct line_node *line_node_split(struct line_node *node)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    struct line_node *right = line_node_new(node->leaf);
+    int half = node->n / 2;
+
+    right->n = node->n - half;
+
+    if (node->leaf) {
+        memcpy(right->rows, &node->rows[half], sizeof(erow) * right->n);
+        right->count = right->n;
     }
-    move_cursur_left_or_previous_line(s);
-    return JS_UNDEFINED;
-}
+    else {
+        memcpy(right->child, &node->child[half],
+                sizeof(struct line_node *) * right->n);
 
+        for (int i = 0; i < right->n; i++) {
+            right->count += right->child[i]->count;
+        }
+    }
 
-static void move_to_line_of_start(struct editor_config *E) {
-    E->cx = 0;
+    node->n      = half;
+    node->count -= right->count;
+    return right;
 }
 
 
-static JSValue js_move_to_line_of_start(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+static struct line_node *line_node_insert(struct line_node *node,
+        int at, const erow *row)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    node->count++;
+
+    if (node->leaf) {
+        line_leaf_load(node);
+        memmove(&node->rows[at + 1], &node->rows[at],
+                sizeof(erow) * (node->n - at));
+        node->rows[at] = *row;
+        node->n++;
+
+        return (node->n == LINE_LEAF_MAX) ? line_node_split(node) : NULL;
     }
-    move_to_line_of_start(s);
-    return JS_UNDEFINED;
-}
 
+    int i = 0;
 
-static void fix_position(struct editor_config *E)
-{
-    erow *row = (E->cy >= E->numrows) ? NULL : &E->row_obj[E->cy];
-    int row_len = row ? row->size : 0;
-    if (row_len == 0) {
-        move_to_line_of_start(E);
+    while (i < node->n - 1 && at > node->child[i]->count) {
+        at -= node->child[i]->count;
+        i++;
     }
-    else if (E->cx >= row_len) {
-        E->cx = row_len - 1;
+
+    struct line_node *right = line_node_insert(node->child[i], at, row);
+
+    if (right == NULL) {
+        return NULL;
     }
+
+    memmove(&node->child[i + 2], &node->child[i + 1],
+            sizeof(struct line_node *) * (node->n - i - 1));
+    node->child[i + 1] = right;
+    node->n++;
+
+    return (node->n == LINE_NODE_MAX) ? line_node_split(node) : NULL;
 }
 
 
-static JSValue js_fix_position(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+void line_tree_insert(struct line_node **root, int at, const erow *row)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    if (*root == NULL) {
+        *root = line_node_new(1);
     }
-    fix_position(s);
-    return JS_UNDEFINED;
-}
 
+    struct line_node *right = line_node_insert(*root, at, row);
 
-static void move_to_next_line_of_start (struct editor_config *E)
-{
-    if (E->cy < (E->numrows - 1)) {
-        E->cy++;
-        move_to_line_of_start(E);
+    if (right) {
+        struct line_node *top = line_node_new(0);
+
+        top->child[0] = *root;
+        top->child[1] = right;
+        top->n        = 2;
+        top->count    = (*root)->count + right->count;
+        *root = top;
     }
 }
 
 
-static void move_cursur_right_or_next_line(struct editor_config *E)
+/*
+ *  Move the first k entries of right to the end of left.
+ */
+static void line_node_shift_left(struct line_node *left,
+        struct line_node *right, int k)
 {
-    erow *row = (E->cy >= E->numrows) ?
-        NULL : &E->row_obj[E->cy];
-    int last_char_size = 1;
-
-    if (row) {
-        unsigned char c = row->chars[row->size - 1];
-        int index = row->size - 1;
+    int moved = k;
 
-        while (c > 128 && c < 192) {
-            index--;
-            c = row->chars[index];
-
-            if (c > 192 && c < 224) {
-                last_char_size = 2;
-                break;
-            }
-            else if (c > 224 && c < 240) {
-                last_char_size = 3;
-                break;
-            }
-            else if (c > 240) {
-                last_char_size = 4;
-                break;
-            }
+    if (left->leaf) {
+        memcpy(&left->rows[left->n], right->rows, sizeof(erow) * k);
+        memmove(right->rows, &right->rows[k],
+                sizeof(erow) * (right->n - k));
+    }
+    else {
+        moved = 0;
+        for (int i = 0; i < k; i++) {
+            moved += right->child[i]->count;
         }
+        memcpy(&left->child[left->n], right->child,
+                sizeof(struct line_node *) * k);
+        memmove(right->child, &right->child[k],
+                sizeof(struct line_node *) * (right->n - k));
     }
 
-    if (row && E->cx < (row->size - last_char_size)) {
-        move_cursur_right(E);
-    }
-    else if (row && ((E->cx == (row->size - last_char_size))
-                || row->size == 0)) {
-        move_to_next_line_of_start(E);
-    }
+    left->n      += k;
+    right->n     -= k;
+    left->count  += moved;
+    right->count -= moved;
 }
 
-static JSValue js_move_cursur_right_or_next_line(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+
+/*
+ *  Move the last k entries of left to the front of right.
+ */
+static void line_node_shift_right(struct line_node *left,
+        struct line_node *right, int k)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    int moved = k;
+
+    if (left->leaf) {
+        memmove(&right->rows[k], right->rows, sizeof(erow) * right->n);
+        memcpy(right->rows, &left->rows[left->n - k], sizeof(erow) * k);
+    }
+    else {
+        moved = 0;
+        for (int i = left->n - k; i < left->n; i++) {
+            moved += left->child[i]->count;
+        }
+        memmove(&right->child[k], right->child,
+                sizeof(struct line_node *) * right->n);
+        memcpy(right->child, &left->child[left->n - k],
+                sizeof(struct line_node *) * k);
     }
 
-    move_cursur_right_or_next_line(s);
-    return JS_UNDEFINED;
+    left->n      -= k;
+    right->n     += k;
+    left->count  -= moved;
+    right->count += moved;
 }
 
 
-static void move_cursur_right(struct editor_config *s)
+/*
+ *  Child i fell under the minimum: merge it with a neighbour when both
+ *  fit in one node, otherwise even the two out.
+ */
+static void line_node_rebalance(struct line_node *node, int i)
 {
-    erow *row = (s->cy >= s->numrows) ? NULL : &s->row_obj[s->cy];
+    if (node->n < 2) {
+        return;
+    }
 
-    if (row) {
-        char c = row->chars[s->cx];
-        unsigned char cc = c;
+    int l = (i > 0) ? i - 1 : i;
+    struct line_node *left  = node->child[l];
+    struct line_node *right = node->child[l + 1];
+    int max = left->leaf ? LINE_LEAF_MAX : LINE_NODE_MAX;
 
-        if (cc < 192) {
-            s->cx++;
-        }
-        else if (cc < 224 && cc > 192) {
-            s->cx += 2;
-        }
-        else if (cc < 240 && cc > 224) {
-            s->cx += 3;
-        }
-        else if (cc > 240) {
-            s->cx += 4;
-        }
+    if (left->leaf) {
+        line_leaf_load(left);
+        line_leaf_load(right);
     }
-}
 
-static JSValue js_utf8_move_cx_right(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
-{
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
-    }
+    if (left->n + right->n < max) {
+        line_node_shift_left(left, right, right->n);
 
-    move_cursur_right(s);
-    return JS_UNDEFINED;
+        free(left->leaf ? (void *) right->rows : (void *) right->child);
+        free(right);
+
+        memmove(&node->child[l + 1], &node->child[l + 2],
+                sizeof(struct line_node *) * (node->n - l - 2));
+        node->n--;
+    }
+    else if (left->n < right->n) {
+        line_node_shift_left(left, right, (right->n - left->n) / 2);
+    }
+    else {
+        line_node_shift_right(left, right, (left->n - right->n) / 2);
+    }
 }
 
 
-static void move_cursur_left(struct editor_config *s)
+static void line_node_delete(struct line_node *node, int at, erow *out)
 {
-    erow *row = (s->cy >= s->numrows) ? NULL : &s->row_obj[s->cy];
+    node->count--;
+
+    if (node->leaf) {
+        line_leaf_load(node);
+        *out = node->rows[at];
+        memmove(&node->rows[at], &node->rows[at + 1],
+                sizeof(erow) * (node->n - at - 1));
+        node->n--;
+        return;
+    }
 
-    if (row) {
-        s->cx--;
-        unsigned char cc = row->chars[s->cx];
+    int i = 0;
 
-        while (cc >= 0b10000000 && cc <= 0b10111111) {
-            s->cx--;
-            cc = row->chars[s->cx];
-        }
+    while (at >= node->child[i]->count) {
+        at -= node->child[i]->count;
+        i++;
     }
-}
 
-static JSValue js_utf8_move_cx_left(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
-{
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    struct line_node *child = node->child[i];
+    line_node_delete(child, at, out);
+
+    if (child->n < (child->leaf ? LINE_LEAF_MIN : LINE_NODE_MIN)) {
+        line_node_rebalance(node, i);
     }
-    move_cursur_left(s);
-    return JS_UNDEFINED;
 }
 
 
-static void page_up (struct editor_config *E)
+/*
+ *  Unlink row `at` and hand it back in *out; the caller owns its
+ *  memory from then on.
+ */
+void line_tree_delete(struct line_node **root, int at, erow *out)
 {
-    int page = E->row_offset - E->rows;
-    erow *row = (E->cy <= 0) ?
-        NULL : &E->row_obj[E->cy];
+    line_node_delete(*root, at, out);
 
-    if (row == NULL) {
-        NULL;
-    }
-    else if (page <= 0) {
-        E->cy = 0;
+    struct line_node *top = *root;
+
+    if (top->leaf && top->n == 0) {
+        free(top->rows);
+        free(top);
+        *root = NULL;
     }
-    else {
-        E->cy -= E->rows;
+    else if (!top->leaf && top->n == 1) {
+        *root = top->child[0];
+        free(top->child);
+        free(top);
     }
-    fix_position(E);
 }
 
-static JSValue js_page_up(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+
+/*
+ *  Drop the first n rows below node: whole children are freed without
+ *  looking at their rows, a lazy leaf only moves its offset on.
+ */
+static void line_node_drop(struct line_node *node, int n)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
-    }
+    node->count -= n;
 
-    page_up(s);
-    return JS_UNDEFINED;
-}
+    if (node->leaf && node->rows == NULL) {
+        char *p   = node->block->base + node->offset;
+        char *end = node->block->base + node->block->len;
+        int len;
 
+        for (int i = 0; i < n; i++) {
+            p = line_next(p, end, &len);
+        }
+        node->offset = p - node->block->base;
+        node->n -= n;
+        return;
+    }
+    if (node->leaf) {
+        for (int i = 0; i < n; i++) {
+            editor_row_free(&node->rows[i]);
+        }
+        memmove(node->rows, &node->rows[n], sizeof(erow) * (node->n - n));
+        node->n -= n;
+        return;
+    }
 
-static void page_down(struct editor_config *E)
-{
-    int page = E->row_offset + E->rows;
-    erow *row = (E->cy >= E->numrows) ?
-        NULL : &E->row_obj[E->cy];
+    int k = 0;
 
-    if (row == NULL) {
-        NULL;
+    while (k < node->n && n >= node->child[k]->count) {
+        n -= node->child[k]->count;
+        line_tree_free(node->child[k]);
+        k++;
     }
-    else if (page >= (E->numrows - E->rows)) {
-        E->cy = E->numrows - 1;
-    }
-    else {
-        E->cy += E->rows;
+    memmove(node->child, &node->child[k],
+            sizeof(struct line_node *) * (node->n - k));
+    node->n -= k;
+
+    if (n > 0) {
+        struct line_node *first = node->child[0];
+
+        line_node_drop(first, n);
+        if (first->n < (first->leaf ? LINE_LEAF_MIN : LINE_NODE_MIN)) {
+            line_node_rebalance(node, 0);
+        }
     }
-    fix_position(E);
 }
 
 
-static JSValue js_page_down(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  Drop the first n rows of the tree, fewer than it has.
+ */
+static void line_tree_drop(struct line_node **root, int n)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    if (n <= 0) {
+        return;
     }
+    line_node_drop(*root, n);
 
-    page_down(s);
-    return JS_UNDEFINED;
+    while (!(*root)->leaf && (*root)->n == 1) {
+        struct line_node *top = *root;
+
+        *root = top->child[0];
+        free(top->child);
+        free(top);
+    }
 }
 
 
-static void utf8_fix_cx_position(struct editor_config *s)
+static struct line_node *line_leaf_lazy(struct text_block *b,
+        size_t offset, int n)
 {
-    unsigned char c = s->row_obj[s->cy].chars[s->cx];
+    struct line_node *leaf = malloc(sizeof(*leaf));
 
-    if (c < 128) {
-        return;
+    if (leaf == NULL) {
+        die("malloc");
     }
-    move_cursur_left(s);
+
+    leaf->leaf   = 1;
+    leaf->n      = n;
+    leaf->count  = n;
+    leaf->rows   = NULL;
+    leaf->block  = text_block_ref(b);
+    leaf->offset = offset;
+    return leaf;
 }
 
 
-static JSValue js_utf8_fix_cx_position(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  Stack leaves into a tree bottom-up. Inner nodes are left half full
+ *  so the first edits do not split them right away.
+ */
+struct line_node *line_tree_build(struct line_node **nodes, int n)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
-            js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
-    }
+    int fill = LINE_NODE_MAX / 2;
 
-    utf8_fix_cx_position(s);
-    return JS_UNDEFINED;
-}
+    while (n > 1) {
+        int parents = (n + fill - 1) / fill;
+        int k = 0;
 
+        for (int p = 0; p < parents; p++) {
+            struct line_node *node = line_node_new(0);
+            int take = (n - k) / (parents - p);
 
-static JSValue js_move_cursur_home(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
-{
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+            for (int i = 0; i < take; i++) {
+                node->child[i] = nodes[k + i];
+                node->count += nodes[k + i]->count;
+            }
+            node->n = take;
+            k += take;
+
+            nodes[p] = node;
+        }
+        n = parents;
     }
+    return (n == 1) ? nodes[0] : NULL;
+}
 
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    return JS_UNDEFINED;
+
+static erow *editor_row_at(struct editor_config *E, int at)
+{
+    return line_tree_get(E->lines, at);
 }
 
 
 /*
- *  Input
+ *  File index
  */
-int get_cursor_position(int *rows, int *cols) {
-    char buf[32];
-    unsigned int i = 0;
 
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
-        return -1;
-    }
 
-    while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
-            break;
-        }
-        if (buf[i] == 'R') {
-            break;
-        }
-        i++;
-    }
-    buf[i] = '\0';
+/*
+ *  Paths of the files under the working directory, walked once by
+ *  several threads, then kept fresh from inotify events on every
+ *  directory instead of asking find. A path the index lacks is still
+ *  looked up on disk: it may sit behind a symlink, which is not walked,
+ *  or in a directory over the watch limit. .git is not walked.
+ *
+ *  Watches come out of a limit shared by every process of the user, so
+ *  one index takes at most FILE_INDEX_WATCH_MAX of them; past that it
+ *  is walked again when used FILE_INDEX_STALE seconds later. An index
+ *  left unused for FILE_INDEX_IDLE seconds is freed with its watches.
+ */
+#define FILE_WALK_THREADS 8
+#define FILE_INDEX_EVENTS \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define FILE_INDEX_WATCH_MAX 1024
+#define FILE_INDEX_STALE 5
+#define FILE_INDEX_IDLE 120
+#define FILE_COMPLETE_MAX 64
+
+
+struct file_entry {
+    char *path;        // relative to the working directory, no "./"
+    const char *base;  // its last component
+    unsigned long hash;
+    struct file_entry *next;
+};
 
-    if (buf[0] != '\x1b' || buf[1] != '[') {
-        return -1;
+
+struct file_index {
+    int built;
+    int fd;          // inotify, -1 without it
+    struct file_entry **buckets;
+    int nbuckets;
+    int n;
+    char **dirs;     // directory of each watch descriptor, "" for "."
+    int ndirs;
+    int nwatch;
+    int partial;     // some directories went unwatched
+    time_t walked;
+    time_t used;
+    pthread_mutex_t lock;  // dirs and nwatch, while threads walk
+};
+
+
+static struct file_index files = {
+    .fd   = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static char *path_join(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir);
+    size_t nlen = strlen(name);
+    char *path = malloc(dlen + nlen + 2);
+
+    if (path == NULL) {
+        die("malloc");
     }
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) {
-        return -1;
+    if (dlen > 0) {
+        memcpy(path, dir, dlen);
+        path[dlen++] = '/';
     }
-    return 0;
+    memcpy(path + dlen, name, nlen + 1);
+    return path;
 }
 
 
-int get_window_size(int *rows, int *cols) {
-    struct winsize ws;
+static struct file_entry **file_index_slot(struct file_index *fi,
+        const char *path, unsigned long hash)
+{
+    struct file_entry **e = &fi->buckets[hash & (fi->nbuckets - 1)];
 
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1
-          || ws.ws_col == 0) {
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
-            return -1;
-        }
-        return get_cursor_position(rows, cols);
-    }
-    else {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
+    while (*e && ((*e)->hash != hash || strcmp((*e)->path, path) != 0)) {
+        e = &(*e)->next;
     }
+    return e;
 }
 
 
-int editor_read_key (void) {
-    int nread;
-    char c;
+static void file_index_grow(struct file_index *fi)
+{
+    int nbuckets = fi->nbuckets ? fi->nbuckets * 2 : 1024;
+    struct file_entry **buckets = calloc(nbuckets, sizeof(*buckets));
 
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) {
-            die("read");
-        }
+    if (buckets == NULL) {
+        die("calloc");
     }
+    for (int i = 0; i < fi->nbuckets; i++) {
+        struct file_entry *e = fi->buckets[i];
 
-    if (c == '\x1b') {
-        char seq[3];
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
-            return '\x1b';
-        }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
-            return '\x1b';
-        }
+        while (e) {
+            struct file_entry *next = e->next;
+            struct file_entry **slot = &buckets[e->hash & (nbuckets - 1)];
 
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-                    return '\x1b';
-                }
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            }
-            else {
-                switch (seq[1]) {
-                    /* Arrow Key */
-                    case 'A': // up
-                        return ARROW_UP;
-                    case 'B': // down
-                        return ARROW_DOWN;
-                    case 'C': // right
-                        return ARROW_RIGHT;
-                    case 'D': // left
-                        return ARROW_LEFT;
-                    case 'H':
-                        return HOME_KEY;
-                    case 'F':
-                        return END_KEY;
-                }
-            }
+            e->next = *slot;
+            *slot   = e;
+            e       = next;
         }
-        else if (seq[0] == '0') {
-            switch (seq[1]) {
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
-            }
-        }
-
-        return '\x1b';
-    }
-    else {
-        return c;
     }
+    free(fi->buckets);
+    fi->buckets  = buckets;
+    fi->nbuckets = nbuckets;
 }
 
 
-static JSValue js_editor_read_key(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  Add path, which the index owns from now on.
+ */
+static void file_index_add(struct file_index *fi, char *path)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    if (fi->n >= fi->nbuckets) {
+        file_index_grow(fi);
     }
 
-    return JS_NewInt32(ctx, editor_read_key());
-}
+    unsigned long hash = frame_hash(path, strlen(path));
+    struct file_entry **slot = file_index_slot(fi, path, hash);
 
+    if (*slot) {
+        free(path);
+        return;
+    }
 
-void editor_row_free(erow *row) {
-    free(row->render);
-    free(row->chars);
+    struct file_entry *e = malloc(sizeof(*e));
+    const char *base = strrchr(path, '/');
 
-    row->render = NULL;
-    row->chars = NULL;
+    if (e == NULL) {
+        die("malloc");
+    }
+    e->path = path;
+    e->base = base ? base + 1 : path;
+    e->hash = hash;
+    e->next = NULL;
+    *slot = e;
+    fi->n++;
 }
 
 
-void editor_row_delete(struct editor_config *E, int at) {
-    if (at < 0 || at >= E->numrows) {
+static void file_index_remove(struct file_index *fi, const char *path)
+{
+    if (fi->n == 0) {
         return;
     }
 
-    editor_row_free(&E->row_obj[at]);
+    struct file_entry **slot = file_index_slot(fi, path,
+            frame_hash(path, strlen(path)));
+    struct file_entry *e = *slot;
 
-    for (int j = at; j < E->numrows; j++) {
-        memmove(&(E->row_obj[j]),
-                &(E->row_obj[j + 1]),
-                sizeof(erow));
+    if (e) {
+        *slot = e->next;
+        free(e->path);
+        free(e);
+        fi->n--;
     }
-    E->numrows--;
-    E->changed++;
+}
 
-    erow *check = realloc(E->row_obj,
-            sizeof(erow) * E->numrows);
 
-    if (!check) {
-        return;
-    }
-    else {
-        E->row_obj = check;
-    }
+static int path_under(const char *path, const char *dir, size_t dlen)
+{
+    return strncmp(path, dir, dlen) == 0
+        && (path[dlen] == '/' || path[dlen] == '\0');
 }
 
 
-void editor_row_update(erow *row) {
-    int tabs = 0;
-    for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
-        }
-    }
+/*
+ *  Directory dir went away: forget the files in it and its watches.
+ */
+static void file_index_remove_dir(struct file_index *fi, const char *dir)
+{
+    size_t dlen = strlen(dir);
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (WOE_TAB - 1) + 1);
+    for (int i = 0; i < fi->nbuckets; i++) {
+        struct file_entry **slot = &fi->buckets[i];
 
-    int index = 0;
-    for (int j = 0; j < row->size; j++) {
-        char c = row->chars[j];
+        while (*slot) {
+            struct file_entry *e = *slot;
 
-        if (c == '\t') {
-            row->render[index++] = ' ';
-            while (index % WOE_TAB != 0) {
-                row->render[index++] = ' ';
+            if (path_under(e->path, dir, dlen)) {
+                *slot = e->next;
+                free(e->path);
+                free(e);
+                fi->n--;
+            }
+            else {
+                slot = &e->next;
             }
         }
-        else {
-            row->render[index++] = row->chars[j];
+    }
+    for (int wd = 0; wd < fi->ndirs; wd++) {
+        if (fi->dirs[wd] && path_under(fi->dirs[wd], dir, dlen)) {
+            inotify_rm_watch(fi->fd, wd);
+            free(fi->dirs[wd]);
+            fi->dirs[wd] = NULL;
         }
     }
-    row->render[index] = '\0';
-    row->rsize = index;
 }
 
 
-void editor_row_insert(struct editor_config *E,
-    int at, const char *s, size_t len)
+/*
+ *  Watch dir before reading it, so nothing made in between is missed.
+ */
+static void file_index_watch(struct file_index *fi, const char *dir)
 {
-    if (at < 0 || at > E->numrows) {
+    if (fi->fd == -1) {
         return;
     }
 
-    if (E->row_obj) {
-        erow *check = realloc(E->row_obj,
-                sizeof(erow) * (E->numrows + 1));
-
-        if (!check) {
-            return;
-        }
-        else {
-            E->row_obj = check;
-        }
+    pthread_mutex_lock(&fi->lock);
+    if (fi->nwatch >= FILE_INDEX_WATCH_MAX) {
+        fi->partial = 1;
+        pthread_mutex_unlock(&fi->lock);
+        return;
     }
-    else {
-        E->row_obj = realloc(E->row_obj, sizeof(erow) * (E->numrows + 1));
+    fi->nwatch++;
+    pthread_mutex_unlock(&fi->lock);
+
+    int wd = inotify_add_watch(fi->fd, dir[0] ? dir : ".",
+            FILE_INDEX_EVENTS);
+
+    pthread_mutex_lock(&fi->lock);
+    if (wd < 0) {
+        fi->nwatch--;
+        fi->partial = 1;
+        pthread_mutex_unlock(&fi->lock);
+        return;
     }
+    if (wd >= fi->ndirs) {
+        int ndirs = wd * 2 + 64;
 
-    if (E->cy != E->numrows) {
-        at = E->cy;
-        for (int i = E->numrows; i > E->cy; i--) {
-            memmove(&E->row_obj[i], &E->row_obj[i - 1], sizeof(erow));
+        fi->dirs = realloc(fi->dirs, ndirs * sizeof(*fi->dirs));
+        if (fi->dirs == NULL) {
+            die("realloc");
         }
+        memset(&fi->dirs[fi->ndirs], 0,
+                (ndirs - fi->ndirs) * sizeof(*fi->dirs));
+        fi->ndirs = ndirs;
     }
+    // the same directory again keeps the watch it has
+    if (fi->dirs[wd]) {
+        fi->nwatch--;
+    }
+    free(fi->dirs[wd]);
+    fi->dirs[wd] = strdup(dir);
+    pthread_mutex_unlock(&fi->lock);
+}
 
-    E->row_obj[at].size = len;
-    E->row_obj[at].chars = malloc(len + 1);
-    memcpy(E->row_obj[at].chars, s, len);
-    E->row_obj[at].chars[len] = '\0';
 
-    E->row_obj[at].rsize = 0;
-    E->row_obj[at].render = NULL;
-    editor_row_update(&E->row_obj[at]);
+/*
+ *  Directories wait in a shared stack; a walker takes one, reads it
+ *  and pushes the directories found in it. The walk is over when the
+ *  stack is empty and nobody is reading.
+ */
+struct file_walk {
+    struct file_index *index;
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    char **dirs;
+    int ndirs;
+    int dirs_cap;
+    int busy;
+    char **found;
+    int nfound;
+    int found_cap;
+};
 
-    E->numrows++;
-    E->changed++;
-}
 
-static JSValue js_editor_row_insert(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+static void file_walk_push(char ***list, int *n, int *cap, char *path)
 {
-    struct editor_config *s = JS_GetOpaque(this_val, js_vt100_class_id);
-
-    if (!s) {
-        return JS_EXCEPTION;
+    if (*n == *cap) {
+        *cap  = *cap ? *cap * 2 : 256;
+        *list = realloc(*list, *cap * sizeof(**list));
+        if (*list == NULL) {
+            die("realloc");
+        }
     }
-
-    int at, len;
-
-    JS_ToInt32(ctx, &at, argv[0]);
-    JS_ToInt32(ctx, &len, argv[2]);
-
-    const char *str = JS_ToCString(ctx, argv[1]);
-    editor_row_insert(s, at, str, len);
-    JS_FreeCString(ctx, str);
-    return JS_UNDEFINED;
+    (*list)[(*n)++] = path;
 }
 
 
-void editor_row_insert_char(struct editor_config *E,
-    erow *row, int at, int c)
+static void file_walk_dir(struct file_walk *w, char *dir)
 {
-    if (at < 0 || at > row->size) {
-        at = row->size;
-    }
+    char **sub = NULL, **found = NULL;
+    int nsub = 0, sub_cap = 0, nfound = 0, found_cap = 0;
 
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at],
-            row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editor_row_update(row);
+    file_index_watch(w->index, dir);
 
-    E->changed++;
-}
+    DIR *d = opendir(dir[0] ? dir : ".");
+    struct dirent *ent;
 
+    while (d && (ent = readdir(d)) != NULL) {
+        const char *name = ent->d_name;
+        int type = ent->d_type;
 
-void editor_row_append_string(struct editor_config *E,
-        erow *row, char *s, size_t len)
-{
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editor_row_update(row);
-    E->changed++;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+                || strcmp(name, ".git") == 0) {
+            continue;
+        }
+
+        char *path = path_join(dir, name);
+        struct stat st;
+
+        if (type == DT_UNKNOWN && lstat(path, &st) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+        if (type == DT_DIR) {
+            file_walk_push(&sub, &nsub, &sub_cap, path);
+        }
+        else {
+            file_walk_push(&found, &nfound, &found_cap, path);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    free(dir);
+
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < nsub; i++) {
+        file_walk_push(&w->dirs, &w->ndirs, &w->dirs_cap, sub[i]);
+    }
+    for (int i = 0; i < nfound; i++) {
+        file_walk_push(&w->found, &w->nfound, &w->found_cap, found[i]);
+    }
+    w->busy--;
+    pthread_cond_broadcast(&w->more);
+    pthread_mutex_unlock(&w->lock);
+
+    free(sub);
+    free(found);
 }
 
 
-void editor_row_delete_char(struct editor_config *E,
-        erow *row, int at)
+static void *file_walk_run(void *arg)
 {
-    if (at < 0 || at >= row->size) {
-        return;
+    struct file_walk *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->ndirs == 0 && w->busy > 0) {
+            pthread_cond_wait(&w->more, &w->lock);
+        }
+        if (w->ndirs == 0) {
+            break;
+        }
+
+        char *dir = w->dirs[--w->ndirs];
+
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+        file_walk_dir(w, dir);
+        pthread_mutex_lock(&w->lock);
     }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
 
-    char c = row->chars[at];
-    unsigned char cc = c;
-    int remove_len = 1;
+/*
+ *  Walk the tree at root with up to threads walkers, indexing its
+ *  files and watching its directories.
+ */
+static void file_walk(struct file_index *fi, const char *root, int threads)
+{
+    struct file_walk w = {
+        .index = fi,
+        .lock  = PTHREAD_MUTEX_INITIALIZER,
+        .more  = PTHREAD_COND_INITIALIZER,
+    };
+    pthread_t tid[FILE_WALK_THREADS];
+    int started = 0;
+
+    file_walk_push(&w.dirs, &w.ndirs, &w.dirs_cap, strdup(root));
+
+    for (int i = 1; i < threads && i < FILE_WALK_THREADS; i++) {
+        if (pthread_create(&tid[started], NULL, file_walk_run, &w) == 0) {
+            started++;
+        }
+    }
+    file_walk_run(&w);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tid[i], NULL);
+    }
 
-    if (cc < 192) {
-        remove_len = 1;
+    for (int i = 0; i < w.nfound; i++) {
+        file_index_add(fi, w.found[i]);
     }
-    else if (cc < 224 && cc > 192) {
-        remove_len = 2;
+    free(w.found);
+    free(w.dirs);
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.more);
+}
+
+
+static void file_index_free(struct file_index *fi)
+{
+    for (int i = 0; i < fi->nbuckets; i++) {
+        struct file_entry *e = fi->buckets[i];
+
+        while (e) {
+            struct file_entry *next = e->next;
+
+            free(e->path);
+            free(e);
+            e = next;
+        }
     }
-    else if (cc < 240 && cc > 224) {
-        remove_len = 3;
+    for (int i = 0; i < fi->ndirs; i++) {
+        free(fi->dirs[i]);
     }
-    else if (cc > 240) {
-        remove_len = 4;
+    if (fi->fd != -1) {
+        close(fi->fd);
     }
+    free(fi->buckets);
+    free(fi->dirs);
+    fi->buckets  = NULL;
+    fi->nbuckets = 0;
+    fi->n        = 0;
+    fi->dirs     = NULL;
+    fi->ndirs    = 0;
+    fi->nwatch   = 0;
+    fi->partial  = 0;
+    fi->fd       = -1;
+    fi->built    = 0;
+}
 
-    memmove(&row->chars[at], &row->chars[at + remove_len],
-            row->size - at - (remove_len - 1));
-    row->size = (row->size - remove_len) > 0 ?
-        (row->size - remove_len) : 0;
 
-    editor_row_update(row);
-    E->changed++;
+static void file_index_build(struct file_index *fi)
+{
+    fi->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    file_walk(fi, "", FILE_WALK_THREADS);
+    fi->built  = 1;
+    fi->walked = time(NULL);
 }
 
 
-void c_delete_char(struct editor_config *E)
+/*
+ *  Apply what inotify reported since the last look. When its queue
+ *  overflowed, events were lost and the tree is walked again.
+ */
+static void file_index_sync(struct file_index *fi)
 {
-    if (E->cy == E->numrows) {
-        return;
-    }
-    if (E->cx == 0 && E->cy == 0) {
-        return;
+    char buf[64 << 10]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while (fi->fd != -1 && (len = read(fi->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                file_index_free(fi);
+                file_index_build(fi);
+                return;
+            }
+            if (ev->wd < 0 || ev->wd >= fi->ndirs
+                    || fi->dirs[ev->wd] == NULL) {
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                free(fi->dirs[ev->wd]);
+                fi->dirs[ev->wd] = NULL;
+                fi->nwatch--;
+                continue;
+            }
+            if (ev->len == 0) {
+                continue;
+            }
+
+            char *path = path_join(fi->dirs[ev->wd], ev->name);
+
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                if (ev->mask & IN_ISDIR) {
+                    file_walk(fi, path, 1);
+                    free(path);
+                }
+                else {
+                    file_index_add(fi, path);
+                }
+            }
+            else {
+                if (ev->mask & IN_ISDIR) {
+                    file_index_remove_dir(fi, path);
+                }
+                else {
+                    file_index_remove(fi, path);
+                }
+                free(path);
+            }
+        }
     }
+}
 
-    erow *row = &E->row_obj[E->cy];
-    if (E->cx > 0) {
-        move_cursur_left(E);
-        editor_row_delete_char(E, row, E->cx);
+
+/*
+ *  The index, built on first use and brought up to date on every use;
+ *  one that could not watch everything is walked again once stale.
+ */
+static struct file_index *file_index_get(void)
+{
+    time_t now = time(NULL);
+
+    if (files.built && files.partial
+            && now - files.walked >= FILE_INDEX_STALE) {
+        file_index_free(&files);
+    }
+    if (!files.built) {
+        file_index_build(&files);
     }
     else {
-        E->cx = E->row_obj[E->cy - 1].size;
-        editor_row_append_string(E,
-                &E->row_obj[E->cy - 1],
-                row->chars,
-                row->size);
-        editor_row_delete(E, E->cy);
-        E->cy--;
-        utf8_fix_cx_position(E);
+        file_index_sync(&files);
     }
+    files.used = now;
+    return &files;
 }
 
 
-static JSValue js_delete_char(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  Give the watches back when the index has not been used for a while,
+ *  the next use walks the tree again.
+ */
+static void file_index_idle(void)
 {
-    struct editor_config *s = JS_GetOpaque(this_val, js_vt100_class_id);
+    if (files.built && time(NULL) - files.used >= FILE_INDEX_IDLE) {
+        file_index_free(&files);
+    }
+}
 
-    if (!s) {
-        return JS_EXCEPTION;
+
+/*
+ *  Path as the index keeps it, or NULL when it can not be inside the
+ *  working directory.
+ */
+static const char *file_index_key(const char *path)
+{
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+        while (*path == '/') {
+            path++;
+        }
     }
-    c_delete_char(s);
-    return JS_UNDEFINED;
+    if (path[0] == '/' || path[0] == '\0' || strstr(path, "..")) {
+        return NULL;
+    }
+    return path;
 }
 
 
-void c_insert_char(struct editor_config *s,
-        int c)
+static int file_exists(const char *path)
 {
-    if (s->cy == s->numrows) {
-        editor_row_insert(s, s->numrows, "", 0);
+    const char *key = file_index_key(path);
+
+    if (key) {
+        struct file_index *fi = file_index_get();
+
+        if (fi->n > 0 && *file_index_slot(fi, key,
+                    frame_hash(key, strlen(key))) != NULL) {
+            return 1;
+        }
     }
-    editor_row_insert_char(s, &s->row_obj[s->cy], s->cx, c);
-    s->cx++;
+    return access(path, F_OK) == 0;
 }
 
 
-static JSValue js_insert_char(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+/*
+ *  How well query matches text as letters in order, -1 when it does
+ *  not. Letters that start a word or follow the last one count more,
+ *  skipped letters count less.
+ */
+static int file_fuzzy_align(const char *query, const char *text)
 {
-    struct editor_config *s = JS_GetOpaque(this_val, js_vt100_class_id);
+    const char *p = text;
+    int score = 0;
+    int run = 0;
 
-    int v;
+    for (const char *q = query; *q; q++) {
+        const char *from = p;
 
-    if (!s) {
-        return JS_EXCEPTION;
+        while (*p && tolower((unsigned char) *p)
+                != tolower((unsigned char) *q)) {
+            p++;
+        }
+        if (*p == '\0') {
+            return -1;
+        }
+
+        if (p == text || strchr("/_-. ", p[-1])) {
+            score += 8;
+        }
+        if (p == from && q != query) {
+            run++;
+            score += 4 + run;
+        }
+        else {
+            run = 0;
+            score -= p - from < 8 ? p - from : 8;
+        }
+        p++;
     }
-    if (JS_ToInt32(ctx, &v, argv[0])) {
-        return JS_EXCEPTION;
+    return score;
+}
+
+
+/*
+ *  Score of path for query, the better of matching the whole path and
+ *  matching only the file name, which is worth more; shorter paths win
+ *  a tie.
+ */
+static long file_fuzzy_score(const char *query, struct file_entry *e)
+{
+    int whole = file_fuzzy_align(query, e->path);
+
+    if (whole < 0) {
+        return -1;
     }
-    c_insert_char(s, v);
-    return JS_UNDEFINED;
+
+    int base  = file_fuzzy_align(query, e->base);
+    int score = base >= 0 && base + 16 > whole ? base + 16 : whole;
+    size_t len = strlen(e->path);
+
+    return (long) (score + 1024) * 256 - (len < 255 ? len : 255);
 }
 
 
-void c_insert_newline(struct editor_config *E)
+/*
+ *  The n best matches of query, best first, in out; returns how many.
+ */
+static int file_complete(const char *query, struct file_entry **out, int n)
 {
-    if (E->cx == 0) {
-        E->cx = 0;
-        editor_row_insert(E, E->cy, "", 0);
-        E->cy++;
+    struct file_index *fi = file_index_get();
+    long score[FILE_COMPLETE_MAX];
+    int got = 0;
+
+    if (n <= 0) {
+        return 0;
+    }
+    if (n > FILE_COMPLETE_MAX) {
+        n = FILE_COMPLETE_MAX;
     }
-    else {
-        if (&E->row_obj[E->cy]) {
-            erow *row = &E->row_obj[E->cy];
 
-            if (E->cx >= row->size) {
-                E->cy++;
-                editor_row_insert(E, E->cy, "", 0);
-                E->cx = 0;
-            }
-            else {
-                int cx = E->cx;
-                int size = row->size;
-
-                char *car = malloc(sizeof(char) * cx + 1);
-                memcpy(car, &row->chars[0], cx);
-                car[cx + 1] = '\0';
-
-                char *cdr = malloc(sizeof(char) * size - cx + 1);
-                memcpy(cdr, &row->chars[cx], size - cx);
-                cdr[size - cx + 1] = '\0';
-
-                if (E->cy == 0) {
-                    editor_row_insert(E,
-                            E->cy,
-                            car,
-                            cx);
-                    E->cy++;
-
-                    editor_row_insert(E,
-                            E->cy,
-                            cdr,
-                            size - cx);
-                    editor_row_delete(E, E->cy + 1);
-                }
-                else {
-                    editor_row_insert(E,
-                            E->cy + 1,
-                            cdr,
-                            size - cx);
-
-                    editor_row_insert(E,
-                            E->cy,
-                            car,
-                            cx);
-                    editor_row_delete(E, E->cy + 2);
-
-                    E->cy++;
-                }
-                E->cx = 0;
+    for (int i = 0; i < fi->nbuckets; i++) {
+        for (struct file_entry *e = fi->buckets[i]; e; e = e->next) {
+            long sc = file_fuzzy_score(query, e);
+            int at = got;
 
-                free(car);
-                free(cdr);
+            if (sc < 0 || (got == n && sc <= score[n - 1])) {
+                continue;
+            }
+            while (at > 0 && score[at - 1] < sc) {
+                at--;
+            }
+            if (got < n) {
+                got++;
             }
+            memmove(&score[at + 1], &score[at],
+                    (got - 1 - at) * sizeof(*score));
+            memmove(&out[at + 1], &out[at], (got - 1 - at) * sizeof(*out));
+            score[at] = sc;
+            out[at]   = e;
         }
     }
+    return got;
 }
 
 
-static JSValue js_insert_newline(JSContext *ctx,
+/*
+ *  Completion for editor_prompt: the k-th best file for query.
+ */
+static char *prompt_complete_file(struct editor_config *E,
+        const char *query, int k)
+{
+    struct file_entry *match[FILE_COMPLETE_MAX];
+
+    if (k >= FILE_COMPLETE_MAX || file_complete(query, match, k + 1) <= k) {
+        return NULL;
+    }
+    return strdup(match[k]->path);
+}
+
+
+/*
+ *  terminal.file_exists(path), without running find.
+ */
+static JSValue js_file_exists(JSContext *ctx,
         JSValueConst this_val,
         int argc, JSValueConst *argv)
 {
-    struct editor_config *s = JS_GetOpaque(this_val, js_vt100_class_id);
+    const char *path = JS_ToCString(ctx, argv[0]);
 
-    if (!s) {
+    if (path == NULL) {
         return JS_EXCEPTION;
     }
-    c_insert_newline(s);
-    return JS_UNDEFINED;
+
+    int exists = file_exists(path);
+
+    JS_FreeCString(ctx, path);
+    return JS_NewBool(ctx, exists);
 }
 
 
-static JSValue js_mode_get(JSContext *ctx,
-        JSValue val)
+/*
+ *  terminal.file_find(name): paths of the files called name, like
+ *  find . -name name.
+ */
+static JSValue js_file_find(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
 {
-    struct editor_config *s = JS_GetOpaque(val, js_vt100_class_id);
+    const char *name = JS_ToCString(ctx, argv[0]);
 
-    if (!s) {
+    if (name == NULL) {
         return JS_EXCEPTION;
     }
-    return JS_NewInt32(ctx, s->mode);
+
+    struct file_index *fi = file_index_get();
+    JSValue list = JS_NewArray(ctx);
+    uint32_t n = 0;
+
+    for (int i = 0; i < fi->nbuckets; i++) {
+        for (struct file_entry *e = fi->buckets[i]; e; e = e->next) {
+            if (strcmp(e->base, name) == 0) {
+                JS_SetPropertyUint32(ctx, list, n++,
+                        JS_NewString(ctx, e->path));
+            }
+        }
+    }
+    JS_FreeCString(ctx, name);
+    return list;
 }
 
 
-static JSValue js_mode_set(JSContext *ctx, JSValueConst this_val,
-        JSValue val)
+/*
+ *  terminal.file_complete(query, n): up to n paths matching query,
+ *  best first.
+ */
+static JSValue js_file_complete(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx,
-            this_val, js_vt100_class_id);
+    struct file_entry *match[FILE_COMPLETE_MAX];
+    int n = 10;
 
-    int v;
-    if (!s) {
+    if (argc > 1 && JS_ToInt32(ctx, &n, argv[1])) {
         return JS_EXCEPTION;
     }
-    if (JS_ToInt32(ctx, &v, val)) {
+
+    const char *query = JS_ToCString(ctx, argv[0]);
+
+    if (query == NULL) {
         return JS_EXCEPTION;
     }
-    s->mode = v;
+
+    int got = file_complete(query, match, n);
+    JSValue list = JS_NewArray(ctx);
+
+    for (int i = 0; i < got; i++) {
+        JS_SetPropertyUint32(ctx, list, i, JS_NewString(ctx, match[i]->path));
+    }
+    JS_FreeCString(ctx, query);
+    return list;
+}
+
+
+/*
+ *  terminal.file_index_idle(): call now and then, e.g. every second.
+ */
+static JSValue js_file_index_idle(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    file_index_idle();
     return JS_UNDEFINED;
 }
 
 
-static JSValue js_editor_config_attr_get(JSContext *ctx,
-        JSValue val,
-        int magic)
+/*
+ *  File i/o
+ */
+
+
+/*
+ *  Files at least this big are scanned for newlines by several threads.
+ */
+#define LINE_SCAN_SPLIT   (32 << 20)
+#define LINE_SCAN_THREADS 8
+
+
+/*
+ *  One thread's share of the newline scan: base[from..to) starts at a
+ *  line start and ends right after a newline or at the end of file. It
+ *  cuts its lines into lazy leaves of LINE_LEAF_LAZY lines.
+ */
+struct line_scan {
+    const char *base;
+    size_t from;
+    size_t to;
+    size_t *starts;
+    int *counts;
+    int n;
+    int cap;
+};
+
+
+static void line_scan_emit(struct line_scan *sc, size_t start, int count)
 {
-    struct editor_config *s = JS_GetOpaque(val, js_vt100_class_id);
-    JSValue v;
+    if (sc->n == sc->cap) {
+        sc->cap = sc->cap ? sc->cap * 2 : 1024;
+        sc->starts = realloc(sc->starts, sizeof(size_t) * sc->cap);
+        sc->counts = realloc(sc->counts, sizeof(int) * sc->cap);
 
-    if (!s) {
-        return JS_EXCEPTION;
+        if (sc->starts == NULL || sc->counts == NULL) {
+            die("realloc");
+        }
     }
 
-    switch (magic) {
-        case 0:
-            v = JS_NewInt32(ctx, s->cx);
-            break;
-        case 1:
-            v = JS_NewInt32(ctx, s->cy);
-            break;
-        case 2:
-            v = JS_NewInt32(ctx, s->rx);
-            break;
-        case 3:
-            v = JS_NewInt32(ctx, s->rows);
-            break;
-        case 4:
-            v = JS_NewInt32(ctx, s->cols);
-            break;
-        case 5:
+    sc->starts[sc->n] = start;
+    sc->counts[sc->n] = count;
+    sc->n++;
+}
+
+
+static void *line_scan_run(void *arg)
+{
+    struct line_scan *sc = arg;
+    const char *p = sc->base;
+    size_t start = sc->from;
+    size_t line = sc->from;  // start of the current line
+    size_t i = sc->from;
+    int count = 0;
+
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    for (; i + 16 <= sc->to; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (p + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+
+        if (mask) {
+            line = i + (31 - __builtin_clz(mask)) + 1;
+        }
+
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            if (++count == LINE_LEAF_LAZY) {
+                line_scan_emit(sc, start, count);
+                start = pos + 1;
+                count = 0;
+            }
+        }
+    }
+#endif
+
+    for (; i < sc->to; i++) {
+        if (p[i] != '\n') {
+            continue;
+        }
+
+        line = i + 1;
+        if (++count == LINE_LEAF_LAZY) {
+            line_scan_emit(sc, start, count);
+            start = i + 1;
+            count = 0;
+        }
+    }
+
+    // last line without a newline
+    if (line < sc->to) {
+        count++;
+    }
+    if (count > 0) {
+        line_scan_emit(sc, start, count);
+    }
+    return NULL;
+}
+
+
+/*
+ *  Index a mapped file as a tree of lazy leaves. Nothing but the leaf
+ *  offsets is kept, the rows themselves are made on first use.
+ */
+static struct line_node *line_index_build(struct text_block *b)
+{
+    struct line_scan sc[LINE_SCAN_THREADS];
+    pthread_t tid[LINE_SCAN_THREADS];
+    int started[LINE_SCAN_THREADS];
+    int workers = 1;
+
+    if (b->len >= LINE_SCAN_SPLIT) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers < 1) {
+            workers = 1;
+        }
+        if (workers > LINE_SCAN_THREADS) {
+            workers = LINE_SCAN_THREADS;
+        }
+    }
+
+    size_t from = 0;
+
+    for (int w = 0; w < workers; w++) {
+        size_t to = b->len;
+
+        if (w != workers - 1) {
+            to = b->len / workers * (w + 1);
+            if (to < from) {
+                to = from;
+            }
+
+            char *nl = memchr(b->base + to, '\n', b->len - to);
+            to = nl ? (size_t) (nl - b->base) + 1 : b->len;
+        }
+
+        memset(&sc[w], 0, sizeof(sc[w]));
+        sc[w].base = b->base;
+        sc[w].from = from;
+        sc[w].to   = to;
+        from = to;
+    }
+
+    for (int w = 1; w < workers; w++) {
+        started[w] = pthread_create(&tid[w], NULL,
+                line_scan_run, &sc[w]) == 0;
+        if (!started[w]) {
+            line_scan_run(&sc[w]);
+        }
+    }
+    line_scan_run(&sc[0]);
+
+    int total = 0;
+
+    for (int w = 0; w < workers; w++) {
+        if (w > 0 && started[w]) {
+            pthread_join(tid[w], NULL);
+        }
+        total += sc[w].n;
+    }
+
+    struct line_node **nodes = malloc(sizeof(struct line_node *) * (total + 1));
+    int k = 0;
+
+    if (nodes == NULL) {
+        die("malloc");
+    }
+
+    for (int w = 0; w < workers; w++) {
+        for (int i = 0; i < sc[w].n; i++) {
+            nodes[k++] = line_leaf_lazy(b, sc[w].starts[i], sc[w].counts[i]);
+        }
+        free(sc[w].starts);
+        free(sc[w].counts);
+    }
+
+    struct line_node *root = line_tree_build(nodes, total);
+
+    free(nodes);
+    return root;
+}
+
+
+static void file_read_rows(struct editor_config *E, FILE *fp)
+{
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+
+    while ((line_len = getline(&line, &line_cap, fp)) != -1) {
+        while (line_len > 0 && (line[line_len - 1] == '\n' ||
+                                line[line_len - 1] == '\r')) {
+            line_len--;
+        }
+
+        editor_row_insert(E, E->numrows, line, line_len);
+    }
+
+    free(line);
+}
+
+
+/*
+ *  Map bytes from..size of fd as a block; the mapping starts on the
+ *  page holding from, *offset is where from is in it.
+ */
+static struct text_block *file_map_from(int fd, off_t from, off_t size,
+        size_t *offset)
+{
+    off_t page = from - from % sysconf(_SC_PAGESIZE);
+    void *map = mmap(NULL, size - page, PROT_READ, MAP_PRIVATE, fd, page);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    *offset = from - page;
+    return text_block_new(map, size - page, 1);
+}
+
+
+/*
+ *  Read bytes from..size of fd into a block of its own. A followed file
+ *  grows by small pieces all day, each would otherwise cost a mapping.
+ */
+static struct text_block *file_read_from(int fd, off_t from, off_t size,
+        size_t *offset)
+{
+    size_t len = size - from;
+    char *buf = malloc(len ? len : 1);
+
+    if (buf == NULL) {
+        die("malloc");
+    }
+    for (size_t got = 0; got < len; ) {
+        ssize_t r = pread(fd, buf + got, len - got, from + got);
+
+        if (r <= 0) {
+            free(buf);
+            return NULL;
+        }
+        got += r;
+    }
+    *offset = 0;
+    return text_block_new(buf, len, 0);
+}
+
+
+/*
+ *  A followed file is read rather than mapped: a log rotated by
+ *  truncating it in place would cut the mapping short under its rows.
+ */
+static struct text_block *file_block_from(struct editor_config *E, int fd,
+        off_t from, off_t size, size_t *offset)
+{
+    return E->follow
+        ? file_read_from(fd, from, size, offset)
+        : file_map_from(fd, from, size, offset);
+}
+
+
+/*
+ *  Regular files are mapped read-only and only indexed here; their rows
+ *  borrow the mapping once they are scrolled into view. Anything that
+ *  cannot be mapped (pipes, empty files) is still read line by line.
+ *  Returns -1 with the buffer as it was when filename cannot be read.
+ */
+int file_open(struct editor_config *E, const char *filename)
+{
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        close(fd);
+        fd    = -1;
+        errno = EISDIR;
+    }
+    if (fd == -1) {
+        c_echo_status_message(E, "open %s failed: %s",
+                filename, strerror(errno));
+        return -1;
+    }
+
+    free(E->filename);
+    E->filename = strdup(filename);
+
+    line_tree_free(E->lines);
+    undo_clear(E);
+    journal_drop(E);
+    E->lines   = NULL;
+    E->numrows = 0;
+    E->mapped  = 0;
+    E->follow_dropped = 0;
+
+    struct text_block *b = NULL;
+    size_t offset;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        b = file_block_from(E, fd, 0, st.st_size, &offset);
+    }
+
+    if (b != NULL) {
+        text_block_ref(b);
+        E->lines   = line_index_build(b);
+        E->numrows = E->lines ? E->lines->count : 0;
+        E->mapped  = b->mapped;
+        text_block_unref(b);
+
+        file_stamp_take(&E->disk, fd);
+        close(fd);
+    }
+    else {
+        FILE *fp = fdopen(fd, "r");
+
+        if (!fp) {
+            die("fdopen");
+        }
+        file_read_rows(E, fp);
+        file_stamp_take(&E->disk, fd);
+        fclose(fp);
+    }
+
+    E->cy = 0;
+    E->changed = 0;
+    file_watch(E);
+    journal_check(E);
+    return 0;
+}
+
+
+/*
+ *  Open filename again, keeping the cursor and the view where they are.
+ */
+static void file_remap(struct editor_config *E)
+{
+    int cx         = E->cx;
+    int cy         = E->cy;
+    int row_offset = E->row_offset;
+    int col_offset = E->col_offset;
+    char *filename = strdup(E->filename);
+    struct undo_log *undo = E->undo;
+
+    // the history holds no views of the mapping, it outlives it
+    E->undo = NULL;
+    int ok = file_open(E, filename) == 0;
+    free(filename);
+
+    E->undo       = undo;
+    if (!ok) {
+        return;
+    }
+
+    E->cx         = cx;
+    E->cy         = cy;
+    E->row_offset = row_offset;
+    E->col_offset = col_offset;
+}
+
+
+static JSValue js_file_open(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    JSValue v;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    const char *str = JS_ToCString(ctx, argv[0]);
+
+    if (str == NULL) {
+        return JS_EXCEPTION;
+    }
+    v = JS_NewBool(ctx, file_open(s, str) == 0);
+    JS_FreeCString(ctx, str);
+    return v;
+}
+
+
+void file_close(struct editor_config *E) {
+    save_wait(E);
+
+    // edits given up on leave no swap file behind
+    if (E->filename) {
+        char *swap = file_side_path(E->filename, "swp");
+
+        unlink(swap);
+        free(swap);
+    }
+
+    line_tree_free(E->lines);
+    undo_clear(E);
+    journal_drop(E);
+    text_block_unref(E->add);
+    free(E->filename);
+    E->filename = NULL;
+
+    E->cx              = 0;
+    E->cy              = 0;
+    E->rx              = 0;
+    E->numrows         = 0;
+    E->number_command  = 0;
+    E->row_offset      = 0;
+    E->col_offset      = 0;
+    E->lines           = NULL;
+    E->add             = NULL;
+    E->add_cap         = 0;
+    E->search_y        = -1;
+    E->search_x        = -1;
+    E->mapped          = 0;
+    E->changed         = 0;
+    E->status_msg[0]   = '\0';
+    E->status_msg_time = 0;
+    E->follow          = 0;
+    E->follow_dropped  = 0;
+    E->swap_changed    = 0;
+    memset(&E->disk, 0, sizeof(E->disk));
+}
+
+
+static JSValue js_file_close(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    buffer_close(s);
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  Copy rows from..to-1, each with its newline, to buf, or only count
+ *  the bytes when buf is NULL. Lazy leaves are read straight from their
+ *  block so saving does not load the whole file as rows.
+ */
+static size_t editor_rows_copy(struct editor_config *E,
+        int from, int to, char *buf)
+{
+    size_t total_len = 0;
+    int index;
+
+    for (int j = from; j < to; j += index) {
+        struct line_node *leaf = line_tree_peek(E->lines, j, &index);
+        int last = leaf->n - index < to - j ? leaf->n : index + to - j;
+
+        if (leaf->rows) {
+            for (int i = index; i < last; i++) {
+                erow *row = &leaf->rows[i];
+
+                for (int k = 0; buf && k < erow_nspans(row); k++) {
+                    int len;
+                    char *p = erow_span(row, k, &len);
+
+                    memcpy(&buf[total_len], p, len);
+                    total_len += len;
+                }
+                if (buf) {
+                    buf[total_len] = '\n';
+                    total_len++;
+                }
+                else {
+                    total_len += row->size + 1;
+                }
+            }
+        }
+        else {
+            char *line = leaf->block->base + leaf->offset;
+            char *end  = leaf->block->base + leaf->block->len;
+            int len;
+
+            for (int i = 0; i < index; i++) {
+                line = line_next(line, end, &len);
+            }
+            for (int i = index; i < last; i++) {
+                char *next = line_next(line, end, &len);
+
+                if (buf) {
+                    memcpy(&buf[total_len], line, len);
+                    buf[total_len + len] = '\n';
+                }
+                total_len += len + 1;
+                line = next;
+            }
+        }
+        index = last - index;
+    }
+    return total_len;
+}
+
+
+/*
+ *  Read a line on the message bar. callback, when given, sees the
+ *  buffer after every key, e.g. to search as the user types.
+ */
+static char *editor_prompt(struct editor_config *E,
+        const char *prompt,
+        void (*callback)(struct editor_config *, char *, int),
+        char *(*complete)(struct editor_config *, const char *, int))
+{
+    size_t buf_size = 128;
+    char *buf = malloc(buf_size);
+    char *query = NULL;  // what Tab completes, while Tab is pressed
+    int tab = 0;
+
+    size_t buf_len = 0;
+    buf[0] = '\0';
+
+    while (1) {
+        c_echo_status_message(E, prompt, buf);
+        editor_scroll(E);
+        editor_refresh_screen(E, NULL);
+
+        int c = editor_read_key();
+
+        if (c == '\t' && complete) {
+            if (query == NULL) {
+                query = strdup(buf);
+                tab   = 0;
+            }
+
+            char *match = complete(E, query, tab++);
+
+            if (match == NULL && tab > 1) {
+                tab   = 0;
+                match = complete(E, query, tab++);
+            }
+            if (match) {
+                buf_len = strlen(match);
+                if (buf_len >= buf_size) {
+                    buf_size = buf_len + 1;
+                    buf = realloc(buf, buf_size);
+                }
+                memcpy(buf, match, buf_len + 1);
+                free(match);
+            }
+            continue;
+        }
+        free(query);
+        query = NULL;
+
+        if (c == DEL_KEY || c == CTRL_('h') || c == BACKSPACE) {
+            if (buf_len != 0) {
+                buf_len--;
+                buf[buf_len] = '\0';
+            }
+        }
+        else if (c == '\x1b') {
+            c_echo_status_message(E, "");
+            if (callback) {
+                callback(E, buf, c);
+            }
+            free(buf);
+            return NULL;
+        }
+        else if (c == '\r') {
+            if (buf_len != 0) {
+                c_echo_status_message(E, "");
+                if (callback) {
+                    callback(E, buf, c);
+                }
+                return buf;
+            }
+        }
+        else if (!iscntrl(c) && c < 128) {
+            if (buf_len == buf_size - 1) {
+                buf_size *= 2;
+                buf = realloc(buf, buf_size);
+            }
+            buf[buf_len++] = c;
+            buf[buf_len] = '\0';
+        }
+
+        if (callback) {
+            callback(E, buf, c);
+        }
+    }
+}
+
+
+static JSValue js_editor_prompt(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    JSValue v;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    const char *str = JS_ToCString(ctx, argv[0]);
+    int files = argc > 1 && JS_ToBool(ctx, argv[1]);
+
+    char *result = editor_prompt(s, str, NULL,
+            files ? prompt_complete_file : NULL);
+
+    if (result != NULL) {
+        v = JS_NewString(ctx, result);
+    }
+    else {
+        v = JS_UNDEFINED;
+    }
+
+    free(result);
+    JS_FreeCString(ctx, str);
+
+    return v;
+}
+
+/*
+ *  Saving takes a snapshot of the rows, small enough to take between
+ *  two keys, and a thread writes it out while editing goes on. The
+ *  text goes with writev straight from where it lives, a batch of
+ *  spans at a time, into a new file next to the old one that is then
+ *  renamed over it, so a crash halfway leaves the old file as it was.
+ *  The thread wakes the editor through save_fd to show how far it got
+ *  and when it is done. Autosave writes the same way to a swap file.
+ */
+#define SAVE_IOV 256
+#define SAVE_STEP 5  // percent between progress reports
+
+
+/*
+ *  Lines of a block the snapshot holds on to: n lines read from p on,
+ *  or, with n 0, one row of len bytes at p. Bytes up to end never
+ *  change, even in the add buffer that keeps growing behind them.
+ */
+struct save_piece {
+    struct text_block *block;  // NULL for text the job copied
+    const char *p;
+    const char *end;
+    const char *next;  // after the last of n lines, NULL when not known
+    int n;
+    int len;
+};
+
+
+struct save_job {
+    pthread_t thread;
+    int threaded;
+    struct save_piece *pieces;
+    int npieces;
+    int cap;
+    char *own;  // copies of the rows being edited
+    size_t own_len;
+    size_t own_cap;
+    char *filename;  // of the buffer
+    char *target;    // what is written, the file or its swap file
+    int swap;
+    int fsync;
+    mode_t mode;
+    int changed;  // E->changed when the snapshot was taken
+    size_t journal_mark;  // journal bytes the snapshot holds
+    int rows;
+    int rows_done;  // written by the thread
+    int percent;    // last reported, read by the editor
+    int finished;
+    int fd;   // the new file once finished, -1 when it failed
+    int err;
+    int event_fd;
+};
+
+
+struct save_out {
+    struct save_job *job;
+    int fd;
+    int n;
+    struct iovec iov[SAVE_IOV];
+};
+
+
+static void save_notify(struct save_job *job)
+{
+    uint64_t one = 1;
+    ssize_t r = write(job->event_fd, &one, sizeof(one));
+
+    (void) r;
+}
+
+
+static int save_flush(struct save_out *o)
+{
+    struct iovec *iov = o->iov;
+    int n = o->n;
+
+    while (n > 0) {
+        ssize_t w = writev(o->fd, iov, n);
+
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        // a short write goes on where it stopped
+        while (n > 0 && (size_t) w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    o->n = 0;
+    return 0;
+}
+
+
+static int save_span(struct save_out *o, const char *p, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+
+    // lines that follow each other in the file go out as one span
+    if (o->n > 0) {
+        struct iovec *last = &o->iov[o->n - 1];
+
+        if ((char *) last->iov_base + last->iov_len == p) {
+            last->iov_len += len;
+            return 0;
+        }
+    }
+    if (o->n == SAVE_IOV && save_flush(o) == -1) {
+        return -1;
+    }
+
+    o->iov[o->n].iov_base = (char *) p;
+    o->iov[o->n].iov_len  = len;
+    o->n++;
+    return 0;
+}
+
+
+/*
+ *  A line and its newline, taking the newline from after the text
+ *  when it is there, before end.
+ */
+static int save_line(struct save_out *o, const char *p, int len,
+        const char *end)
+{
+    if (p && p + len < end && p[len] == '\n') {
+        return save_span(o, p, len + 1);
+    }
+    if (save_span(o, p, len) == -1) {
+        return -1;
+    }
+    return save_span(o, "\n", 1);
+}
+
+
+static struct save_piece *save_piece_add(struct save_job *job)
+{
+    if (job->npieces == job->cap) {
+        job->cap = job->cap ? job->cap * 2 : 256;
+        job->pieces = realloc(job->pieces,
+                sizeof(struct save_piece) * job->cap);
+        if (job->pieces == NULL) {
+            die("realloc");
+        }
+    }
+    return &job->pieces[job->npieces++];
+}
+
+
+/*
+ *  A row being edited changes in place: copy it. Its offset in own
+ *  stands in for p until the snapshot is complete.
+ */
+static void save_snapshot_copy(struct save_job *job, erow *row)
+{
+    if (job->own_len + row->size > job->own_cap) {
+        job->own_cap = (job->own_len + row->size) * 2;
+        job->own = realloc(job->own, job->own_cap);
+        if (job->own == NULL) {
+            die("realloc");
+        }
+    }
+
+    struct save_piece *s = save_piece_add(job);
+
+    s->block = NULL;
+    s->p     = (const char *) job->own_len;
+    s->n     = 0;
+    s->len   = row->size;
+    for (int k = 0; k < erow_nspans(row); k++) {
+        int len;
+        char *p = erow_span(row, k, &len);
+
+        memcpy(job->own + job->own_len, p, len);
+        job->own_len += len;
+    }
+}
+
+
+/*
+ *  A row viewing a block joins the lines before it when it carries
+ *  on right where they end, so rows loaded by scrolling cost nothing.
+ */
+static void save_snapshot_view(struct save_job *job, erow *row)
+{
+    struct save_piece *last = job->npieces
+        ? &job->pieces[job->npieces - 1] : NULL;
+    char *end = row->block->base + row->block->len;
+    int len;
+    char *next = line_next(row->chars, end, &len);
+
+    if (len == row->size && last && last->block == row->block
+            && last->next == row->chars) {
+        last->n++;
+        last->next = next;
+        last->end  = end;
+        return;
+    }
+
+    struct save_piece *s = save_piece_add(job);
+
+    s->block = text_block_ref(row->block);
+    s->p     = row->chars;
+    s->end   = end;
+    s->n     = (len == row->size);
+    s->next  = s->n ? next : NULL;
+    s->len   = row->size;
+}
+
+
+static void save_snapshot(struct editor_config *E, struct save_job *job)
+{
+    int index;
+
+    for (int j = 0; j < E->numrows; j += index) {
+        struct line_node *leaf = line_tree_peek(E->lines, j, &index);
+
+        if (leaf->rows == NULL) {
+            struct save_piece *s = save_piece_add(job);
+
+            s->block = text_block_ref(leaf->block);
+            s->p     = leaf->block->base + leaf->offset;
+            s->end   = leaf->block->base + leaf->block->len;
+            s->next  = NULL;
+            s->n     = leaf->n;
+            s->len   = 0;
+        }
+        for (int i = 0; leaf->rows && i < leaf->n; i++) {
+            erow *row = &leaf->rows[i];
+
+            if (row->block) {
+                save_snapshot_view(job, row);
+            }
+            else {
+                save_snapshot_copy(job, row);
+            }
+        }
+        index = leaf->n;
+    }
+
+    for (int i = 0; i < job->npieces; i++) {
+        struct save_piece *s = &job->pieces[i];
+
+        if (s->block == NULL) {
+            s->p    = job->own + (size_t) s->p;
+            s->end  = s->p + s->len;
+            s->next = NULL;
+        }
+    }
+}
+
+
+static void save_job_free(struct save_job *job)
+{
+    for (int i = 0; i < job->npieces; i++) {
+        text_block_unref(job->pieces[i].block);
+    }
+    free(job->pieces);
+    free(job->own);
+    free(job->filename);
+    free(job->target);
+    free(job);
+}
+
+
+/*
+ *  In the thread: queue every piece, each line with its newline.
+ */
+static int save_job_write(struct save_job *job, struct save_out *o)
+{
+    int shown = 0;
+
+    for (int i = 0; i < job->npieces; i++) {
+        struct save_piece *s = &job->pieces[i];
+        char *p = (char *) s->p;
+        int len;
+
+        if (s->n == 0 && save_line(o, p, s->len, s->end) == -1) {
+            return -1;
+        }
+        for (int k = 0; k < s->n; k++) {
+            char *next = line_next(p, (char *) s->end, &len);
+
+            if (save_line(o, p, len, s->end) == -1) {
+                return -1;
+            }
+            p = next;
+        }
+
+        job->rows_done += s->n ? s->n : 1;
+
+        int percent = job->rows_done * 100.0 / job->rows;
+
+        if (percent >= shown + SAVE_STEP) {
+            shown = percent;
+            __atomic_store_n(&job->percent, percent, __ATOMIC_RELAXED);
+            save_notify(job);
+        }
+    }
+    return save_flush(o);
+}
+
+
+/*
+ *  Write the snapshot to a temporary file in the directory of target,
+ *  then put it in place of target. Returns the open new file, or -1
+ *  with errno set and target untouched.
+ */
+static int file_write_atomic(struct save_job *job)
+{
+    const char *target = job->target;
+    const char *base = path_base(target);
+    int dir_len = base - target;
+    char *tmp = malloc(strlen(target) + 16);
+
+    if (tmp == NULL) {
+        die("malloc");
+    }
+    sprintf(tmp, "%.*s.%s.XXXXXX", dir_len, target, base);
+
+    int fd = mkstemp(tmp);
+
+    if (fd == -1) {
+        free(tmp);
+        return -1;
+    }
+
+    struct save_out o;
+
+    o.job = job;
+    o.fd  = fd;
+    o.n   = 0;
+
+    int ok = fchmod(fd, job->mode) == 0
+        && save_job_write(job, &o) == 0
+        && (!job->fsync || fsync(fd) == 0)
+        && rename(tmp, target) == 0;
+    int err = errno;
+
+    if (!ok) {
+        unlink(tmp);
+        close(fd);
+        free(tmp);
+        errno = err;
+        return -1;
+    }
+    free(tmp);
+
+    // the rename itself only lasts once the directory is on disk
+    if (job->fsync) {
+        char *dir = dir_len > 0 ? strndup(target, dir_len) : strdup(".");
+        int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+
+        if (dfd != -1) {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(dir);
+    }
+    return fd;
+}
+
+
+static void *save_run(void *arg)
+{
+    struct save_job *job = arg;
+
+    job->fd  = file_write_atomic(job);
+    job->err = job->fd == -1 ? errno : 0;
+
+    __atomic_store_n(&job->finished, 1, __ATOMIC_RELEASE);
+    save_notify(job);
+    return NULL;
+}
+
+
+/*
+ *  A file kept next to filename as .name.ext: the swap file autosave
+ *  writes, the edit journal.
+ */
+static char *file_side_path(const char *filename, const char *ext)
+{
+    const char *base = path_base(filename);
+    char *path = malloc(strlen(filename) + strlen(ext) + 4);
+
+    if (path == NULL) {
+        die("malloc");
+    }
+    sprintf(path, "%.*s.%s.%s", (int) (base - filename), filename, base, ext);
+    return path;
+}
+
+
+static void save_finish(struct editor_config *E);
+
+
+/*
+ *  Snapshot the current buffer and start writing it to target.
+ */
+static void save_start(struct editor_config *E, const char *target,
+        int swap)
+{
+    struct save_job *job = calloc(1, sizeof(*job));
+    struct stat st;
+
+    if (job == NULL) {
+        die("calloc");
+    }
+
+    mode_t mask = umask(0);
+
+    umask(mask);
+
+    job->filename = strdup(E->filename);
+    job->target   = strdup(target);
+    job->swap     = swap;
+    job->fsync    = E->save_fsync;
+    job->changed  = E->changed;
+    job->journal_mark = journal_mark(E->journal);
+    job->rows     = E->numrows > 0 ? E->numrows : 1;
+    job->fd       = -1;
+    job->event_fd = E->save_fd;
+    if (swap) {
+        job->mode = 0600;
+    }
+    else {
+        job->mode = stat(target, &st) == 0
+            ? st.st_mode & 07777 : 0644 & ~mask;
+    }
+
+    save_snapshot(E, job);
+    E->save = job;
+
+    // without a thread, or a way to hear from it, save right here
+    job->threaded = E->save_fd != -1
+        && pthread_create(&job->thread, NULL, save_run, job) == 0;
+    if (!job->threaded) {
+        save_run(job);
+        save_finish(E);
+    }
+}
+
+
+/*
+ *  The saved file is the buffer's now, and it is saved unless it was
+ *  edited since the snapshot. Its rows keep viewing the old file,
+ *  which lives on unnamed; mapping the new one would mean indexing it
+ *  all again right when the save was meant to cost nothing.
+ */
+static void save_done(struct editor_config *E, struct save_job *job)
+{
+    if (E->filename && strcmp(E->filename, job->filename) == 0) {
+        file_stamp_take(&E->disk, job->fd);
+        journal_saved(&E->journal, E->changed == job->changed,
+                job->journal_mark, &E->disk);
+        if (E->changed == job->changed) {
+            E->changed      = 0;
+            E->swap_changed = 0;
+        }
+        E->mapped = 0;
+        file_watch(E);
+    }
+
+    buffer_saved(E, job->filename, job->fd, job->changed, job->journal_mark);
+
+    char *swap = file_side_path(job->filename, "swp");
+
+    unlink(swap);
+    free(swap);
+}
+
+
+/*
+ *  Wait for the save going on, then take its outcome.
+ */
+static void save_finish(struct editor_config *E)
+{
+    struct save_job *job = E->save;
+
+    if (job->threaded) {
+        pthread_join(job->thread, NULL);
+    }
+    E->save = NULL;
+
+    if (job->fd == -1) {
+        c_echo_status_message(E,
+                "%s %s failed: %s",
+                job->swap ? "autosave" : "save",
+                job->filename,
+                strerror(job->err));
+    }
+    else if (!job->swap) {
+        c_echo_status_message(E, "save %s success", job->filename);
+        save_done(E, job);
+    }
+
+    if (job->fd != -1) {
+        close(job->fd);
+    }
+    save_job_free(job);
+
+    if (E->disk.pending) {
+        file_reload(E);
+    }
+    if (E->save_again) {
+        E->save_again = 0;
+        file_save(E);
+    }
+    buffer_save_queued(E);
+}
+
+
+static void save_wait(struct editor_config *E)
+{
+    while (E->save) {
+        save_finish(E);
+    }
+}
+
+
+void file_save(struct editor_config *E) {
+    if (E->filename == NULL) {
+        E->filename = editor_prompt(E, "Save as: %s", NULL,
+                prompt_complete_file);
+        if (E->filename == NULL) {
+            c_echo_status_message(E, "without filename!");
+            return;
+        }
+    }
+
+    // one save at a time, this one follows the one going on
+    if (E->save) {
+        E->save_again = 1;
+        c_echo_status_message(E, "saving %s, %s is next",
+                E->save->filename, E->filename);
+        return;
+    }
+
+    struct stat st;
+
+    // rows dropped while following would be cut from the file too
+    if (E->follow_dropped > 0 && stat(E->filename, &st) == 0
+            && st.st_dev == E->disk.dev && st.st_ino == E->disk.ino) {
+        c_echo_status_message(E,
+                "%s lost %d rows to follow_limit, save it elsewhere",
+                E->filename, E->follow_dropped);
+        return;
+    }
+
+    // rows cut short with the mapping would write NULs over the file
+    if (E->disk.cut && stat(E->filename, &st) == 0
+            && st.st_dev == E->disk.dev && st.st_ino == E->disk.ino) {
+        c_echo_status_message(E,
+                "%s was cut short under your edits, save it elsewhere",
+                E->filename);
+        return;
+    }
+
+    // someone else wrote the file since we read it, ask once
+    if (E->disk.ino && !E->disk.asked && stat(E->filename, &st) == 0
+            && !file_stamp_same(&E->disk, &st)) {
+        E->disk.asked = 1;
+        c_echo_status_message(E,
+                "%s changed on disk, save again to overwrite", E->filename);
+        return;
+    }
+
+    // a symlink stays a link to the file it names
+    char *path = realpath(E->filename, NULL);
+
+    c_echo_status_message(E, "saving %s", E->filename);
+    save_start(E, path ? path : E->filename, 0);
+    free(path);
+}
+
+
+/*
+ *  Write unsaved edits of the current buffer to its swap file once
+ *  autosave seconds went by since the last time.
+ */
+static void autosave_tick(struct editor_config *E)
+{
+    time_t now = time(NULL);
+
+    if (E->autosave <= 0 || E->save || E->filename == NULL
+            || E->changed == 0 || E->changed == E->swap_changed
+            || now - E->swap_time < E->autosave) {
+        return;
+    }
+    E->swap_time    = now;
+    E->swap_changed = E->changed;
+
+    char *swap = file_side_path(E->filename, "swp");
+
+    save_start(E, swap, 1);
+    free(swap);
+}
+
+
+static JSValue js_file_save(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    file_save(s);
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  terminal.save_fd(): the descriptor the save thread wakes us on.
+ */
+static JSValue js_save_fd(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    return JS_NewInt32(ctx, s->save_fd);
+}
+
+
+/*
+ *  terminal.check_save(): take what the save thread reported, true when
+ *  the status bar has news.
+ */
+static JSValue js_check_save(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    uint64_t n;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (read(s->save_fd, &n, sizeof(n)) == -1 || s->save == NULL) {
+        return JS_FALSE;
+    }
+    if (__atomic_load_n(&s->save->finished, __ATOMIC_ACQUIRE)) {
+        save_finish(s);
+        return JS_TRUE;
+    }
+    if (s->save->swap) {
+        return JS_FALSE;
+    }
+    c_echo_status_message(s, "saving %s %d%%", s->save->filename,
+            __atomic_load_n(&s->save->percent, __ATOMIC_RELAXED));
+    return JS_TRUE;
+}
+
+
+/*
+ *  terminal.save_wait(): block until the file is saved, for callers
+ *  that read it back or are about to exit.
+ */
+static JSValue js_save_wait(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    save_wait(s);
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  terminal.autosave_tick(): call now and then, e.g. every second.
+ */
+static JSValue js_autosave_tick(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    autosave_tick(s);
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  Buffers
+ */
+
+
+/*
+ *  Every open file is a buffer. The current one lives in the editor
+ *  fields, the others are parked in E->buffers, so switching only
+ *  swaps a few fields and keeps the rows, the history and the view.
+ *  Past buffer_budget bytes the least recently used buffers give back
+ *  the rows they loaded from their mapping.
+ */
+#define BUFFER_BUDGET (64 << 20)
+
+
+struct editor_buffer {
+    char *filename;
+    struct line_node *lines;
+    struct undo_log *undo;
+    int numrows;
+    int cx;
+    int cy;
+    int rx;
+    int row_offset;
+    int col_offset;
+    int mapped;
+    int changed;
+    struct file_stamp disk;
+    int follow;
+    int follow_limit;
+    int follow_dropped;
+    int swap_changed;
+    int save_again;
+    struct journal *journal;
+    unsigned long used;  // when it was last current
+    size_t bytes;        // rows held in memory, as last parked
+    int unloaded;        // nothing more to give back
+};
+
+
+/*
+ *  Bytes of a tree beyond the file it came from: nodes, loaded leaves
+ *  and the text of edited rows.
+ */
+static size_t line_tree_bytes(struct line_node *node)
+{
+    if (node == NULL) {
+        return 0;
+    }
+
+    size_t bytes = sizeof(*node);
+
+    if (!node->leaf) {
+        bytes += LINE_NODE_MAX * sizeof(*node->child);
+        for (int i = 0; i < node->n; i++) {
+            bytes += line_tree_bytes(node->child[i]);
+        }
+        return bytes;
+    }
+    if (node->rows == NULL) {
+        return bytes;
+    }
+
+    bytes += LINE_LEAF_MAX * sizeof(erow);
+    for (int i = 0; i < node->n; i++) {
+        erow *row = &node->rows[i];
+
+        if (erow_is_gap(row)) {
+            bytes += row->size + row->gap_len;
+        }
+    }
+    return bytes;
+}
+
+
+/*
+ *  Make loaded leaves lazy again where their rows are still a run of
+ *  untouched lines of a mapping; only the leaf offsets stay.
+ */
+static void line_tree_unload(struct line_node *node)
+{
+    if (node == NULL) {
+        return;
+    }
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; i++) {
+            line_tree_unload(node->child[i]);
+        }
+        return;
+    }
+    if (node->rows == NULL || node->n == 0) {
+        return;
+    }
+
+    erow *rows = node->rows;
+    struct text_block *b = rows[0].block;
+
+    if (b == NULL || !b->mapped) {
+        return;
+    }
+
+    char *p   = rows[0].chars;
+    char *end = b->base + b->len;
+
+    for (int i = 0; i < node->n; i++) {
+        int len;
+
+        if (rows[i].block != b || rows[i].chars != p) {
+            return;
+        }
+        p = line_next(p, end, &len);
+        if (len != rows[i].size) {
+            return;
+        }
+    }
+
+    node->block  = text_block_ref(b);
+    node->offset = rows[0].chars - b->base;
+    for (int i = 0; i < node->n; i++) {
+        text_block_unref(rows[i].block);
+    }
+    free(rows);
+    node->rows = NULL;
+}
+
+
+static void buffer_park(struct editor_config *E, struct editor_buffer *b)
+{
+    b->filename   = E->filename;
+    b->lines      = E->lines;
+    b->undo       = E->undo;
+    b->numrows    = E->numrows;
+    b->cx         = E->cx;
+    b->cy         = E->cy;
+    b->rx         = E->rx;
+    b->row_offset = E->row_offset;
+    b->col_offset = E->col_offset;
+    b->mapped     = E->mapped;
+    b->changed    = E->changed;
+    b->disk       = E->disk;
+    b->follow     = E->follow;
+    b->follow_limit = E->follow_limit;
+    b->follow_dropped = E->follow_dropped;
+    b->swap_changed = E->swap_changed;
+    b->save_again = E->save_again;
+    b->journal    = E->journal;
+    b->bytes      = line_tree_bytes(E->lines);
+    b->unloaded   = 0;
+}
+
+
+static void buffer_load(struct editor_config *E, struct editor_buffer *b)
+{
+    E->filename   = b->filename;
+    E->lines      = b->lines;
+    E->undo       = b->undo;
+    E->numrows    = b->numrows;
+    E->cx         = b->cx;
+    E->cy         = b->cy;
+    E->rx         = b->rx;
+    E->row_offset = b->row_offset;
+    E->col_offset = b->col_offset;
+    E->mapped     = b->mapped;
+    E->changed    = b->changed;
+    E->disk       = b->disk;
+    E->follow     = b->follow;
+    E->follow_limit = b->follow_limit;
+    E->follow_dropped = b->follow_dropped;
+    E->swap_changed = b->swap_changed;
+    E->save_again = b->save_again;
+    E->journal    = b->journal;
+    E->journal_found = 0;
+    E->search_y   = -1;
+    E->search_x   = -1;
+
+    memset(b, 0, sizeof(*b));
+    b->used = ++E->buffer_tick;
+}
+
+
+static void buffers_free(struct editor_config *E)
+{
+    for (int i = 0; i < E->nbuffers; i++) {
+        struct editor_buffer *b = &E->buffers[i];
+
+        if (i != E->buffer) {
+            line_tree_free(b->lines);
+            undo_log_free(b->undo);
+            journal_free(b->journal);
+            free(b->filename);
+        }
+    }
+    free(E->buffers);
+    E->buffers  = NULL;
+    E->nbuffers = 0;
+    E->buffer   = 0;
+}
+
+
+/*
+ *  A parked buffer of filename was saved from a snapshot taken when
+ *  its changed count was changed; fd is the new file. Its rows view
+ *  the old one now.
+ */
+static void buffer_saved(struct editor_config *E, const char *filename,
+        int fd, int changed, size_t mark)
+{
+    for (int i = 0; i < E->nbuffers; i++) {
+        struct editor_buffer *b = &E->buffers[i];
+
+        if (i != E->buffer && b->filename
+                && strcmp(b->filename, filename) == 0) {
+            file_stamp_take(&b->disk, fd);
+            journal_saved(&b->journal, b->changed == changed, mark, &b->disk);
+            if (b->changed == changed) {
+                b->changed      = 0;
+                b->swap_changed = 0;
+            }
+            b->mapped = 0;
+        }
+    }
+}
+
+
+/*
+ *  Once the save going on is done, start one a parked buffer asked for
+ *  meanwhile. The buffer stands in for the current one while its
+ *  snapshot is taken, which leaves the view and the order buffers were
+ *  used in as they were.
+ */
+static void buffer_save_queued(struct editor_config *E)
+{
+    for (int i = 0; i < E->nbuffers && E->save == NULL; i++) {
+        struct editor_buffer *b = &E->buffers[i];
+
+        if (i == E->buffer || !b->save_again) {
+            continue;
+        }
+        b->save_again = 0;
+
+        struct editor_buffer current;
+        unsigned long used = b->used;
+        int at       = E->buffer;
+        int found    = E->journal_found;
+        int search_y = E->search_y;
+        int search_x = E->search_x;
+
+        buffer_park(E, &current);
+        buffer_load(E, b);
+        E->buffer = i;
+        file_save(E);
+        buffer_park(E, b);
+        b->used = used;
+
+        buffer_load(E, &current);
+        E->buffer        = at;
+        E->journal_found = found;
+        E->search_y      = search_y;
+        E->search_x      = search_x;
+    }
+}
+
+
+/*
+ *  Saves asked for meanwhile are given up with the editor.
+ */
+static void buffer_save_cancel(struct editor_config *E)
+{
+    E->save_again = 0;
+    for (int i = 0; i < E->nbuffers; i++) {
+        E->buffers[i].save_again = 0;
+    }
+}
+
+
+/*
+ *  Give back loaded rows of background buffers, least recently used
+ *  first, until they fit the budget.
+ */
+static void buffer_trim(struct editor_config *E)
+{
+    size_t total = 0;
+
+    for (int i = 0; i < E->nbuffers; i++) {
+        if (i != E->buffer) {
+            total += E->buffers[i].bytes;
+        }
+    }
+
+    while (total > E->buffer_budget) {
+        struct editor_buffer *lru = NULL;
+
+        for (int i = 0; i < E->nbuffers; i++) {
+            struct editor_buffer *b = &E->buffers[i];
+
+            if (i != E->buffer && !b->unloaded
+                    && (lru == NULL || b->used < lru->used)) {
+                lru = b;
+            }
+        }
+        if (lru == NULL) {
+            break;
+        }
+
+        size_t bytes = lru->bytes;
+
+        line_tree_unload(lru->lines);
+        lru->bytes    = line_tree_bytes(lru->lines);
+        lru->unloaded = 1;
+        total -= bytes - lru->bytes;
+    }
+}
+
+
+static void buffer_switch(struct editor_config *E, int i)
+{
+    if (i == E->buffer || i < 0 || i >= E->nbuffers) {
+        return;
+    }
+
+    buffer_park(E, &E->buffers[E->buffer]);
+    buffer_load(E, &E->buffers[i]);
+    E->buffer = i;
+    buffer_trim(E);
+
+    if (E->disk.pending) {
+        file_reload(E);
+    }
+}
+
+
+static void buffer_grow(struct editor_config *E)
+{
+    if (E->nbuffers < E->buffer_cap) {
+        return;
+    }
+
+    E->buffer_cap = E->buffer_cap ? E->buffer_cap * 2 : 8;
+    E->buffers = realloc(E->buffers, E->buffer_cap * sizeof(*E->buffers));
+    if (E->buffers == NULL) {
+        die("realloc");
+    }
+}
+
+
+static int buffer_find(struct editor_config *E, const char *filename)
+{
+    for (int i = 0; i < E->nbuffers; i++) {
+        const char *name = i == E->buffer
+            ? E->filename : E->buffers[i].filename;
+
+        if (name && strcmp(name, filename) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ *  Make filename the current buffer, opening it unless it is open
+ *  already; without a filename an empty buffer is made. Returns -1,
+ *  back on the buffer it started from, when filename cannot be read.
+ */
+static int buffer_open(struct editor_config *E, const char *filename)
+{
+    int i = filename ? buffer_find(E, filename) : -1;
+
+    if (i >= 0) {
+        buffer_switch(E, i);
+        return i;
+    }
+
+    // the buffer the editor started with is slot 0, reused when empty
+    int reuse = E->nbuffers <= 1 && E->filename == NULL && E->numrows == 0;
+    int from  = E->buffer;
+    int had   = E->nbuffers;
+
+    if (E->nbuffers == 0) {
+        buffer_grow(E);
+        memset(&E->buffers[0], 0, sizeof(E->buffers[0]));
+        E->buffers[0].used = ++E->buffer_tick;
+        E->nbuffers = 1;
+        E->buffer   = 0;
+    }
+
+    i = E->buffer;
+    if (!reuse) {
+        buffer_grow(E);
+        i = E->nbuffers++;
+        memset(&E->buffers[i], 0, sizeof(E->buffers[i]));
+        buffer_switch(E, i);
+    }
+    if (filename && file_open(E, filename) == -1) {
+        // nothing was read into it, the slot goes again
+        if (!reuse) {
+            E->nbuffers--;
+            buffer_load(E, &E->buffers[from]);
+            E->buffer = from;
+        }
+        else if (had == 0) {
+            E->nbuffers = 0;
+        }
+        return -1;
+    }
+    return i;
+}
+
+
+/*
+ *  Close the current buffer, the one used last before it takes over.
+ */
+static void buffer_close(struct editor_config *E)
+{
+    file_close(E);
+
+    if (E->nbuffers <= 1) {
+        E->nbuffers = 0;
+        E->buffer   = 0;
+        return;
+    }
+
+    int closed = E->buffer;
+
+    memmove(&E->buffers[closed], &E->buffers[closed + 1],
+            (E->nbuffers - closed - 1) * sizeof(*E->buffers));
+    E->nbuffers--;
+
+    int mru = 0;
+
+    for (int i = 1; i < E->nbuffers; i++) {
+        if (E->buffers[i].used > E->buffers[mru].used) {
+            mru = i;
+        }
+    }
+    buffer_load(E, &E->buffers[mru]);
+    E->buffer = mru;
+
+    if (E->disk.pending) {
+        file_reload(E);
+    }
+}
+
+
+/*
+ *  terminal.buffer_open(filename): switch to filename, opening it when
+ *  needed, or to a new empty buffer for null. Returns its index, -1
+ *  when filename cannot be read.
+ */
+static JSValue js_buffer_open(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    const char *str = NULL;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (argc > 0 && !JS_IsNull(argv[0]) && !JS_IsUndefined(argv[0])) {
+        str = JS_ToCString(ctx, argv[0]);
+        if (str == NULL) {
+            return JS_EXCEPTION;
+        }
+    }
+
+    int i = buffer_open(s, str);
+
+    JS_FreeCString(ctx, str);
+    return JS_NewInt32(ctx, i);
+}
+
+
+static JSValue js_buffer_switch(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    int i;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (JS_ToInt32(ctx, &i, argv[0])) {
+        return JS_EXCEPTION;
+    }
+    buffer_switch(s, i);
+    return JS_NewInt32(ctx, s->buffer);
+}
+
+
+/*
+ *  terminal.buffers(): { name, changed, current } for every buffer.
+ */
+static JSValue js_buffers(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    JSValue list = JS_NewArray(ctx);
+
+    for (int i = 0; i < s->nbuffers; i++) {
+        struct editor_buffer *b = &s->buffers[i];
+        int current = i == s->buffer;
+        const char *name = current ? s->filename : b->filename;
+        JSValue obj = JS_NewObject(ctx);
+
+        JS_SetPropertyStr(ctx, obj, "name",
+                name ? JS_NewString(ctx, name) : JS_NULL);
+        JS_SetPropertyStr(ctx, obj, "changed",
+                JS_NewInt32(ctx, current ? s->changed : b->changed));
+        JS_SetPropertyStr(ctx, obj, "current", JS_NewBool(ctx, current));
+        JS_SetPropertyUint32(ctx, list, i, obj);
+    }
+    return list;
+}
+
+
+/*
+ *  Disk changes
+ */
+
+
+/*
+ *  The directory of every open file is watched with inotify. An event
+ *  for a file name only makes the buffers of that name look at their
+ *  file again; what is on disk is compared with the stamp taken when
+ *  it was last read or written, so our own saves reload nothing.
+ */
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE \
+        | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/*
+ *  Past this many rows changed in the middle, a reload builds the tree
+ *  again from the file instead of patching it.
+ */
+#define RELOAD_PATCH_MAX (LINE_LEAF_MAX * 64)
+
+
+static const char *path_base(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash ? slash + 1 : path;
+}
+
+
+/*
+ *  Remember in d what fd, the file just read or written, looks like.
+ */
+static void file_stamp_take(struct file_stamp *d, int fd)
+{
+    struct stat st;
+
+    memset(d, 0, sizeof(*d));
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+
+    d->dev   = st.st_dev;
+    d->ino   = st.st_ino;
+    d->size  = st.st_size;
+    d->mtime = st.st_mtim;
+
+    size_t len = st.st_size < STAMP_TAIL ? st.st_size : STAMP_TAIL;
+    ssize_t got = pread(fd, d->tail, len, st.st_size - len);
+
+    d->tail_len = got > 0 ? got : 0;
+}
+
+
+static int file_stamp_same(struct file_stamp *d, struct stat *st)
+{
+    return d->dev == st->st_dev && d->ino == st->st_ino
+        && d->size == st->st_size
+        && d->mtime.tv_sec == st->st_mtim.tv_sec
+        && d->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+/*
+ *  Watch the directory of the current file; adding the same directory
+ *  again gives back the watch it already has.
+ */
+static void file_watch(struct editor_config *E)
+{
+    if (E->filename == NULL) {
+        return;
+    }
+    if (E->watch_fd == -1) {
+        E->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (E->watch_fd == -1) {
+            return;
+        }
+    }
+
+    char *dir = strdup(E->filename);
+    char *slash = strrchr(dir, '/');
+
+    if (slash == dir) {
+        slash[1] = '\0';
+    }
+    else if (slash) {
+        *slash = '\0';
+    }
+    inotify_add_watch(E->watch_fd, slash ? dir : ".", WATCH_EVENTS);
+    free(dir);
+}
+
+
+/*
+ *  Text of rows index.. of leaf, without loading a lazy one.
+ */
+static int line_leaf_text(struct line_node *leaf, int index,
+        const char **text, int *len)
+{
+    if (leaf->rows) {
+        for (int i = index; i < leaf->n; i++) {
+            erow *row = &leaf->rows[i];
+
+            if (erow_is_gap(row)) {
+                erow_gap_move(row, row->size);
+            }
+            text[i - index] = row->chars;
+            len[i - index]  = row->size;
+        }
+        return leaf->n - index;
+    }
+
+    char *p   = leaf->block->base + leaf->offset;
+    char *end = leaf->block->base + leaf->block->len;
+
+    for (int i = 0; i < leaf->n; i++) {
+        int l;
+        char *next = line_next(p, end, &l);
+
+        if (i >= index) {
+            text[i - index] = p;
+            len[i - index]  = l;
+        }
+        p = next;
+    }
+    return leaf->n - index;
+}
+
+
+/*
+ *  The line that ends where *at is, in text starting at base, going
+ *  backwards; *at moves to its start. The inverse of line_next.
+ */
+static const char *line_prev(const char *base, const char **at, int *len)
+{
+    const char *e = (*at)[-1] == '\n' ? *at - 1 : *at;
+    const char *p = e;
+
+    while (p > base && p[-1] != '\n') {
+        p--;
+    }
+
+    *len = e - p;
+    while (*len > 0 && p[*len - 1] == '\r') {
+        (*len)--;
+    }
+    *at = p;
+    return p;
+}
+
+
+static int line_same(const char *a, int alen, const char *b, int blen)
+{
+    return alen == blen && (alen == 0 || memcmp(a, b, alen) == 0);
+}
+
+
+/*
+ *  Hang leaf after the last leaf of node, return the right half when
+ *  node had to be split.
+ */
+static struct line_node *line_node_push(struct line_node *node,
+        struct line_node *leaf)
+{
+    struct line_node *last = node->child[node->n - 1];
+    struct line_node *right = last->leaf ? leaf : line_node_push(last, leaf);
+
+    node->count += leaf->count;
+    if (right == NULL) {
+        return NULL;
+    }
+
+    node->child[node->n++] = right;
+    return (node->n == LINE_NODE_MAX) ? line_node_split(node) : NULL;
+}
+
+
+static void line_tree_push(struct line_node **root, struct line_node *leaf)
+{
+    if (*root == NULL) {
+        *root = leaf;
+        return;
+    }
+
+    struct line_node *right = (*root)->leaf
+        ? leaf : line_node_push(*root, leaf);
+
+    if (right) {
+        struct line_node *top = line_node_new(0);
+
+        top->child[0] = *root;
+        top->child[1] = right;
+        top->n        = 2;
+        top->count    = (*root)->count + right->count;
+        *root = top;
+    }
+}
+
+
+/*
+ *  Append the lines of b from offset on as rows in bulk: the last leaf
+ *  is topped up with views, the rest goes in as lazy leaves, so only
+ *  the new bytes are looked at.
+ */
+static void editor_rows_append_block(struct editor_config *E,
+        struct text_block *b, size_t offset)
+{
+    char *p   = b->base + offset;
+    char *end = b->base + b->len;
+    int index = 0;
+    struct line_node *last = NULL;
+
+    if (E->numrows > 0) {
+        last = line_tree_peek(E->lines, E->numrows - 1, &index);
+    }
+    else {
+        line_tree_free(E->lines);
+        E->lines = NULL;
+    }
+    text_block_ref(b);
+
+    // views only while the last leaf is short, as a lazy leaf would be
+    while (p < end && last && last->n < LINE_LEAF_LAZY) {
+        erow row;
+
+        row.chars   = p;
+        row.block   = text_block_ref(b);
+        row.gap     = 0;
+        row.gap_len = 0;
+        p = line_next(p, end, &row.size);
+        editor_row_link(E, E->numrows, &row);
+        last = line_tree_peek(E->lines, E->numrows - 1, &index);
+    }
+
+    while (p < end) {
+        char *start = p;
+        int n = 0;
+        int len;
+
+        while (p < end && n < LINE_LEAF_LAZY) {
+            p = line_next(p, end, &len);
+            n++;
+        }
+        line_tree_push(&E->lines, line_leaf_lazy(b, start - b->base, n));
+        E->numrows += n;
+    }
+
+    text_block_unref(b);
+}
+
+
+/*
+ *  Where the line holding byte at - 1 starts, read back from fd.
+ */
+static off_t file_line_start(int fd, off_t at)
+{
+    char buf[4096];
+
+    while (at > 0) {
+        size_t len = at < (off_t) sizeof(buf) ? at : sizeof(buf);
+
+        if (pread(fd, buf, len, at - len) != (ssize_t) len) {
+            return -1;
+        }
+        for (size_t i = len; i > 0; i--) {
+            if (buf[i - 1] == '\n') {
+                return at - len + i;
+            }
+        }
+        at -= len;
+    }
+    return 0;
+}
+
+
+/*
+ *  The file only grew: read what came after the old end. A last line
+ *  that had no newline is read again with what continues it.
+ */
+static int file_reload_append(struct editor_config *E, int fd, off_t size)
+{
+    struct file_stamp *d = &E->disk;
+    off_t from = d->size;
+    char tail[STAMP_TAIL];
+
+    if ((from > 0 && d->tail_len == 0)
+            || pread(fd, tail, d->tail_len, from - d->tail_len) != d->tail_len
+            || memcmp(tail, d->tail, d->tail_len) != 0) {
+        return 0;
+    }
+
+    int partial = from > 0 && d->tail[d->tail_len - 1] != '\n'
+        && E->numrows > 0;
+
+    if (partial) {
+        from = file_line_start(fd, from);
+        if (from < 0) {
+            return 0;
+        }
+    }
+
+    size_t offset;
+    struct text_block *b = file_block_from(E, fd, from, size, &offset);
+
+    if (b == NULL) {
+        return 0;
+    }
+    if (partial) {
+        editor_row_delete(E, E->numrows - 1);
+    }
+    editor_rows_append_block(E, b, offset);
+    return 1;
+}
+
+
+/*
+ *  The file was replaced, our rows still hold the old text: keep the
+ *  rows both have in common at the start and at the end, and only put
+ *  the lines between in anew.
+ */
+static int file_reload_patch(struct editor_config *E, int fd, off_t size)
+{
+    struct text_block *b = NULL;
+    const char *base = "";
+    size_t len = 0;
+
+    if (size > 0) {
+        size_t offset;
+
+        b = file_block_from(E, fd, 0, size, &offset);
+        if (b == NULL) {
+            return 0;
+        }
+        text_block_ref(b);
+        base = b->base;
+        len  = size;
+    }
+
+    const char *text[LINE_LEAF_MAX];
+    int tlen[LINE_LEAF_MAX];
+    const char *p   = base;
+    const char *end = base + len;
+    int head = 0;
+    int index;
+
+    // rows the same from the top
+    while (head < E->numrows && p < end) {
+        struct line_node *leaf = line_tree_peek(E->lines, head, &index);
+        int n = line_leaf_text(leaf, index, text, tlen);
+        int i = 0;
+
+        while (i < n && p < end) {
+            int l;
+            const char *next = line_next((char *) p, (char *) end, &l);
+
+            if (!line_same(text[i], tlen[i], p, l)) {
+                break;
+            }
+            p = next;
+            i++;
+        }
+        head += i;
+        if (i < n) {
+            break;
+        }
+    }
+
+    // and from the bottom, not reaching into the rows kept at the top
+    const char *q = end;
+    int tail = 0;
+
+    while (E->numrows - tail > head && q > p) {
+        int y = E->numrows - tail - 1;
+        struct line_node *leaf = line_tree_peek(E->lines, y, &index);
+        int first = y - index;
+        int from = first > head ? first : head;
+        int i = y - from;
+
+        line_leaf_text(leaf, from - first, text, tlen);
+        while (i >= 0 && q > p) {
+            const char *at = q;
+            int l;
+            const char *s = line_prev(p, &at, &l);
+
+            if (!line_same(text[i], tlen[i], s, l)) {
+                break;
+            }
+            q = at;
+            tail++;
+            i--;
+        }
+        if (i >= 0) {
+            break;
+        }
+    }
+
+    int old_mid = E->numrows - head - tail;
+    int new_mid = 0;
+
+    for (const char *s = p; s < q; new_mid++) {
+        int l;
+
+        s = line_next((char *) s, (char *) q, &l);
+    }
+
+    if (old_mid > RELOAD_PATCH_MAX || new_mid > RELOAD_PATCH_MAX) {
+        text_block_unref(b);
+        return 0;
+    }
+
+    for (int i = 0; i < old_mid; i++) {
+        editor_row_delete(E, head);
+    }
+    for (int y = head; p < q; y++) {
+        erow row;
+
+        row.chars   = (char *) p;
+        row.block   = b ? text_block_ref(b) : NULL;
+        row.gap     = 0;
+        row.gap_len = 0;
+        p = line_next((char *) p, (char *) q, &row.size);
+        editor_row_link(E, y, &row);
+    }
+    text_block_unref(b);
+
+    // what was below the change moves with it
+    if (E->cy >= head + old_mid) {
+        E->cy += new_mid - old_mid;
+    }
+    else if (E->cy >= head + new_mid) {
+        E->cy = head + (new_mid > 0 ? new_mid - 1 : 0);
+    }
+    if (E->row_offset >= head + old_mid) {
+        E->row_offset += new_mid - old_mid;
+    }
+    return 1;
+}
+
+
+/*
+ *  While following, drop the oldest rows past follow_limit and, when
+ *  the cursor was on the last row, keep it there.
+ */
+static void follow_rows(struct editor_config *E, int pinned)
+{
+    if (!E->follow) {
+        return;
+    }
+
+    int n = E->numrows - E->follow_limit;
+
+    // unsaved edits are never thrown away
+    if (E->follow_limit > 0 && n > 0 && !E->changed) {
+        line_tree_drop(&E->lines, n);
+        E->numrows -= n;
+        E->follow_dropped += n;
+        E->cy          = E->cy > n ? E->cy - n : 0;
+        E->row_offset  = E->row_offset > n ? E->row_offset - n : 0;
+        E->search_y    = -1;
+        E->search_x    = -1;
+
+        // its positions went with the rows
+        undo_clear(E);
+    }
+    if (pinned) {
+        E->cy = E->numrows > 0 ? E->numrows - 1 : 0;
+        E->cx = 0;
+    }
+}
+
+
+/*
+ *  Bring the current buffer up to date with its file. Rows with unsaved
+ *  edits are never touched, the next save asks first instead.
+ */
+static void file_reload(struct editor_config *E)
+{
+    struct file_stamp *d = &E->disk;
+    struct stat st;
+
+    // our own save is landing, look again once it is done
+    if (E->save && !E->save->swap && E->filename
+            && strcmp(E->save->filename, E->filename) == 0) {
+        d->pending = 1;
+        return;
+    }
+
+    d->pending = 0;
+    if (E->filename == NULL || d->ino == 0) {
+        return;
+    }
+    if (stat(E->filename, &st) == -1) {
+        if (!d->told) {
+            c_echo_status_message(E, "%s is gone from disk", E->filename);
+        }
+        d->told = 1;
+        return;
+    }
+    if (file_stamp_same(d, &st) || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    if (E->changed) {
+        // being cut short says more, file_cut_mark told it
+        if (!d->told && !d->cut) {
+            c_echo_status_message(E,
+                    "%s changed on disk, kept your edits", E->filename);
+        }
+        d->told = 1;
+        return;
+    }
+
+    int fd = open(E->filename, O_RDONLY);
+
+    if (fd == -1) {
+        return;
+    }
+
+    int same = d->dev == st.st_dev && d->ino == st.st_ino;
+    int done = 0;
+    int pinned = E->cy >= E->numrows - 1;
+
+    if (same && st.st_size >= d->size) {
+        done = file_reload_append(E, fd, st.st_size);
+    }
+    if (!done) {
+        // positions in the history no longer fit the text
+        undo_clear(E);
+
+        // a file written over in place may show through our mapping
+        if (!same || !E->mapped) {
+            done = file_reload_patch(E, fd, st.st_size);
+        }
+    }
+    if (done) {
+        file_stamp_take(&E->disk, fd);
+        journal_drop(E);
+        E->mapped  = !E->follow;
+        E->changed = 0;
+    }
+    close(fd);
+
+    if (!done) {
+        file_remap(E);
+    }
+    follow_rows(E, pinned);
+    cursor_clamp(E);
+}
+
+
+/*
+ *  Whether rows of a tree view a mapping that was cut short.
+ */
+static int line_tree_cut(struct line_node *node)
+{
+    if (node == NULL) {
+        return 0;
+    }
+    if (!node->leaf) {
+        for (int i = 0; i < node->n; i++) {
+            if (line_tree_cut(node->child[i])) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    for (int i = 0; i < (node->rows ? node->n : 1); i++) {
+        struct text_block *b = node->rows ? node->rows[i].block : node->block;
+
+        if (b && b->slot >= 0 && map_slots[b->slot].cut) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *  A buffer reading NULs where its file was cut short is reloaded, or,
+ *  with unsaved edits, kept from being saved over that file.
+ */
+static void file_cut_mark(struct editor_config *E, struct line_node *lines,
+        int changed, struct file_stamp *d, const char *filename)
+{
+    if (!line_tree_cut(lines)) {
+        return;
+    }
+    d->pending = 1;
+    if (changed && !d->cut) {
+        d->cut = 1;
+        c_echo_status_message(E,
+                "%s was cut short under your edits, save it elsewhere",
+                filename);
+    }
+}
+
+
+/*
+ *  Take what inotify has reported. Buffers whose file name came up are
+ *  looked at; the current one right away, the others once they are
+ *  switched to. Returns whether the current buffer was looked at.
+ */
+static int file_watch_check(struct editor_config *E)
+{
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    // a mapping was cut short, the buffers viewing it are looked at
+    if (map_cut) {
+        map_cut = 0;
+        file_cut_mark(E, E->lines, E->changed, &E->disk, E->filename);
+        for (int i = 0; i < E->nbuffers; i++) {
+            struct editor_buffer *b = &E->buffers[i];
+
+            if (i != E->buffer) {
+                file_cut_mark(E, b->lines, b->changed, &b->disk, b->filename);
+            }
+        }
+    }
+
+    while (E->watch_fd != -1
+            && (len = read(E->watch_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+
+            p += sizeof(*ev) + ev->len;
+            if (ev->len == 0) {
+                continue;
+            }
+            if (E->filename
+                    && strcmp(path_base(E->filename), ev->name) == 0) {
+                E->disk.pending = 1;
+            }
+            for (int i = 0; i < E->nbuffers; i++) {
+                struct editor_buffer *b = &E->buffers[i];
+
+                if (i != E->buffer && b->filename
+                        && strcmp(path_base(b->filename), ev->name) == 0) {
+                    b->disk.pending = 1;
+                }
+            }
+        }
+    }
+
+    if (!E->disk.pending) {
+        return 0;
+    }
+    file_reload(E);
+    return 1;
+}
+
+
+/*
+ *  terminal.watch_fd(): the descriptor to wait on for changes on disk,
+ *  -1 when nothing is watched.
+ */
+static JSValue js_watch_fd(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    return JS_NewInt32(ctx, s->watch_fd);
+}
+
+
+/*
+ *  terminal.check_files(): true when the current buffer was reloaded
+ *  or told about a change and the screen needs a refresh.
+ */
+static JSValue js_check_files(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    return JS_NewBool(ctx, file_watch_check(s));
+}
+
+
+/*
+ *  Width
+ */
+
+
+/*
+ *  Bytes of the UTF-8 sequence led by c. Continuation bytes and leads
+ *  that cannot start a valid sequence count as one byte.
+ */
+static int utf8_seq_len(unsigned char c)
+{
+    if (c < 0xc2) {
+        return 1;
+    }
+    if (c < 0xe0) {
+        return 2;
+    }
+    if (c < 0xf0) {
+        return 3;
+    }
+    if (c < 0xf5) {
+        return 4;
+    }
+    return 1;
+}
+
+
+/*
+ *  Decode the character at p, len bytes are readable. A malformed
+ *  sequence is a single byte that decodes to U+FFFD.
+ */
+static int utf8_decode(const unsigned char *p, int len, unsigned int *cp)
+{
+    static const unsigned int least[] = {0, 0, 0x80, 0x800, 0x10000};
+    int n = utf8_seq_len(p[0]);
+    unsigned int c = p[0] & (0x7f >> n);
+
+    if (n == 1) {
+        *cp = p[0] < 0x80 ? p[0] : 0xfffd;
+        return 1;
+    }
+    if (n > len) {
+        *cp = 0xfffd;
+        return 1;
+    }
+
+    for (int i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            *cp = 0xfffd;
+            return 1;
+        }
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+
+    // overlong, a surrogate or past U+10FFFF
+    if (c < least[n] || (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff) {
+        *cp = 0xfffd;
+        return 1;
+    }
+    *cp = c;
+    return n;
+}
+
+
+static int width_in(const struct width_range *r, int n, unsigned int cp)
+{
+    int lo = 0;
+    int hi = n - 1;
+
+    if (cp < r[0].lo || cp > r[n - 1].hi) {
+        return 0;
+    }
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+
+        if (cp > r[mid].hi) {
+            lo = mid + 1;
+        }
+        else if (cp < r[mid].lo) {
+            hi = mid - 1;
+        }
+        else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *  Columns cp takes on the terminal, from the tables in width_table.h.
+ */
+static int utf8_width(unsigned int cp)
+{
+    if (cp < 0x300) {
+        return 1;
+    }
+    if (width_in(width_zero, countof(width_zero), cp)) {
+        return 0;
+    }
+    if (width_in(width_wide, countof(width_wide), cp)) {
+        return 2;
+    }
+    return 1;
+}
+
+
+/*
+ *  Columns of the UTF-8 text s, len bytes long.
+ */
+static int utf8_text_width(const char *s, int len)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    int width = 0;
+
+    for (int i = 0; i < len; ) {
+        unsigned int cp;
+
+        i += utf8_decode(p + i, len - i, &cp);
+        width += utf8_width(cp);
+    }
+    return width;
+}
+
+
+/*
+ *  How many bytes of s fit in cols columns, cut between characters.
+ */
+static int utf8_text_clip(const char *s, int len, int cols)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    int width = 0;
+    int i = 0;
+
+    while (i < len) {
+        unsigned int cp;
+        int n = utf8_decode(p + i, len - i, &cp);
+        int w = utf8_width(cp);
+
+        if (width + w > cols) {
+            break;
+        }
+        width += w;
+        i += n;
+    }
+    return i;
+}
+
+
+/*
+ *  Bytes from p on that are one column each: ASCII other than tab.
+ */
+static int ascii_run(const char *p, int len)
+{
+    int n = 0;
+
+#ifdef __SSE2__
+    const __m128i tab = _mm_set1_epi8('\t');
+
+    for (; n + 16 <= len; n += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (p + n));
+        unsigned int mask = _mm_movemask_epi8(chunk)
+            | _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, tab));
+
+        if (mask) {
+            return n + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    while (n < len && (unsigned char) p[n] < 0x80 && p[n] != '\t') {
+        n++;
+    }
+    return n;
+}
+
+
+/*
+ *  The bytes of row from `at` on, *avail of them in one piece. A
+ *  character cut by the gap is copied to buf.
+ */
+static const char *erow_bytes(erow *row, int at, int *avail, char buf[4])
+{
+    if (!erow_is_gap(row)) {
+        *avail = row->size - at;
+        return row->chars + at;
+    }
+    if (at >= row->gap) {
+        *avail = row->size - at;
+        return row->chars + at + row->gap_len;
+    }
+
+    *avail = row->gap - at;
+    if (*avail < 4 && row->gap < row->size) {
+        int n = row->size - at < 4 ? row->size - at : 4;
+
+        for (int i = 0; i < n; i++) {
+            buf[i] = erow_char(row, at + i);
+        }
+        *avail = n;
+        return buf;
+    }
+    return row->chars + at;
+}
+
+
+/*
+ *  Decode the character at byte at of row, return its length.
+ */
+static int erow_decode(erow *row, int at, unsigned int *cp)
+{
+    char buf[4];
+    int avail;
+    const char *p = erow_bytes(row, at, &avail, buf);
+
+    return utf8_decode((const unsigned char *) p, avail, cp);
+}
+
+
+/*
+ *  Start of the character after the one at `at`. Combining marks go
+ *  with the character before them, so they are stepped over too.
+ */
+static int erow_next(erow *row, int at)
+{
+    unsigned int cp;
+
+    if (at < 0 || at >= row->size) {
+        return at + 1;
+    }
+
+    at += erow_decode(row, at, &cp);
+    while (at < row->size) {
+        int n = erow_decode(row, at, &cp);
+
+        if (utf8_width(cp) != 0) {
+            break;
+        }
+        at += n;
+    }
+    return at;
+}
+
+
+/*
+ *  Start of the character that ends at, or holds, byte at - 1.
+ */
+static int erow_prev(erow *row, int at)
+{
+    if (at > row->size) {
+        return at - 1;
+    }
+
+    while (at > 0) {
+        int start = at - 1;
+        unsigned int cp;
+
+        while (start > 0 && start > at - 4
+                && (erow_char(row, start) & 0xc0) == 0x80) {
+            start--;
+        }
+        // a stray continuation byte is a character of its own
+        if (start + erow_decode(row, start, &cp) < at) {
+            start = at - 1;
+            erow_decode(row, start, &cp);
+        }
+        at = start;
+
+        if (at == 0 || utf8_width(cp) != 0) {
+            break;
+        }
+    }
+    return at;
+}
+
+
+/*
+ *  Walk row from byte *at, column *col over whole characters, until
+ *  byte `to` is reached or the next character would go past column
+ *  stop; marks that take no column are always walked over.
+ */
+static void width_walk(erow *row, int *at, int *col, int to, int stop)
+{
+    int i = *at;
+    int x = *col;
+
+    if (to > row->size) {
+        to = row->size;
+    }
+
+    while (i < to && x < stop) {
+        char buf[4];
+        int avail;
+        const char *p = erow_bytes(row, i, &avail, buf);
+        int run = ascii_run(p, avail);
+
+        if (run > to - i) {
+            run = to - i;
+        }
+        if (run > stop - x) {
+            run = stop - x;
+        }
+        if (run > 0) {
+            i += run;
+            x += run;
+            continue;
+        }
+
+        unsigned int cp;
+        int n = utf8_decode((const unsigned char *) p, avail, &cp);
+        int w = cp == '\t' ? WOE_TAB - x % WOE_TAB : utf8_width(cp);
+
+        if (x + w > stop && w > 0) {
+            break;
+        }
+        i += n;
+        x += w;
+    }
+
+    // marks at the stop column still belong to the character before
+    while (i < to && x == stop) {
+        unsigned int cp;
+        int n = erow_decode(row, i, &cp);
+
+        if (cp == '\t' || utf8_width(cp) != 0) {
+            break;
+        }
+        i += n;
+    }
+
+    *at = i;
+    *col = x;
+}
+
+
+/*
+ *  Rows longer than WIDTH_INDEX_MIN bytes get an index of where every
+ *  WIDTH_STEP bytes fall on screen, so a position on them is found by
+ *  a binary search and a short walk. It is kept by row stamp.
+ */
+#define WIDTH_INDEX_MIN   4096
+#define WIDTH_STEP        512
+#define WIDTH_CACHE_LINES 64
+
+
+struct width_line {
+    unsigned long gen;  // 0 for an empty slot
+    int n;
+    int cap;
+    int *marks;  // byte and column pairs, at character starts
+};
+
+
+static void width_cache_free(struct editor_config *E)
+{
+    if (E->width_cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < WIDTH_CACHE_LINES; i++) {
+        free(E->width_cache[i].marks);
+    }
+    free(E->width_cache);
+    E->width_cache = NULL;
+}
+
+
+static struct width_line *width_index(struct editor_config *E, erow *row)
+{
+    if (E->width_cache == NULL) {
+        E->width_cache = calloc(WIDTH_CACHE_LINES, sizeof(struct width_line));
+        if (E->width_cache == NULL) {
+            die("calloc");
+        }
+    }
+
+    struct width_line *line = &E->width_cache[row->gen % WIDTH_CACHE_LINES];
+
+    if (line->gen == row->gen) {
+        return line;
+    }
+
+    int at = 0;
+    int col = 0;
+
+    line->n = 0;
+    for (;;) {
+        if (line->n == line->cap) {
+            line->cap = line->cap ? line->cap * 2 : 64;
+            line->marks = realloc(line->marks,
+                    line->cap * 2 * sizeof(int));
+            if (line->marks == NULL) {
+                die("realloc");
+            }
+        }
+        line->marks[line->n * 2]     = at;
+        line->marks[line->n * 2 + 1] = col;
+        line->n++;
+
+        if (at >= row->size) {
+            break;
+        }
+        width_walk(row, &at, &col, at + WIDTH_STEP, INT_MAX);
+    }
+
+    line->gen = row->gen;
+    return line;
+}
+
+
+/*
+ *  Where to start walking: the last mark at or before byte key, or
+ *  column key when by_col is set.
+ */
+static void width_seek(struct editor_config *E, erow *row,
+        int key, int by_col, int *at, int *col)
+{
+    *at = 0;
+    *col = 0;
+
+    if (row->size < WIDTH_INDEX_MIN || E == NULL) {
+        return;
+    }
+
+    struct width_line *line = width_index(E, row);
+    int lo = 0;
+    int hi = line->n - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+
+        if (line->marks[mid * 2 + by_col] <= key) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    *at  = line->marks[lo * 2];
+    *col = line->marks[lo * 2 + 1];
+}
+
+
+/*
+ *  Convert position
+ */
+int editor_convert_cx_to_rx(struct editor_config *E, erow *row, int cx)
+{
+    int at, rx;
+
+    width_seek(E, row, cx, 0, &at, &rx);
+    width_walk(row, &at, &rx, cx, INT_MAX);
+    return rx;
+}
+
+
+/*
+ *  Byte where the character covering column rx starts; *start is its
+ *  first column, less than rx when a wide character or a tab is cut.
+ */
+static int editor_convert_rx_to_cx(struct editor_config *E,
+        erow *row, int rx, int *start)
+{
+    int at, col;
+
+    width_seek(E, row, rx, 1, &at, &col);
+    width_walk(row, &at, &col, row->size, rx);
+    if (start) {
+        *start = col;
+    }
+    return at;
+}
+
+
+static JSValue js_display_width(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    size_t len;
+    const char *str = JS_ToCStringLen(ctx, &len, argv[0]);
+
+    if (str == NULL) {
+        return JS_EXCEPTION;
+    }
+
+    int width = utf8_text_width(str, len);
+
+    JS_FreeCString(ctx, str);
+    return JS_NewInt32(ctx, width);
+}
+
+
+/*
+ *  Terminal
+ */
+
+
+static int rawmode;  // enable_rawmode changed the terminal
+
+
+/*
+ *  Give the terminal back as it was found. Stdout is the tty the shell
+ *  shares, left non-blocking its reads would fail with EAGAIN.
+ */
+static int rawmode_restore(void)
+{
+    if (!rawmode) {
+        return 0;
+    }
+    rawmode = 0;
+
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+
+    if (flags != -1) {
+        fcntl(STDOUT_FILENO, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);  // bracketed paste off
+
+    return tcsetattr(STDIN_FILENO, TCSAFLUSH, &origin_termios);
+}
+
+
+void die(const char *s) {
+    int err = errno;
+
+    rawmode_restore();
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+
+    errno = err;
+    perror(s);
+    exit(1);
+}
+
+
+void disable_rawmode(void)
+{
+    if (rawmode_restore() == -1) {
+        die("tcsetattr");
+    }
+}
+
+
+static JSValue js_disable_rawmode(JSContext *ctx, JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    disable_rawmode();
+    return JS_UNDEFINED;
+}
+
+
+void enable_rawmode (void)
+{
+    if (tcgetattr(STDIN_FILENO, &origin_termios) == -1) {
+        die("tcgetattr");
+    }
+
+    struct termios raw = origin_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag &= ~(CS8);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    // reads never block, input_fill sleeps in poll instead
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+        die("tcsetattr");
+    }
+    rawmode = 1;
+
+    // pastes arrive wrapped in \x1b[200~ and \x1b[201~
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+
+    // a slow terminal makes refreshes drop frames instead of blocking
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+
+    if (flags != -1) {
+        fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+
+static JSValue js_enable_rawmode(JSContext *ctx, JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    enable_rawmode();
+    return JS_UNDEFINED;
+}
+
+
+void c_echo_status_message(struct editor_config *E,
+        const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E->status_msg, sizeof(E->status_msg), fmt, ap);
+    va_end(ap);
+    E->status_msg_time = time(NULL);
+}
+
+
+static JSValue js_echo_status_message(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    const char *str = JS_ToCString(ctx, argv[0]);
+    c_echo_status_message(s, str, NULL);
+    JS_FreeCString(ctx, str);
+
+    return JS_UNDEFINED;
+}
+
+
+static JSValue js_clean_screen(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    frame_send(s, "\x1b[2J", 4);
+    frame_invalidate(s);
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  Api
+ */
+
+
+void move_to_line(struct editor_config *E,
+        int at)
+{
+    at--;
+    if (at <= 0) {
+        at = 0;
+    }
+    else if (at >= E->numrows) {
+        at = E->numrows;
+    }
+
+    E->cy = at;
+}
+
+
+static JSValue js_move_to_line(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    int v;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    if (JS_ToInt32(ctx, &v, argv[0])) {
+        return JS_EXCEPTION;
+    }
+
+    move_to_line(s, v);
+    return JS_UNDEFINED;
+}
+
+
+static void move_to_line_of_end(struct editor_config *E)
+{
+    erow *row = editor_row_at(E, E->cy);
+
+    if (row) {
+        E->cx = row->size - 1;
+        utf8_fix_cx_position(E);
+    }
+}
+
+
+static JSValue js_move_to_line_of_end(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    move_to_line_of_end(s);
+    return JS_UNDEFINED;
+}
+
+
+static void move_cursur_left_or_previous_line(struct editor_config *E)
+{
+    E->cy--;
+    move_to_line_of_end(E);
+}
+
+
+static JSValue js_move_cursur_left_or_previous_line(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    move_cursur_left_or_previous_line(s);
+    return JS_UNDEFINED;
+}
+
+
+static void move_to_line_of_start(struct editor_config *E) {
+    E->cx = 0;
+}
+
+
+static JSValue js_move_to_line_of_start(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    move_to_line_of_start(s);
+    return JS_UNDEFINED;
+}
+
+
+static void fix_position(struct editor_config *E)
+{
+    erow *row = editor_row_at(E, E->cy);
+    int row_len = row ? row->size : 0;
+    if (row_len == 0) {
+        move_to_line_of_start(E);
+    }
+    else if (E->cx >= row_len) {
+        E->cx = row_len - 1;
+        utf8_fix_cx_position(E);
+    }
+}
+
+
+/*
+ *  Keep the cursor on the text after rows changed under it.
+ */
+static void cursor_clamp(struct editor_config *E)
+{
+    if (E->cy >= E->numrows) {
+        E->cy = E->numrows > 0 ? E->numrows - 1 : 0;
+    }
+
+    erow *row = editor_row_at(E, E->cy);
+
+    if (row == NULL) {
+        E->cx = 0;
+    }
+    else if (E->cx > row->size) {
+        E->cx = row->size;
+    }
+    utf8_fix_cx_position(E);
+}
+
+
+static JSValue js_fix_position(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    fix_position(s);
+    return JS_UNDEFINED;
+}
+
+
+static void move_to_next_line_of_start (struct editor_config *E)
+{
+    if (E->cy < (E->numrows - 1)) {
+        E->cy++;
+        move_to_line_of_start(E);
+    }
+}
+
+
+static void move_cursur_right_or_next_line(struct editor_config *E)
+{
+    erow *row = editor_row_at(E, E->cy);
+    int last = row ? erow_prev(row, row->size) : 0;
+
+    if (row && E->cx < last) {
+        move_cursur_right(E);
+    }
+    else if (row && (E->cx == last || row->size == 0)) {
+        move_to_next_line_of_start(E);
+    }
+}
+
+static JSValue js_move_cursur_right_or_next_line(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    move_cursur_right_or_next_line(s);
+    return JS_UNDEFINED;
+}
+
+
+static void move_cursur_right(struct editor_config *s)
+{
+    erow *row = editor_row_at(s, s->cy);
+
+    if (row) {
+        s->cx = erow_next(row, s->cx);
+    }
+}
+
+static JSValue js_utf8_move_cx_right(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    move_cursur_right(s);
+    return JS_UNDEFINED;
+}
+
+
+static void move_cursur_left(struct editor_config *s)
+{
+    erow *row = editor_row_at(s, s->cy);
+
+    if (row) {
+        s->cx = erow_prev(row, s->cx);
+    }
+}
+
+static JSValue js_utf8_move_cx_left(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    move_cursur_left(s);
+    return JS_UNDEFINED;
+}
+
+
+static void page_up (struct editor_config *E)
+{
+    int page = E->row_offset - E->rows;
+    erow *row = (E->cy <= 0) ? NULL : editor_row_at(E, E->cy);
+
+    if (row == NULL) {
+        NULL;
+    }
+    else if (page <= 0) {
+        E->cy = 0;
+    }
+    else {
+        E->cy -= E->rows;
+    }
+    fix_position(E);
+}
+
+static JSValue js_page_up(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    page_up(s);
+    return JS_UNDEFINED;
+}
+
+
+static void page_down(struct editor_config *E)
+{
+    int page = E->row_offset + E->rows;
+    erow *row = editor_row_at(E, E->cy);
+
+    if (row == NULL) {
+        NULL;
+    }
+    else if (page >= (E->numrows - E->rows)) {
+        E->cy = E->numrows - 1;
+    }
+    else {
+        E->cy += E->rows;
+    }
+    fix_position(E);
+}
+
+
+static JSValue js_page_down(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    page_down(s);
+    return JS_UNDEFINED;
+}
+
+
+static void utf8_fix_cx_position(struct editor_config *s)
+{
+    erow *row = editor_row_at(s, s->cy);
+
+    // rows may borrow a mapping, so never read past their bytes
+    if (row == NULL || s->cx < 0 || s->cx >= row->size) {
+        return;
+    }
+    s->cx = erow_prev(row, s->cx + 1);
+}
+
+
+static JSValue js_utf8_fix_cx_position(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    utf8_fix_cx_position(s);
+    return JS_UNDEFINED;
+}
+
+
+static JSValue js_move_cursur_home(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    frame_send(s, "\x1b[H", 3);
+    s->frame_x = 1;
+    s->frame_y = 1;
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  Input
+ */
+
+
+/*
+ *  Keys are decoded from a buffer filled by large reads, so typeahead
+ *  or a paste costs a few syscalls instead of one per byte.
+ */
+struct input_buffer {
+    unsigned char b[4096];
+    int start;
+    int end;
+};
+
+static struct input_buffer input;
+static struct abuf paste = ABUF_INIT;
+
+
+/*
+ *  How long the rest of an escape sequence may take to arrive.
+ */
+#define INPUT_ESC_WAIT 100
+
+/*
+ *  How long a paste may go quiet before what came of it is taken, for
+ *  when its closing sequence is lost.
+ */
+#define INPUT_PASTE_WAIT 1000
+
+
+/*
+ *  Read what is pending, waiting up to wait ms (forever when -1) for
+ *  something to arrive. The process sleeps in poll while idle.
+ */
+static int input_fill(int wait)
+{
+    if (input.start == input.end) {
+        input.start = 0;
+        input.end = 0;
+    }
+    else if (input.start > 0) {
+        memmove(input.b, &input.b[input.start], input.end - input.start);
+        input.end -= input.start;
+        input.start = 0;
+    }
+
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    int ready = poll(&pfd, 1, wait);
+
+    if (ready == -1 && errno != EINTR) {
+        die("poll");
+    }
+    if (ready <= 0) {
+        return 0;
+    }
+
+    int nread = read(STDIN_FILENO, &input.b[input.end],
+            sizeof(input.b) - input.end);
+
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+        die("read");
+    }
+    if (nread == 0) {
+        // the terminal went away, do not spin on a dead descriptor
+        errno = EIO;
+        die("read");
+    }
+    if (nread > 0) {
+        input.end += nread;
+    }
+    return nread;
+}
+
+
+static int input_next(unsigned char *c, int wait)
+{
+    if (input.start == input.end && input_fill(wait) <= 0) {
+        return 0;
+    }
+
+    *c = input.b[input.start++];
+    return 1;
+}
+
+
+/*
+ *  How long the terminal may take to report the cursor position.
+ */
+#define CURSOR_REPLY_WAIT 500
+
+
+/*
+ *  Length of the \x1b[rows;colsR at p, 0 when there is none.
+ */
+static int cursor_reply_parse(const unsigned char *p,
+        const unsigned char *end, int *rows, int *cols)
+{
+    int v[2] = {0, 0};
+    const unsigned char *q = p + 2;
+
+    if (end - p < 2 || p[0] != '\x1b' || p[1] != '[') {
+        return 0;
+    }
+    for (int k = 0; k < 2; k++) {
+        const unsigned char *digits = q;
+
+        while (q < end && isdigit(*q)) {
+            v[k] = v[k] * 10 + (*q++ - '0');
+        }
+        if (q == digits || q == end || *q != (k ? 'R' : ';')) {
+            return 0;
+        }
+        q++;
+    }
+
+    *rows = v[0];
+    *cols = v[1];
+    return q - p;
+}
+
+
+/*
+ *  The reply is read through the input buffer and cut out of it, keys
+ *  typed before it arrived stay queued.
+ */
+int get_cursor_position(int *rows, int *cols) {
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
+        return -1;
+    }
+
+    for (;;) {
+        for (int i = input.start; i < input.end; i++) {
+            int n = cursor_reply_parse(&input.b[i], &input.b[input.end],
+                    rows, cols);
+
+            if (n > 0) {
+                memmove(&input.b[i], &input.b[i + n], input.end - i - n);
+                input.end -= n;
+                return 0;
+            }
+        }
+
+        // a full buffer holds no reply and cannot take one
+        if (input.start == 0 && input.end == (int)sizeof(input.b)) {
+            return -1;
+        }
+        errno = 0;
+        if (input_fill(CURSOR_REPLY_WAIT) <= 0
+                && errno != EINTR && errno != EAGAIN) {
+            return -1;
+        }
+    }
+}
+
+
+int get_window_size(int *rows, int *cols) {
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1
+          || ws.ws_col == 0) {
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
+            return -1;
+        }
+        return get_cursor_position(rows, cols);
+    }
+    else {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+
+/*
+ *  Whether Ctrl-C was typed, for long jobs that look between steps.
+ *  Keys typed before it go with it, the ones after it stay queued.
+ */
+static int input_interrupted(int wait)
+{
+    // a full buffer cannot take more, the keys in it are dropped
+    if (input.start == 0 && input.end == (int)sizeof(input.b)) {
+        input.start = input.end;
+    }
+    input_fill(wait);
+
+    unsigned char *c = memchr(&input.b[input.start], CTRL_('c'),
+            input.end - input.start);
+
+    if (c == NULL) {
+        return 0;
+    }
+    input.start = c - input.b + 1;
+    return 1;
+}
+
+
+static void paste_put(char *chunk, int *len, const char *s, int n)
+{
+    if (*len + n > 1024) {
+        abuf_append(&paste, chunk, *len);
+        *len = 0;
+    }
+    memcpy(&chunk[*len], s, n);
+    *len += n;
+}
+
+
+/*
+ *  Collect the text of a bracketed paste up to its closing \x1b[201~,
+ *  or up to where the terminal stopped sending.
+ */
+static void input_read_paste(void)
+{
+    static const char end[] = "\x1b[201~";
+    char chunk[1024];
+    int len = 0;
+    int matched = 0;
+    unsigned char c;
+
+    abuf_free(&paste);
+    paste.b = NULL;
+    paste.len = 0;
+
+    while (matched < (int)sizeof(end) - 1) {
+        errno = 0;
+        if (!input_next(&c, INPUT_PASTE_WAIT)) {
+            // a signal cut the wait short, only a quiet terminal ends it
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            break;
+        }
+
+        if (c == end[matched]) {
+            matched++;
+            continue;
+        }
+
+        // what looked like the end was text after all
+        paste_put(chunk, &len, end, matched);
+        matched = 0;
+
+        if (c == end[0]) {
+            matched = 1;
+        }
+        else {
+            paste_put(chunk, &len, (char *)&c, 1);
+        }
+    }
+
+    if (len > 0) {
+        abuf_append(&paste, chunk, len);
+    }
+}
+
+
+int editor_read_key (void) {
+    unsigned char c;
+
+    while (!input_next(&c, -1)) {
+    }
+
+    if (c == '\x1b') {
+        unsigned char seq[2];
+
+        if (!input_next(&seq[0], INPUT_ESC_WAIT)) {
+            return '\x1b';
+        }
+        if (!input_next(&seq[1], INPUT_ESC_WAIT)) {
+            return '\x1b';
+        }
+
+        if (seq[0] == '[') {
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                int code = seq[1] - '0';
+                int first = 1;  // still in the first number
+                unsigned char f;
+
+                // parameters run up to the final byte, all of it is read
+                for (;;) {
+                    if (!input_next(&f, INPUT_ESC_WAIT)) {
+                        return '\x1b';
+                    }
+                    if (f >= '0' && f <= '9') {
+                        if (first && code < 10000) {
+                            code = code * 10 + f - '0';
+                        }
+                    }
+                    else if (f >= 0x20 && f <= 0x3f) {
+                        first = 0;
+                    }
+                    else {
+                        break;
+                    }
+                }
+
+                if (f == '~') {
+                    switch (code) {
+                        case 1: return HOME_KEY;
+                        case 3: return DEL_KEY;
+                        case 4: return END_KEY;
+                        case 5: return PAGE_UP;
+                        case 6: return PAGE_DOWN;
+                        case 7: return HOME_KEY;
+                        case 8: return END_KEY;
+                        case 200:
+                            input_read_paste();
+                            return PASTE_KEY;
+                    }
+                }
+            }
+            else {
+                switch (seq[1]) {
+                    /* Arrow Key */
+                    case 'A': // up
+                        return ARROW_UP;
+                    case 'B': // down
+                        return ARROW_DOWN;
+                    case 'C': // right
+                        return ARROW_RIGHT;
+                    case 'D': // left
+                        return ARROW_LEFT;
+                    case 'H':
+                        return HOME_KEY;
+                    case 'F':
+                        return END_KEY;
+                }
+            }
+        }
+        else if (seq[0] == '0') {
+            switch (seq[1]) {
+                case 'H':
+                    return HOME_KEY;
+                case 'F':
+                    return END_KEY;
+            }
+        }
+
+        return '\x1b';
+    }
+    else {
+        return c;
+    }
+}
+
+
+static JSValue js_editor_read_key(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    return JS_NewInt32(ctx, editor_read_key());
+}
+
+
+/*
+ *  Whether a key can be read without waiting, for event loops that
+ *  wake up on stdin and must drain what input already buffered.
+ */
+static JSValue js_key_pending(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    if (input.start < input.end) {
+        return JS_TRUE;
+    }
+
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+    return JS_NewBool(ctx, poll(&pfd, 1, 0) > 0);
+}
+
+
+/*
+ *  Consume copies of key queued right behind it and return how many,
+ *  so a held motion key can be applied as one jump. Only plain keys
+ *  and arrows are matched.
+ */
+static JSValue js_skip_repeats(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    int key;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (JS_ToInt32(ctx, &key, argv[0])) {
+        return JS_EXCEPTION;
+    }
+
+    char seq[3];
+    int len = 3;
+
+    if (key > ' ' && key < 127) {
+        seq[0] = key;
+        len = 1;
+    }
+    else if (key >= ARROW_LEFT && key <= ARROW_DOWN) {
+        seq[0] = '\x1b';
+        seq[1] = '[';
+        seq[2] = "DCAB"[key - ARROW_LEFT];
+    }
+    else {
+        return JS_NewInt32(ctx, 0);
+    }
+
+    int n = 0;
+
+    for (;;) {
+        if (input.end - input.start < len && input_fill(0) <= 0) {
+            break;
+        }
+        if (input.end - input.start < len
+                || memcmp(&input.b[input.start], seq, len) != 0) {
+            break;
+        }
+        input.start += len;
+        n++;
+    }
+    return JS_NewInt32(ctx, n);
+}
+
+
+/*
+ *  Milliseconds until the status message expires and the screen needs
+ *  a refresh, -1 when no message is up.
+ */
+static JSValue js_status_timeout(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    time_t left = s->status_msg_time + WOE_MSG_TIME - time(NULL);
+
+    if (s->status_msg[0] == '\0' || left <= 0) {
+        return JS_NewInt32(ctx, -1);
+    }
+    return JS_NewInt32(ctx, left * 1000);
+}
+
+
+static JSValue js_update_window_size(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    if (get_window_size(&(s->rows), &(s->cols)) == -1) {
+        return JS_UNDEFINED;
+    }
+    s->rows -= 2;
+    frame_invalidate(s);
+    frame_send(s, "\x1b[2J", 4);
+    return JS_UNDEFINED;
+}
+
+
+void editor_row_free(erow *row) {
+    if (erow_is_gap(row)) {
+        free(row->chars);
+    }
+    else {
+        text_block_unref(row->block);
+    }
+
+    row->chars   = NULL;
+    row->block   = NULL;
+    row->gap     = 0;
+    row->gap_len = 0;
+}
+
+
+void editor_row_delete(struct editor_config *E, int at) {
+    if (at < 0 || at >= E->numrows) {
+        return;
+    }
+
+    erow row;
+
+    line_tree_delete(&E->lines, at, &row);
+    editor_row_free(&row);
+
+    E->numrows--;
+    E->changed++;
+}
+
+
+static unsigned long row_gen;
+
+
+/*
+ *  Rows are only rendered when drawn, see editor_row_render. A fresh
+ *  stamp makes the render cache drop what it had for the old text.
+ */
+void editor_row_update(erow *row) {
+    row->gen = ++row_gen;
+}
+
+
+/*
+ *  Put a filled in row into the tree at `at`.
+ */
+static void editor_row_link(struct editor_config *E, int at, erow *row)
+{
+    editor_row_update(row);
+    line_tree_insert(&E->lines, at, row);
+
+    E->numrows++;
+    E->changed++;
+}
+
+
+void editor_row_insert(struct editor_config *E,
+    int at, const char *s, size_t len)
+{
+    if (at < 0 || at > E->numrows) {
+        return;
+    }
+
+    erow row;
+
+    row.size    = len;
+    row.chars   = NULL;
+    row.block   = NULL;
+    row.gap     = 0;
+    row.gap_len = 0;
+
+    if (len > 0) {
+        row.chars = add_buffer_append(E, s, len);
+        row.block = text_block_ref(E->add);
+    }
+
+    editor_row_link(E, at, &row);
+}
+
+static JSValue js_editor_row_insert(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque(this_val, js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    int at, len;
+    size_t str_len;
+
+    if (JS_ToInt32(ctx, &at, argv[0]) || JS_ToInt32(ctx, &len, argv[2])) {
+        return JS_EXCEPTION;
+    }
+    if (len < 0) {
+        return JS_ThrowRangeError(ctx, "row_insert: length %d", len);
+    }
+
+    const char *str = JS_ToCStringLen(ctx, &str_len, argv[1]);
+
+    if (str == NULL) {
+        return JS_EXCEPTION;
+    }
+
+    // what goes in the history and the journal is what was given
+    if ((size_t) len > str_len) {
+        len = str_len;
+    }
+    if (at >= 0 && at <= s->numrows) {
+        undo_row_add(s, at, str, len);
+        editor_row_insert(s, at, str, len);
+    }
+    JS_FreeCString(ctx, str);
+    return JS_UNDEFINED;
+}
+
+
+void editor_row_insert_string(struct editor_config *E,
+    erow *row, int at, const char *s, int len)
+{
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+    if (len <= 0) {
+        return;
+    }
+
+    erow_gap_reserve(row, len);
+    erow_gap_move(row, at);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap     += len;
+    row->gap_len -= len;
+    row->size    += len;
+    editor_row_update(row);
+
+    E->changed++;
+}
+
+
+void editor_row_insert_char(struct editor_config *E,
+    erow *row, int at, int c)
+{
+    char ch = c;
+
+    editor_row_insert_string(E, row, at, &ch, 1);
+}
+
+
+void editor_row_append_string(struct editor_config *E,
+        erow *row, char *s, size_t len)
+{
+    erow_gap_reserve(row, len);
+    erow_gap_move(row, row->size);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap     += len;
+    row->gap_len -= len;
+    row->size    += len;
+    editor_row_update(row);
+    E->changed++;
+}
+
+
+/*
+ *  Append the bytes of from to row.
+ */
+static void editor_row_append_row(struct editor_config *E,
+        erow *row, erow *from)
+{
+    erow_gap_reserve(row, from->size);
+    erow_gap_move(row, row->size);
+
+    for (int k = 0; k < erow_nspans(from); k++) {
+        int len;
+        char *p = erow_span(from, k, &len);
+
+        memcpy(&row->chars[row->gap], p, len);
+        row->gap     += len;
+        row->gap_len -= len;
+        row->size    += len;
+    }
+
+    editor_row_update(row);
+    E->changed++;
+}
+
+
+/*
+ *  Cut row y at `at`, the bytes from there on go to a new row
+ *  inserted below it.
+ */
+static void editor_row_split(struct editor_config *E, int y, int at)
+{
+    erow *row = editor_row_at(E, y);
+    int len = row->size - at;
+    erow tail;
+
+    tail.size    = len;
+    tail.chars   = NULL;
+    tail.block   = NULL;
+    tail.gap     = 0;
+    tail.gap_len = 0;
+
+    // a view just gets shorter and shares its block with the tail
+    if (erow_is_gap(row)) {
+        erow_gap_move(row, at);
+        if (len > 0) {
+            tail.chars = add_buffer_append(E,
+                    row->chars + row->gap + row->gap_len, len);
+            tail.block = text_block_ref(E->add);
+        }
+        row->gap_len += len;
+    }
+    else if (len > 0) {
+        tail.chars = row->chars + at;
+        tail.block = text_block_ref(row->block);
+    }
+
+    row->size = at;
+    editor_row_update(row);
+    E->changed++;
+
+    editor_row_link(E, y + 1, &tail);
+}
+
+
+int editor_row_delete_char(struct editor_config *E,
+        erow *row, int at)
+{
+    if (at < 0 || at >= row->size) {
+        return 0;
+    }
+
+    // a character goes with its combining marks
+    int remove_len = erow_next(row, at) - at;
+
+    erow_gap_reserve(row, 0);
+    erow_gap_move(row, at);
+    row->gap_len += remove_len;
+    row->size    -= remove_len;
+
+    editor_row_update(row);
+    E->changed++;
+    return remove_len;
+}
+
+
+/*
+ *  Remove len bytes of row from `at` on.
+ */
+static void editor_row_cut(struct editor_config *E,
+        erow *row, int at, int len)
+{
+    if (len <= 0) {
+        return;
+    }
+
+    erow_gap_reserve(row, 0);
+    erow_gap_move(row, at);
+    row->gap_len += len;
+    row->size    -= len;
+
+    editor_row_update(row);
+    E->changed++;
+}
+
+
+void c_delete_char(struct editor_config *E)
+{
+    if (E->cy == E->numrows) {
+        return;
+    }
+    if (E->cx == 0 && E->cy == 0) {
+        return;
+    }
+
+    erow *row = editor_row_at(E, E->cy);
+    if (E->cx > 0) {
+        char small[16];
+
+        move_cursur_left(E);
+
+        int n = erow_next(row, E->cx) - E->cx;
+        char *cut = n <= (int) sizeof(small) ? small : malloc(n);
+
+        if (cut == NULL) {
+            die("malloc");
+        }
+        for (int i = 0; i < n; i++) {
+            cut[i] = erow_char(row, E->cx + i);
+        }
+        n = editor_row_delete_char(E, row, E->cx);
+        if (n > 0) {
+            undo_delete(E, E->cy, E->cx, cut, n);
+        }
+        if (cut != small) {
+            free(cut);
+        }
+    }
+    else {
+        erow *prev = editor_row_at(E, E->cy - 1);
+
+        undo_delete(E, E->cy - 1, prev->size, "\n", 1);
+        E->cx = prev->size;
+        editor_row_append_row(E, prev, row);
+        editor_row_delete(E, E->cy);
+        E->cy--;
+        utf8_fix_cx_position(E);
+    }
+}
+
+
+static JSValue js_delete_char(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque(this_val, js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    c_delete_char(s);
+    return JS_UNDEFINED;
+}
+
+
+void c_insert_char(struct editor_config *s,
+        int c)
+{
+    if (s->cy == s->numrows) {
+        undo_row_add(s, s->numrows, "", 0);
+        editor_row_insert(s, s->numrows, "", 0);
+    }
+
+    erow *row = editor_row_at(s, s->cy);
+    char ch = c;
+
+    undo_insert(s, s->cy, s->cx < row->size ? s->cx : row->size, &ch, 1);
+    editor_row_insert_char(s, row, s->cx, c);
+    s->cx++;
+}
+
+
+static JSValue js_insert_char(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque(this_val, js_vt100_class_id);
+
+    int v;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (JS_ToInt32(ctx, &v, argv[0])) {
+        return JS_EXCEPTION;
+    }
+    c_insert_char(s, v);
+    return JS_UNDEFINED;
+}
+
+
+void c_insert_newline(struct editor_config *E)
+{
+    erow *row = editor_row_at(E, E->cy);
+
+    if (row == NULL) {
+        undo_row_add(E, E->cy, "", 0);
+    }
+    else {
+        undo_insert(E, E->cy, E->cx < row->size ? E->cx : row->size, "\n", 1);
+    }
+
+    if (E->cx == 0 || row == NULL) {
+        editor_row_insert(E, E->cy, "", 0);
+    }
+    else if (E->cx >= row->size) {
+        editor_row_insert(E, E->cy + 1, "", 0);
+    }
+    else {
+        editor_row_split(E, E->cy, E->cx);
+    }
+
+    E->cy++;
+    E->cx = 0;
+}
+
+
+static JSValue js_insert_newline(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque(this_val, js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    c_insert_newline(s);
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  End of the line at p: typed or pasted text breaks at \r or \n, raw
+ *  text only at \n, like line_next, and keeps any \r in its rows.
+ */
+static const char *line_break(const char *p, const char *end, int raw)
+{
+    if (raw) {
+        const char *nl = memchr(p, '\n', end - p);
+
+        return nl ? nl : end;
+    }
+    while (p < end && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    return p;
+}
+
+
+/*
+ *  Text with its \r\n and \r line breaks made \n, the way the history
+ *  keeps it; NULL when it has no \r.
+ */
+static char *line_breaks_raw(const char *s, size_t len, size_t *raw_len)
+{
+    if (len == 0 || memchr(s, '\r', len) == NULL) {
+        return NULL;
+    }
+
+    char *t = malloc(len);
+    size_t n = 0;
+
+    if (t == NULL) {
+        die("malloc");
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] != '\r') {
+            t[n++] = s[i];
+            continue;
+        }
+        t[n++] = '\n';
+        if (i + 1 < len && s[i + 1] == '\n') {
+            i++;
+        }
+    }
+    *raw_len = n;
+    return t;
+}
+
+
+/*
+ *  Insert text at the cursor in one go, see line_break for where lines
+ *  end. The row is split once: the first line goes after its head, the
+ *  last one before its tail and the ones between become new rows.
+ */
+static void editor_insert_text(struct editor_config *E,
+        const char *s, size_t len, int raw)
+{
+    const char *end = s + len;
+    const char *p = line_break(s, end, raw);
+
+    if (E->cy == E->numrows) {
+        undo_row_add(E, E->numrows, "", 0);
+        editor_row_insert(E, E->numrows, "", 0);
+    }
+    if (E->cx > editor_row_at(E, E->cy)->size) {
+        E->cx = editor_row_at(E, E->cy)->size;
+    }
+
+    size_t raw_len;
+    char *logged = raw ? NULL : line_breaks_raw(s, len, &raw_len);
+
+    if (logged) {
+        undo_insert(E, E->cy, E->cx, logged, raw_len);
+        free(logged);
+    }
+    else {
+        undo_insert(E, E->cy, E->cx, s, len);
+    }
+
+    if (p == end) {
+        editor_row_insert_string(E, editor_row_at(E, E->cy), E->cx, s, len);
+        E->cx += len;
+        return;
+    }
+
+    editor_row_split(E, E->cy, E->cx);
+    editor_row_insert_string(E, editor_row_at(E, E->cy), E->cx, s, p - s);
+
+    for (;;) {
+        s = p + 1;
+        if (!raw && *p == '\r' && s < end && *s == '\n') {
+            s++;
+        }
+        p = line_break(s, end, raw);
+        E->cy++;
+
+        if (p == end) {
+            break;
+        }
+        editor_row_insert(E, E->cy, s, p - s);
+    }
+
+    editor_row_insert_string(E, editor_row_at(E, E->cy), 0, s, p - s);
+    E->cx = p - s;
+}
+
+
+void c_insert_text(struct editor_config *E, const char *s, int len)
+{
+    editor_insert_text(E, s, len, 0);
+}
+
+
+/*
+ *  Put back text as rows held it, for undo and the journal.
+ */
+static void editor_insert_raw(struct editor_config *E,
+        const char *s, size_t len)
+{
+    editor_insert_text(E, s, len, 1);
+}
+
+
+static JSValue js_insert_paste(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque(this_val, js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (paste.len > 0) {
+        c_insert_text(s, paste.b, paste.len);
+    }
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  Journal
+ */
+
+
+/*
+ *  Every change the undo log sees is also appended, as a few bytes, to
+ *  .name.jnl next to the file: a thread writes what gathered every
+ *  JOURNAL_COMMIT_MS in one go, so typing never waits on the disk. The
+ *  header names the file as it was read or last saved, the records are
+ *  the edits made to it since. When the editor dies with unsaved edits
+ *  the next file_open finds the journal and they can be replayed.
+ *
+ *  A record is a type byte and LEB128 numbers: y x len text for an
+ *  insert, y x ey ex for a delete, y len text for a row put in or given
+ *  new text, y for a row taken out.
+ */
+#define JOURNAL_MAGIC     "WOEJ"
+#define JOURNAL_VERSION   1
+#define JOURNAL_COMMIT_MS 200
+#define JOURNAL_HEAD_MAX  (1 + 5 * 10)  // type and varints of a record
+
+
+enum journal_type {
+    JOURNAL_INSERT,
+    JOURNAL_DELETE,
+    JOURNAL_ROW_ADD,
+    JOURNAL_ROW_DEL,
+    JOURNAL_ROW_SET,
+};
+
+
+struct journal_head {
+    char magic[4];
+    uint32_t version;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t sec;
+    int64_t nsec;
+};
+
+
+struct journal {
+    char *path;
+    struct file_stamp base;  // the file the records apply to
+    int fsync;
+    int fd;       // opened by the thread on its first write
+    int exists;   // the file holds base's header already
+    size_t total;  // bytes of records, written or not
+    pthread_t thread;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    char *buf;  // records not written yet
+    size_t len;
+    size_t cap;
+    char *out;  // what the thread is writing
+    size_t out_cap;
+};
+
+
+struct journal_op {
+    int type;
+    int y;
+    int x;
+    int ey;
+    int ex;
+    const char *text;
+    size_t len;
+};
+
+
+static void journal_head_fill(struct journal_head *h, struct file_stamp *d)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, JOURNAL_MAGIC, 4);
+    h->version = JOURNAL_VERSION;
+    h->dev     = d->dev;
+    h->ino     = d->ino;
+    h->size    = d->size;
+    h->sec     = d->mtime.tv_sec;
+    h->nsec    = d->mtime.tv_nsec;
+}
+
+
+static int journal_head_same(struct journal_head *h, struct file_stamp *d)
+{
+    struct journal_head now;
+
+    journal_head_fill(&now, d);
+    return memcmp(h, &now, sizeof(now)) == 0;
+}
+
+
+static int journal_write_all(int fd, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/*
+ *  Write records to the journal, creating it on the first call. What
+ *  cannot be written is lost; the file itself is untouched either way.
+ */
+static void journal_out(struct journal *j, const char *p, size_t len)
+{
+    if (j->fd == -1 && j->exists) {
+        j->fd = open(j->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    else if (j->fd == -1) {
+        struct journal_head h;
+
+        journal_head_fill(&h, &j->base);
+        j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (j->fd != -1
+                && journal_write_all(j->fd, (char *) &h, sizeof(h)) == -1) {
+            close(j->fd);
+            j->fd = -1;
+        }
+        j->exists = j->fd != -1;
+    }
+    if (j->fd == -1) {
+        return;
+    }
+
+    journal_write_all(j->fd, p, len);
+    if (j->fsync) {
+        fdatasync(j->fd);
+    }
+}
+
+
+/*
+ *  The group commit: once records come in, wait a little for more and
+ *  write them all at once.
+ */
+static void *journal_run(void *arg)
+{
+    struct journal *j = arg;
+
+    pthread_mutex_lock(&j->lock);
+    for (;;) {
+        while (j->len == 0 && !j->stop) {
+            pthread_cond_wait(&j->wake, &j->lock);
+        }
+        if (j->len == 0) {
+            break;
+        }
+
+        struct timespec t;
+
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+        t.tv_sec  += t.tv_nsec / 1000000000L;
+        t.tv_nsec %= 1000000000L;
+        while (!j->stop
+                && pthread_cond_timedwait(&j->wake, &j->lock, &t) != ETIMEDOUT);
+
+        char *p    = j->buf;
+        size_t len = j->len;
+        size_t cap = j->cap;
+
+        j->buf     = j->out;
+        j->cap     = j->out_cap;
+        j->len     = 0;
+        j->out     = p;
+        j->out_cap = cap;
+
+        pthread_mutex_unlock(&j->lock);
+        journal_out(j, p, len);
+        pthread_mutex_lock(&j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+
+static struct journal *journal_new(struct editor_config *E)
+{
+    struct journal *j = calloc(1, sizeof(*j));
+
+    if (j == NULL) {
+        die("calloc");
+    }
+    j->path  = file_side_path(E->filename, "jnl");
+    j->base  = E->disk;
+    j->fsync = E->save_fsync;
+    j->fd    = -1;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->wake, NULL);
+    return j;
+}
+
+
+static void journal_append(struct journal *j, const char *s, size_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    if (j->len + len > j->cap) {
+        size_t cap = j->cap ? j->cap : 4096;
+
+        while (cap < j->len + len) {
+            cap *= 2;
+        }
+
+        char *buf = realloc(j->buf, cap);
+
+        if (buf == NULL) {
+            die("realloc");
+        }
+        j->buf = buf;
+        j->cap = cap;
+    }
+    memcpy(j->buf + j->len, s, len);
+    j->len += len;
+}
+
+
+/*
+ *  Hand a record to the thread, or write it right here when there is
+ *  no thread to be had.
+ */
+static void journal_put(struct journal *j, const char *head, size_t head_len,
+        const char *s, size_t len)
+{
+    if (!j->running) {
+        j->running = pthread_create(&j->thread, NULL, journal_run, j) == 0;
+    }
+
+    pthread_mutex_lock(&j->lock);
+
+    int idle = j->len == 0;
+
+    journal_append(j, head, head_len);
+    journal_append(j, s, len);
+    if (idle) {
+        pthread_cond_signal(&j->wake);
+    }
+    pthread_mutex_unlock(&j->lock);
+    j->total += head_len + len;
+
+    if (!j->running) {
+        journal_out(j, j->buf, j->len);
+        j->len = 0;
+    }
+}
+
+
+/*
+ *  Wait until the thread wrote everything, and close the journal.
+ */
+static void journal_stop(struct journal *j)
+{
+    if (j->running) {
+        pthread_mutex_lock(&j->lock);
+        j->stop = 1;
+        pthread_cond_signal(&j->wake);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->thread, NULL);
+        j->running = 0;
+        j->stop    = 0;
+    }
+    if (j->fd != -1) {
+        close(j->fd);
+        j->fd = -1;
+    }
+}
+
+
+/*
+ *  The edits are saved or given up on, the journal goes. Only a crash
+ *  leaves one on disk for the next file_open to find.
+ */
+static void journal_free(struct journal *j)
+{
+    if (j == NULL) {
+        return;
+    }
+    journal_stop(j);
+    unlink(j->path);
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->wake);
+    free(j->path);
+    free(j->buf);
+    free(j->out);
+    free(j);
+}
+
+
+static void journal_drop(struct editor_config *E)
+{
+    journal_free(E->journal);
+    E->journal       = NULL;
+    E->journal_found = 0;
+}
+
+
+static char *journal_varint(char *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+
+/*
+ *  Log a change of the current buffer. Rows dropped while following
+ *  are not in the file either, so their edits cannot be replayed.
+ */
+static void journal_record(struct editor_config *E, int type,
+        int y, int x, int ey, int ex, const char *s, size_t len)
+{
+    char head[JOURNAL_HEAD_MAX];
+    char *p = head;
+
+    if (E->filename == NULL || E->disk.ino == 0 || E->follow_dropped) {
+        return;
+    }
+    if (E->journal == NULL) {
+        E->journal = journal_new(E);
+    }
+
+    *p++ = type;
+    p = journal_varint(p, y);
+    switch (type) {
+        case JOURNAL_INSERT:
+            p = journal_varint(p, x);
+            p = journal_varint(p, len);
+            break;
+        case JOURNAL_DELETE:
+            p = journal_varint(p, x);
+            p = journal_varint(p, ey);
+            p = journal_varint(p, ex);
+            len = 0;
+            break;
+        case JOURNAL_ROW_ADD:
+        case JOURNAL_ROW_SET:
+            p = journal_varint(p, len);
+            break;
+        default:
+            len = 0;
+            break;
+    }
+    journal_put(E->journal, head, p - head, s, len);
+}
+
+
+/*
+ *  Log that row y holds new text now.
+ */
+static void journal_row_set(struct editor_config *E, int y)
+{
+    erow *row = editor_row_at(E, y);
+
+    if (erow_is_gap(row)) {
+        erow_gap_move(row, row->size);
+    }
+    journal_record(E, JOURNAL_ROW_SET, y, 0, 0, 0, row->chars, row->size);
+}
+
+
+static size_t journal_mark(struct journal *j)
+{
+    return j ? j->total : 0;
+}
+
+
+/*
+ *  The file was saved from a snapshot that held the first mark bytes of
+ *  records. Those are in the file now, the rest is kept under a header
+ *  naming the new file, d.
+ */
+static void journal_saved(struct journal **jp, int unchanged, size_t mark,
+        struct file_stamp *d)
+{
+    struct journal *j = *jp;
+
+    if (j == NULL) {
+        return;
+    }
+    if (unchanged) {
+        journal_free(j);
+        *jp = NULL;
+        return;
+    }
+
+    journal_stop(j);
+
+    size_t len = j->total - mark;
+    char *tail = malloc(len);
+    int fd = open(j->path, O_RDONLY | O_CLOEXEC);
+    int ok = tail && fd != -1
+        && pread(fd, tail, len, sizeof(struct journal_head) + mark)
+            == (ssize_t) len;
+
+    if (fd != -1) {
+        close(fd);
+    }
+    unlink(j->path);
+    j->base   = *d;
+    j->exists = 0;
+    j->total  = 0;
+    if (ok) {
+        journal_put(j, tail, len, NULL, 0);
+    }
+    free(tail);
+}
+
+
+/*
+ *  Whether file_open left a journal of edits to the file as it is on
+ *  disk now, one from a crash.
+ */
+static void journal_check(struct editor_config *E)
+{
+    struct journal_head h;
+    struct stat st;
+
+    E->journal_found = 0;
+    if (E->filename == NULL || E->disk.ino == 0) {
+        return;
+    }
+
+    char *path = file_side_path(E->filename, "jnl");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    free(path);
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > (off_t) sizeof(h)
+            && read(fd, &h, sizeof(h)) == sizeof(h)) {
+        if (journal_head_same(&h, &E->disk)) {
+            E->journal_found = 1;
+            c_echo_status_message(E, "%s has unsaved edits from a crash",
+                    E->filename);
+        }
+        else {
+            c_echo_status_message(E,
+                    "%s changed since its journal was written", E->filename);
+        }
+    }
+    close(fd);
+}
+
+
+/*
+ *  Undo
+ */
+
+
+/*
+ *  Every change is logged as the bytes it inserted or deleted at a
+ *  position, lines joined by '\n', so undoing it only touches those
+ *  bytes. Copied text goes to append-only chunks like the add buffer,
+ *  and typing next to the last change grows its entry in place. Past
+ *  undo_limit bytes the oldest entries go first, never the newest.
+ */
+#define UNDO_CHUNK (64 << 10)
+#define UNDO_LIMIT (64 << 20)
+
+
+enum undo_type {
+    UNDO_INSERT,
+    UNDO_DELETE,   // text is kept back to front, backspaces prepend
+    UNDO_ROW_ADD,  // a whole row put in at y
+    UNDO_ROWS      // rows given new contents, by a replace
+};
+
+
+struct undo_rows {
+    int n;
+    int *ys;
+    erow *rows;  // what rows ys held before, or after, the change
+};
+
+
+struct undo_op {
+    int type;
+    int y;
+    int x;
+    unsigned long group;  // undone and redone as one
+    const char *text;
+    size_t len;
+    struct text_block *block;  // holds text
+    struct undo_rows *rows;
+    size_t bytes;  // counted against the limit
+};
+
+
+struct undo_log {
+    struct undo_op *ops;
+    int head;  // oldest op kept
+    int pos;   // ops before pos can be undone, from pos on redone
+    int n;
+    int cap;
+    size_t bytes;
+    struct text_block *arena;
+    size_t arena_cap;
+    unsigned long group;
+    int sealed;  // the next change starts a new group
+    int end_y;   // where the last change left off
+    int end_x;
+    int replaying;
+};
+
+
+static void undo_rows_free(struct undo_rows *rows)
+{
+    if (rows == NULL) {
+        return;
+    }
+    for (int i = 0; i < rows->n; i++) {
+        editor_row_free(&rows->rows[i]);
+    }
+    free(rows->ys);
+    free(rows->rows);
+    free(rows);
+}
+
+
+static void undo_op_free(struct undo_op *op)
+{
+    text_block_unref(op->block);
+    undo_rows_free(op->rows);
+}
+
+
+static void undo_log_free(struct undo_log *u)
+{
+    if (u == NULL) {
+        return;
+    }
+
+    for (int i = u->head; i < u->n; i++) {
+        undo_op_free(&u->ops[i]);
+    }
+    free(u->ops);
+    text_block_unref(u->arena);
+    free(u);
+}
+
+
+static void undo_clear(struct editor_config *E)
+{
+    undo_log_free(E->undo);
+    E->undo = NULL;
+}
+
+
+/*
+ *  Room for len bytes of text that stays put, held by *block.
+ */
+static char *undo_alloc(struct undo_log *u, size_t len,
+        struct text_block **block)
+{
+    if (len > UNDO_CHUNK / 4) {
+        char *base = malloc(len);
+
+        if (base == NULL) {
+            die("malloc");
+        }
+        *block = text_block_ref(text_block_new(base, len, 0));
+        return base;
+    }
+
+    if (u->arena == NULL || u->arena->len + len > u->arena_cap) {
+        char *base = malloc(UNDO_CHUNK);
+
+        if (base == NULL) {
+            die("malloc");
+        }
+        text_block_unref(u->arena);
+        u->arena = text_block_ref(text_block_new(base, 0, 0));
+        u->arena_cap = UNDO_CHUNK;
+    }
+
+    char *p = u->arena->base + u->arena->len;
+
+    u->arena->len += len;
+    *block = text_block_ref(u->arena);
+    return p;
+}
+
+
+static void undo_put(char *p, const char *s, size_t len, int reverse)
+{
+    if (!reverse) {
+        memcpy(p, s, len);
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        p[i] = s[len - 1 - i];
+    }
+}
+
+
+/*
+ *  Add s to the end of op's text, in place when nothing was put in the
+ *  arena after it.
+ */
+static void undo_extend(struct undo_log *u, struct undo_op *op,
+        const char *s, size_t len, int reverse)
+{
+    struct text_block *b = op->block;
+
+    if (b == u->arena && op->text + op->len == b->base + b->len
+            && b->len + len <= u->arena_cap) {
+        undo_put(b->base + b->len, s, len, reverse);
+        b->len += len;
+    }
+    else {
+        char *p = undo_alloc(u, op->len + len, &b);
+
+        memcpy(p, op->text, op->len);
+        undo_put(p + op->len, s, len, reverse);
+        text_block_unref(op->block);
+        op->text  = p;
+        op->block = b;
+    }
+    op->len   += len;
+    op->bytes += len;
+    u->bytes  += len;
+}
+
+
+/*
+ *  Where text put in at y, x ends; lines break at \n only, like in
+ *  editor_insert_raw.
+ */
+static void undo_text_end(const char *s, size_t len, int reverse,
+        int y, int x, int *ey, int *ex)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (s[reverse ? len - 1 - i : i] == '\n') {
+            y++;
+            x = 0;
+        }
+        else {
+            x++;
+        }
+    }
+    *ey = y;
+    *ex = x;
+}
+
+
+static void undo_drop(struct undo_log *u, struct undo_op *op)
+{
+    u->bytes -= op->bytes;
+    undo_op_free(op);
+}
+
+
+static struct undo_op *undo_push(struct editor_config *E,
+        struct undo_log *u, int joined)
+{
+    if (u->n == u->cap) {
+        if (u->head > 0) {
+            memmove(u->ops, &u->ops[u->head],
+                    (u->n - u->head) * sizeof(*u->ops));
+            u->n   -= u->head;
+            u->pos -= u->head;
+            u->head = 0;
+        }
+        if (u->n == u->cap) {
+            u->cap = u->cap ? u->cap * 2 : 256;
+            u->ops = realloc(u->ops, u->cap * sizeof(*u->ops));
+            if (u->ops == NULL) {
+                die("realloc");
+            }
+        }
+    }
+
+    struct undo_op *op = &u->ops[u->n++];
+
+    memset(op, 0, sizeof(*op));
+    op->group = joined ? u->group : ++u->group;
+    op->bytes = sizeof(*op);
+    u->bytes += op->bytes;
+    u->pos = u->n;
+    return op;
+}
+
+
+/*
+ *  Oldest entries go until the log fits the limit again.
+ */
+static void undo_trim(struct editor_config *E, struct undo_log *u)
+{
+    while (u->bytes > E->undo_limit && u->head < u->pos - 1) {
+        undo_drop(u, &u->ops[u->head++]);
+    }
+}
+
+
+/*
+ *  Start logging a change; NULL while undo or redo replays the log.
+ *  A change made right where the last one left off joins its group.
+ */
+static struct undo_log *undo_begin(struct editor_config *E,
+        int y, int x, int *joined)
+{
+    if (E->undo == NULL) {
+        E->undo = calloc(1, sizeof(struct undo_log));
+        if (E->undo == NULL) {
+            die("calloc");
+        }
+        E->undo->sealed = 1;
+    }
+
+    struct undo_log *u = E->undo;
+
+    if (u->replaying) {
+        return NULL;
+    }
+
+    while (u->n > u->pos) {
+        undo_drop(u, &u->ops[--u->n]);
+    }
+
+    *joined = !u->sealed && u->pos > u->head
+        && y == u->end_y && x == u->end_x;
+    u->sealed = 0;
+    return u;
+}
+
+
+/*
+ *  Log that len bytes of s were inserted, or deleted, at y, x.
+ */
+static void undo_record(struct editor_config *E, int type,
+        int y, int x, const char *s, size_t len)
+{
+    int joined;
+    int ey, ex;
+
+    undo_text_end(s, len, 0, y, x, &ey, &ex);
+
+    // a backspace touches the change before it with its end
+    struct undo_log *u = type == UNDO_DELETE
+        ? undo_begin(E, ey, ex, &joined) : undo_begin(E, y, x, &joined);
+
+    if (u == NULL) {
+        return;
+    }
+
+    if (type == UNDO_DELETE) {
+        journal_record(E, JOURNAL_DELETE, y, x, ey, ex, NULL, 0);
+    }
+    else {
+        journal_record(E, type == UNDO_INSERT
+                ? JOURNAL_INSERT : JOURNAL_ROW_ADD, y, x, 0, 0, s, len);
+    }
+
+    struct undo_op *last = joined ? &u->ops[u->pos - 1] : NULL;
+
+    if (last && last->type == type && type == UNDO_INSERT) {
+        undo_extend(u, last, s, len, 0);
+        u->end_y = ey;
+        u->end_x = ex;
+        undo_trim(E, u);
+        return;
+    }
+    if (last && last->type == type && type == UNDO_DELETE) {
+        undo_extend(u, last, s, len, 1);
+        last->y = y;
+        last->x = x;
+        u->end_y = y;
+        u->end_x = x;
+        undo_trim(E, u);
+        return;
+    }
+
+    struct undo_op *op = undo_push(E, u, joined);
+    char *p = undo_alloc(u, len, &op->block);
+
+    undo_put(p, s, len, type == UNDO_DELETE);
+    op->type   = type;
+    op->y      = y;
+    op->x      = x;
+    op->text   = p;
+    op->len    = len;
+    op->bytes += len;
+    u->bytes  += len;
+
+    u->end_y = type == UNDO_INSERT ? ey : y;
+    u->end_x = type == UNDO_INSERT ? ex : x;
+    if (type == UNDO_ROW_ADD) {
+        u->end_y = y;
+        u->end_x = len;
+    }
+    undo_trim(E, u);
+}
+
+
+static void undo_insert(struct editor_config *E,
+        int y, int x, const char *s, size_t len)
+{
+    undo_record(E, UNDO_INSERT, y, x, s, len);
+}
+
+
+static void undo_delete(struct editor_config *E,
+        int y, int x, const char *s, size_t len)
+{
+    undo_record(E, UNDO_DELETE, y, x, s, len);
+}
+
+
+/*
+ *  An empty row put after the last one is a line break at its end.
+ */
+static void undo_row_add(struct editor_config *E,
+        int y, const char *s, size_t len)
+{
+    if (y < 0 || y > E->numrows) {
+        return;
+    }
+    if (len == 0 && y > 0 && y == E->numrows) {
+        undo_record(E, UNDO_INSERT, y - 1,
+                editor_row_at(E, y - 1)->size, "\n", 1);
+        return;
+    }
+    undo_record(E, UNDO_ROW_ADD, y, 0, s, len);
+}
+
+
+/*
+ *  Log that rows got new contents; rows holds what they had before and
+ *  is owned by the log from now on.
+ */
+static void undo_record_rows(struct editor_config *E, struct undo_rows *rows)
+{
+    int joined;
+    struct undo_log *u = undo_begin(E, -1, -1, &joined);
+
+    if (u == NULL || rows->n == 0) {
+        undo_rows_free(rows);
+        return;
+    }
+    for (int i = 0; i < rows->n; i++) {
+        journal_row_set(E, rows->ys[i]);
+    }
+
+    struct undo_op *op = undo_push(E, u, 0);
+    size_t bytes = rows->n * (sizeof(int) + sizeof(erow));
+
+    // a view of the mapping would change under us when the file is saved
+    for (int i = 0; i < rows->n; i++) {
+        erow *row = &rows->rows[i];
+
+        if (row->block && row->block->mapped) {
+            erow_gap_reserve(row, 0);
+        }
+        if (erow_is_gap(row)) {
+            bytes += row->size + row->gap_len;
+        }
+    }
+
+    op->type   = UNDO_ROWS;
+    op->y      = rows->ys[0];
+    op->rows   = rows;
+    op->bytes += bytes;
+    u->bytes  += bytes;
+
+    u->sealed = 1;
+    undo_trim(E, u);
+}
+
+
+/*
+ *  The next change starts a new undo step even when it is right next
+ *  to the last one, e.g. once insert mode is left.
+ */
+static void undo_seal(struct editor_config *E)
+{
+    if (E->undo) {
+        E->undo->sealed = 1;
+    }
+}
+
+
+/*
+ *  Remove the text that starts at y, x and ends at ey, ex.
+ */
+static void editor_delete_range(struct editor_config *E,
+        int y, int x, int ey, int ex)
+{
+    if (ey == y) {
+        editor_row_cut(E, editor_row_at(E, y), x, ex - x);
+        return;
+    }
+
+    erow *row = editor_row_at(E, y);
+
+    editor_row_cut(E, row, x, row->size - x);
+    row = editor_row_at(E, ey);
+    editor_row_cut(E, row, 0, ex);
+    editor_row_append_row(E, editor_row_at(E, y), editor_row_at(E, ey));
+
+    for (int i = y; i < ey; i++) {
+        editor_row_delete(E, y + 1);
+    }
+}
+
+
+/*
+ *  Put op in, or take it out again when undo is set.
+ */
+static void undo_apply(struct editor_config *E, struct undo_op *op, int undo)
+{
+    const char *text = op->text;
+    char *forward = NULL;
+    int ey, ex;
+
+    if (op->type == UNDO_DELETE && op->len > 0) {
+        forward = malloc(op->len);
+        if (forward == NULL) {
+            die("malloc");
+        }
+        undo_put(forward, op->text, op->len, 1);
+        text = forward;
+    }
+
+    switch (op->type) {
+        case UNDO_INSERT:
+        case UNDO_DELETE:
+            if ((op->type == UNDO_INSERT) == !undo) {
+                journal_record(E, JOURNAL_INSERT, op->y, op->x, 0, 0,
+                        text, op->len);
+                E->cy = op->y;
+                E->cx = op->x;
+                editor_insert_raw(E, text, op->len);
+            }
+            else {
+                undo_text_end(text, op->len, 0, op->y, op->x, &ey, &ex);
+                journal_record(E, JOURNAL_DELETE, op->y, op->x, ey, ex,
+                        NULL, 0);
+                editor_delete_range(E, op->y, op->x, ey, ex);
+            }
+            break;
+        case UNDO_ROW_ADD:
+            if (undo) {
+                journal_record(E, JOURNAL_ROW_DEL, op->y, 0, 0, 0, NULL, 0);
+                editor_row_delete(E, op->y);
+            }
+            else {
+                journal_record(E, JOURNAL_ROW_ADD, op->y, 0, 0, 0,
+                        text, op->len);
+                editor_row_insert(E, op->y, text, op->len);
+            }
+            break;
+        case UNDO_ROWS:
+            for (int i = 0; i < op->rows->n; i++) {
+                erow *row = editor_row_at(E, op->rows->ys[i]);
+                erow swap = *row;
+
+                *row = op->rows->rows[i];
+                op->rows->rows[i] = swap;
+                editor_row_update(row);
+                journal_row_set(E, op->rows->ys[i]);
+            }
+            E->changed++;
+            break;
+    }
+    free(forward);
+}
+
+
+static void undo_cursor(struct editor_config *E, int y, int x)
+{
+    E->cy = y < E->numrows ? y : E->numrows;
+    E->cx = x;
+    if (E->cy < E->numrows && E->cx > editor_row_at(E, E->cy)->size) {
+        E->cx = editor_row_at(E, E->cy)->size;
+    }
+    if (E->cx < 0 || E->cy == E->numrows) {
+        E->cx = 0;
+    }
+}
+
+
+/*
+ *  Take back the last group of changes, return 0 when there is none.
+ */
+static int c_undo(struct editor_config *E)
+{
+    struct undo_log *u = E->undo;
+
+    if (u == NULL || u->pos == u->head) {
+        c_echo_status_message(E, "Already at oldest change");
+        return 0;
+    }
+
+    unsigned long group = u->ops[u->pos - 1].group;
+    struct undo_op *op = NULL;
+
+    u->replaying = 1;
+    while (u->pos > u->head && u->ops[u->pos - 1].group == group) {
+        op = &u->ops[--u->pos];
+        undo_apply(E, op, 1);
+    }
+    u->replaying = 0;
+    u->sealed = 1;
+
+    undo_cursor(E, op->y, op->type == UNDO_ROWS ? 0 : op->x);
+    return 1;
+}
+
+
+static int c_redo(struct editor_config *E)
+{
+    struct undo_log *u = E->undo;
+
+    if (u == NULL || u->pos == u->n) {
+        c_echo_status_message(E, "Already at newest change");
+        return 0;
+    }
+
+    unsigned long group = u->ops[u->pos].group;
+    struct undo_op *op = NULL;
+
+    u->replaying = 1;
+    while (u->pos < u->n && u->ops[u->pos].group == group) {
+        op = &u->ops[u->pos++];
+        undo_apply(E, op, 0);
+    }
+    u->replaying = 0;
+    u->sealed = 1;
+
+    if (op->type == UNDO_INSERT) {
+        undo_cursor(E, E->cy, E->cx);
+    }
+    else {
+        undo_cursor(E, op->y, op->type == UNDO_ROWS ? 0 : op->x);
+    }
+    return 1;
+}
+
+
+static JSValue js_undo(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    return JS_NewBool(ctx, c_undo(s));
+}
+
+
+static JSValue js_redo(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    return JS_NewBool(ctx, c_redo(s));
+}
+
+
+static JSValue js_undo_seal(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    undo_seal(s);
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  Recovery
+ */
+
+
+static const char *journal_read_varint(const char *p, const char *end,
+        int *v)
+{
+    uint64_t n = 0;
+
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+        unsigned char c = *p++;
+
+        n |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            if (n > INT_MAX) {
+                return NULL;
+            }
+            *v = n;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ *  The record at p, NULL when it is cut short.
+ */
+static const char *journal_decode(const char *p, const char *end,
+        struct journal_op *op)
+{
+    int len = 0;
+
+    if (p == end) {
+        return NULL;
+    }
+    memset(op, 0, sizeof(*op));
+    op->type = (unsigned char) *p++;
+    p = journal_read_varint(p, end, &op->y);
+    switch (op->type) {
+        case JOURNAL_INSERT:
+            p = p ? journal_read_varint(p, end, &op->x) : NULL;
+            p = p ? journal_read_varint(p, end, &len) : NULL;
+            break;
+        case JOURNAL_DELETE:
+            p = p ? journal_read_varint(p, end, &op->x) : NULL;
+            p = p ? journal_read_varint(p, end, &op->ey) : NULL;
+            p = p ? journal_read_varint(p, end, &op->ex) : NULL;
+            break;
+        case JOURNAL_ROW_ADD:
+        case JOURNAL_ROW_SET:
+            p = p ? journal_read_varint(p, end, &len) : NULL;
+            break;
+        case JOURNAL_ROW_DEL:
+            break;
+        default:
+            return NULL;
+    }
+    if (p == NULL || end - p < len) {
+        return NULL;
+    }
+    op->text = p;
+    op->len  = len;
+    return p + len;
+}
+
+
+static int journal_row_size(struct editor_config *E, int y)
+{
+    return editor_row_at(E, y)->size;
+}
+
+
+/*
+ *  Make the change op logged, 0 when it does not fit the text: the
+ *  journal is not of this file after all.
+ */
+static int journal_apply(struct editor_config *E, struct journal_op *op)
+{
+    int y = op->y;
+
+    switch (op->type) {
+        case JOURNAL_INSERT:
+            if (y > E->numrows
+                    || (y < E->numrows && op->x > journal_row_size(E, y))) {
+                return 0;
+            }
+            E->cy = y;
+            E->cx = op->x;
+            editor_insert_raw(E, op->text, op->len);
+            return 1;
+        case JOURNAL_DELETE:
+            if (op->ey < y || op->ey >= E->numrows
+                    || op->x > journal_row_size(E, y)
+                    || op->ex > journal_row_size(E, op->ey)
+                    || (op->ey == y && op->ex < op->x)) {
+                return 0;
+            }
+            editor_delete_range(E, y, op->x, op->ey, op->ex);
+            return 1;
+        case JOURNAL_ROW_ADD:
+            if (y > E->numrows) {
+                return 0;
+            }
+            editor_row_insert(E, y, op->text, op->len);
+            return 1;
+        case JOURNAL_ROW_DEL:
+            if (y >= E->numrows) {
+                return 0;
+            }
+            editor_row_delete(E, y);
+            return 1;
+        case JOURNAL_ROW_SET:
+            if (y >= E->numrows) {
+                return 0;
+            }
+
+            erow *row = editor_row_at(E, y);
+
+            editor_row_cut(E, row, 0, row->size);
+            editor_row_insert_string(E, row, 0, op->text, op->len);
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ *  Replay the journal file_open found onto the buffer, fresh from the
+ *  file. Records up to the first one that is cut short or does not fit
+ *  are kept, and later edits are appended after them. Returns how many
+ *  were replayed, -1 when there was nothing to replay.
+ */
+static int journal_replay(struct editor_config *E)
+{
+    if (!E->journal_found || E->journal || E->changed) {
+        return -1;
+    }
+    E->journal_found = 0;
+
+    char *path = file_side_path(E->filename, "jnl");
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    char *map = MAP_FAILED;
+
+    if (fd == -1) {
+        free(path);
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > (off_t) sizeof(struct journal_head)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map == MAP_FAILED
+            || !journal_head_same((struct journal_head *) map, &E->disk)) {
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+        close(fd);
+        free(path);
+        return -1;
+    }
+
+    // neither the history nor the journal log what is replayed
+    undo_clear(E);
+    E->undo = calloc(1, sizeof(struct undo_log));
+    if (E->undo == NULL) {
+        die("calloc");
+    }
+    E->undo->replaying = 1;
+
+    const char *p   = map + sizeof(struct journal_head);
+    const char *end = map + st.st_size;
+    int n = 0;
+
+    for (;;) {
+        struct journal_op op;
+        const char *next = journal_decode(p, end, &op);
+
+        if (next == NULL || !journal_apply(E, &op)) {
+            break;
+        }
+        p = next;
+        n++;
+    }
+    undo_clear(E);
+
+    // a torn record at the end is cut off, later ones go after the rest
+    off_t valid = p - map;
+
+    E->journal = journal_new(E);
+    if (valid == st.st_size || ftruncate(fd, valid) == 0) {
+        E->journal->exists = 1;
+        E->journal->total  = valid - sizeof(struct journal_head);
+    }
+    else {
+        // appended behind the torn one, later records would never replay
+        const char *kept = map + sizeof(struct journal_head);
+
+        unlink(path);
+        if (p > kept) {
+            journal_put(E->journal, kept, p - kept, NULL, 0);
+        }
+    }
+    munmap(map, st.st_size);
+    close(fd);
+    free(path);
+
+    cursor_clamp(E);
+    c_echo_status_message(E, "%d edits of %s replayed, save to keep them",
+            n, E->filename);
+    return n;
+}
+
+
+/*
+ *  terminal.journal_found(): file_open found a journal from a crash.
+ */
+static JSValue js_journal_found(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    return JS_NewBool(ctx, s->journal_found);
+}
+
+
+/*
+ *  terminal.journal_replay(): put the edits of that journal back, right
+ *  after file_open. Returns how many there were, -1 for none.
+ */
+static JSValue js_journal_replay(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    return JS_NewInt32(ctx, journal_replay(s));
+}
+
+
+/*
+ *  terminal.journal_discard(): throw the journal of a crash away.
+ */
+static JSValue js_journal_discard(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val,
+            js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (s->journal_found && s->journal == NULL) {
+        char *path = file_side_path(s->filename, "jnl");
+
+        unlink(path);
+        free(path);
+    }
+    s->journal_found = 0;
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  Keymap
+ */
+
+
+/*
+ *  A key pressed in a mode runs a native action or a JS function bound
+ *  to it, falling back to the mode's default binding, then to what the
+ *  caller of dispatch gives. Native actions never go through JS, and
+ *  dispatch times both kinds for key_stats().
+ */
+#define KEYMAP_SLOTS 256  // to start with, grows at 3/4 full
+#define KEYMAP_ANY   -1    // key of a mode's default binding
+#define KEY_UNBOUND  -2
+#define KEY_JS       -1
+
+
+struct key_binding {
+    int used;
+    int mode;
+    int key;
+    int action;  // in key_actions, KEY_JS or KEY_UNBOUND
+    JSValue fn;
+};
+
+
+static void key_move_up(struct editor_config *E, int key)
+{
+    if (E->cy != 0) {
+        E->cy--;
+    }
+    fix_position(E);
+}
+
+
+static void key_move_down(struct editor_config *E, int key)
+{
+    if (E->cy < E->numrows - 1) {
+        E->cy++;
+    }
+    fix_position(E);
+}
+
+
+static void key_move_left(struct editor_config *E, int key)
+{
+    if (E->cx != 0) {
+        move_cursur_left(E);
+    }
+    else if (E->cy > 0) {
+        move_cursur_left_or_previous_line(E);
+    }
+    fix_position(E);
+}
+
+
+static void key_move_right(struct editor_config *E, int key)
+{
+    move_cursur_right_or_next_line(E);
+    fix_position(E);
+}
+
+
+static void key_line_start(struct editor_config *E, int key)
+{
+    move_to_line_of_start(E);
+}
+
+
+static void key_line_end(struct editor_config *E, int key)
+{
+    move_to_line_of_end(E);
+}
+
+
+static void key_page_up(struct editor_config *E, int key)
+{
+    page_up(E);
+}
+
+
+static void key_page_down(struct editor_config *E, int key)
+{
+    page_down(E);
+}
+
+
+static void key_bottom(struct editor_config *E, int key)
+{
+    move_to_line(E, E->numrows);
+}
+
+
+static void key_delete(struct editor_config *E, int key)
+{
+    move_cursur_right(E);
+    c_delete_char(E);
+}
+
+
+static void key_backspace(struct editor_config *E, int key)
+{
+    c_delete_char(E);
+    fix_position(E);
+}
+
+
+// x and X in normal mode, each one undo step
+static void key_delete_under(struct editor_config *E, int key)
+{
+    move_cursur_right(E);
+    c_delete_char(E);
+    undo_seal(E);
+    fix_position(E);
+}
+
+
+static void key_delete_before(struct editor_config *E, int key)
+{
+    c_delete_char(E);
+    undo_seal(E);
+    fix_position(E);
+}
+
+
+static void key_insert_char(struct editor_config *E, int key)
+{
+    c_insert_char(E, key);
+}
+
+
+static void key_insert_newline(struct editor_config *E, int key)
+{
+    c_insert_newline(E);
+}
+
+
+static void key_paste(struct editor_config *E, int key)
+{
+    if (paste.len > 0) {
+        c_insert_text(E, paste.b, paste.len);
+    }
+}
+
+
+static void key_undo(struct editor_config *E, int key)
+{
+    c_undo(E);
+    fix_position(E);
+}
+
+
+static void key_redo(struct editor_config *E, int key)
+{
+    c_redo(E);
+    fix_position(E);
+}
+
+
+static const struct key_action {
+    const char *name;
+    void (*run)(struct editor_config *E, int key);
+} key_actions[] = {
+    {"move_up",        key_move_up},
+    {"move_down",      key_move_down},
+    {"move_left",      key_move_left},
+    {"move_right",     key_move_right},
+    {"line_start",     key_line_start},
+    {"line_end",       key_line_end},
+    {"page_up",        key_page_up},
+    {"page_down",      key_page_down},
+    {"bottom",         key_bottom},
+    {"delete",         key_delete},
+    {"backspace",      key_backspace},
+    {"delete_under",   key_delete_under},
+    {"delete_before",  key_delete_before},
+    {"insert_char",    key_insert_char},
+    {"insert_newline", key_insert_newline},
+    {"paste",          key_paste},
+    {"undo",           key_undo},
+    {"redo",           key_redo},
+};
+
+
+static unsigned int keymap_hash(int mode, int key)
+{
+    return ((unsigned int) mode * 31 + (unsigned int) key) * 2654435761u;
+}
+
+
+static void keymap_grow(struct editor_config *E)
+{
+    int cap = E->keymap_cap ? E->keymap_cap * 2 : KEYMAP_SLOTS;
+    struct key_binding *map = calloc(cap, sizeof(struct key_binding));
+
+    if (map == NULL) {
+        die("calloc");
+    }
+
+    for (int i = 0; i < E->keymap_cap; i++) {
+        struct key_binding *b = &E->keymap[i];
+        unsigned int h = keymap_hash(b->mode, b->key);
+
+        if (!b->used) {
+            continue;
+        }
+        while (map[h & (cap - 1)].used) {
+            h++;
+        }
+        map[h & (cap - 1)] = *b;
+    }
+
+    free(E->keymap);
+    E->keymap = map;
+    E->keymap_cap = cap;
+}
+
+
+static struct key_binding *keymap_slot(struct editor_config *E,
+        int mode, int key, int add)
+{
+    if (add && (E->keymap_used + 1) * 4 > E->keymap_cap * 3) {
+        keymap_grow(E);
+    }
+
+    for (unsigned int h = keymap_hash(mode, key); E->keymap; h++) {
+        struct key_binding *b = &E->keymap[h & (E->keymap_cap - 1)];
+
+        if (!b->used) {
+            if (!add) {
+                return NULL;
+            }
+            b->used   = 1;
+            b->mode   = mode;
+            b->key    = key;
+            b->action = KEY_UNBOUND;
+            b->fn     = JS_UNDEFINED;
+            E->keymap_used++;
+            return b;
+        }
+        if (b->mode == mode && b->key == key) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+
+static struct key_binding *keymap_find(struct editor_config *E,
+        int mode, int key)
+{
+    struct key_binding *b = keymap_slot(E, mode, key, 0);
+
+    if (b == NULL || b->action == KEY_UNBOUND) {
+        b = keymap_slot(E, mode, KEYMAP_ANY, 0);
+    }
+    if (b == NULL || b->action == KEY_UNBOUND) {
+        return NULL;
+    }
+    return b;
+}
+
+
+static void keymap_free(JSRuntime *rt, struct editor_config *E)
+{
+    if (E->keymap == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < E->keymap_cap; i++) {
+        JS_FreeValueRT(rt, E->keymap[i].fn);
+    }
+    free(E->keymap);
+    E->keymap = NULL;
+    E->keymap_cap = 0;
+    E->keymap_used = 0;
+}
+
+
+static void key_stats_add(struct key_stats *st, struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    unsigned long long ns = (end.tv_sec - start->tv_sec) * 1000000000ULL
+        + end.tv_nsec - start->tv_nsec;
+
+    st->keys++;
+    st->ns += ns;
+    if (ns > st->max_ns) {
+        st->max_ns = ns;
+    }
+}
+
+
+/*
+ *  terminal.bind(mode, key, action): action is the name of a native
+ *  action, a function called as action(terminal, key), or null to
+ *  unbind. A null key binds every key the mode has no binding for.
+ */
+static JSValue js_bind(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    int mode;
+    int key = KEYMAP_ANY;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (JS_ToInt32(ctx, &mode, argv[0])) {
+        return JS_EXCEPTION;
+    }
+    if (!JS_IsNull(argv[1]) && JS_ToInt32(ctx, &key, argv[1])) {
+        return JS_EXCEPTION;
+    }
+
+    int action = KEY_UNBOUND;
+
+    if (JS_IsString(argv[2])) {
+        const char *name = JS_ToCString(ctx, argv[2]);
+
+        for (int i = 0; i < (int) countof(key_actions); i++) {
+            if (strcmp(name, key_actions[i].name) == 0) {
+                action = i;
+            }
+        }
+        if (action == KEY_UNBOUND) {
+            JS_ThrowTypeError(ctx, "no action %s", name);
+            JS_FreeCString(ctx, name);
+            return JS_EXCEPTION;
+        }
+        JS_FreeCString(ctx, name);
+    }
+    else if (JS_IsFunction(ctx, argv[2])) {
+        action = KEY_JS;
+    }
+
+    struct key_binding *b = keymap_slot(s, mode, key,
+            action != KEY_UNBOUND);
+
+    if (b == NULL) {
+        return JS_UNDEFINED;
+    }
+
+    JS_FreeValue(ctx, b->fn);
+    b->action = action;
+    b->fn = action == KEY_JS ? JS_DupValue(ctx, argv[2]) : JS_UNDEFINED;
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  terminal.dispatch(key, fallback): run what key is bound to in the
+ *  current mode. Returns true after a native action, otherwise what
+ *  the function bound, or fallback(terminal, key), returns.
+ */
+static JSValue js_dispatch(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    struct timespec start;
+    int key;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (JS_ToInt32(ctx, &key, argv[0])) {
+        return JS_EXCEPTION;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct key_binding *b = keymap_find(s, s->mode, key);
+
+    if (b && b->action != KEY_JS) {
+        key_actions[b->action].run(s, key);
+        key_stats_add(&s->key_native, &start);
+        return JS_TRUE;
+    }
+
+    // the function may unbind itself
+    JSValue fn = JS_DupValue(ctx, b ? b->fn : argc > 1 ? argv[1] : JS_UNDEFINED);
+    JSValue args[2] = { this_val, argv[0] };
+    JSValue v = JS_FALSE;
+
+    if (JS_IsFunction(ctx, fn)) {
+        v = JS_Call(ctx, fn, JS_UNDEFINED, 2, args);
+    }
+    JS_FreeValue(ctx, fn);
+
+    key_stats_add(&s->key_js, &start);
+    return v;
+}
+
+
+/*
+ *  terminal.key_stats(reset): keys handled natively and in JS, with
+ *  the mean and worst time each took in microseconds.
+ */
+static JSValue js_key_stats(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    JSValue obj = JS_NewObject(ctx);
+    struct key_stats *st[2] = { &s->key_native, &s->key_js };
+    const char *names[2][3] = {
+        { "native_keys", "native_us", "native_max_us" },
+        { "js_keys", "js_us", "js_max_us" },
+    };
+
+    for (int i = 0; i < 2; i++) {
+        double mean = st[i]->keys ? st[i]->ns / 1e3 / st[i]->keys : 0;
+
+        JS_SetPropertyStr(ctx, obj, names[i][0],
+                JS_NewInt64(ctx, st[i]->keys));
+        JS_SetPropertyStr(ctx, obj, names[i][1], JS_NewFloat64(ctx, mean));
+        JS_SetPropertyStr(ctx, obj, names[i][2],
+                JS_NewFloat64(ctx, st[i]->max_ns / 1e3));
+    }
+
+    if (argc > 0 && JS_ToBool(ctx, argv[0])) {
+        memset(&s->key_native, 0, sizeof(s->key_native));
+        memset(&s->key_js, 0, sizeof(s->key_js));
+    }
+    return obj;
+}
+
+
+static void js_vt100_mark(JSRuntime *rt, JSValueConst val,
+        JS_MarkFunc *mark_func)
+{
+    struct editor_config *s = JS_GetOpaque(val, js_vt100_class_id);
+
+    if (s->keymap == NULL) {
+        return;
+    }
+    for (int i = 0; i < s->keymap_cap; i++) {
+        JS_MarkValue(rt, s->keymap[i].fn, mark_func);
+    }
+}
+
+
+static JSValue js_mode_get(JSContext *ctx,
+        JSValue val)
+{
+    struct editor_config *s = JS_GetOpaque(val, js_vt100_class_id);
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    return JS_NewInt32(ctx, s->mode);
+}
+
+
+static JSValue js_mode_set(JSContext *ctx, JSValueConst this_val,
+        JSValue val)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx,
+            this_val, js_vt100_class_id);
+
+    int v;
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (JS_ToInt32(ctx, &v, val)) {
+        return JS_EXCEPTION;
+    }
+    s->mode = v;
+    return JS_UNDEFINED;
+}
+
+
+static JSValue js_editor_config_attr_get(JSContext *ctx,
+        JSValue val,
+        int magic)
+{
+    struct editor_config *s = JS_GetOpaque(val, js_vt100_class_id);
+    JSValue v;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    switch (magic) {
+        case 0:
+            v = JS_NewInt32(ctx, s->cx);
+            break;
+        case 1:
+            v = JS_NewInt32(ctx, s->cy);
+            break;
+        case 2:
+            v = JS_NewInt32(ctx, s->rx);
+            break;
+        case 3:
+            v = JS_NewInt32(ctx, s->rows);
+            break;
+        case 4:
+            v = JS_NewInt32(ctx, s->cols);
+            break;
+        case 5:
             v = JS_NewInt32(ctx, s->row_offset);
             break;
-        case 6:
-            v = JS_NewInt32(ctx, s->col_offset);
+        case 6:
+            v = JS_NewInt32(ctx, s->col_offset);
+            break;
+        case 7:
+            v = JS_NewInt32(ctx, s->changed);
+            break;
+        case 8:
+            v = JS_NewInt32(ctx, s->numrows);
+            break;
+        case 9:
+            v = JS_NewInt32(ctx, s->number_command);
+            break;
+        case 10:
+            {
+                if (s->filename) {
+                    v = JS_NewString(ctx, s->filename);
+                }
+                else {
+                    v = JS_NewString(ctx, "[No name]");
+                }
+            }
+            break;
+        case 11:
+            {
+                /*
+                 *  Eager rendering kept at least every byte and a NUL
+                 *  per row, the cache only keeps what was drawn.
+                 */
+                double eager = s->lines
+                    ? editor_rows_copy(s, 0, s->numrows, NULL) : 0;
+
+                v = JS_NewFloat64(ctx, eager - (double)s->render_bytes);
+            }
+            break;
+        case 12:
+            v = JS_NewInt32(ctx, s->frame_bytes);
+            break;
+        case 13:
+            v = JS_NewInt32(ctx, s->frames_dropped);
+            break;
+        case 14:
+            v = JS_NewInt64(ctx, s->undo_limit);
+            break;
+        case 15:
+            v = JS_NewInt64(ctx, s->undo ? s->undo->bytes : 0);
+            break;
+        case 16:
+            v = JS_NewInt64(ctx, s->buffer_budget);
+            break;
+        case 17:
+            v = JS_NewBool(ctx, s->follow);
+            break;
+        case 18:
+            v = JS_NewInt32(ctx, s->follow_limit);
+            break;
+        case 19:
+            v = JS_NewBool(ctx, s->save_fsync);
+            break;
+        case 20:
+            v = JS_NewInt32(ctx, s->autosave);
+            break;
+    }
+    return v;
+}
+
+
+static JSValue js_editor_config_attr_set(JSContext *ctx,
+        JSValueConst this_val,
+        JSValue val,
+        int magic)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx,
+            this_val, js_vt100_class_id);
+
+    int v;
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    const char *str = NULL;
+    if (magic == 10) {
+        str = JS_ToCString(ctx, val);
+    }
+    else {
+        if (JS_ToInt32(ctx, &v, val)) {
+            return JS_EXCEPTION;
+        }
+    }
+
+    switch (magic) {
+        case 0:
+            s->cx = v;
+            break;
+        case 1:
+            s->cy = v;
+            break;
+        case 2:
+            s->rx = v;
+            break;
+        case 3:
+            s->rows = v;
+            break;
+        case 4:
+            s->cols = v;
+            break;
+        case 5:
+            s->row_offset = v;
+            break;
+        case 6:
+            s->col_offset = v;
+            break;
+        case 7: // variable changed can not modified by user.
+        case 11:
+        case 12:
+        case 13:
+        case 15:
+            break;
+        case 14:
+            s->undo_limit = v > 0 ? v : 0;
+            if (s->undo) {
+                undo_trim(s, s->undo);
+            }
+            break;
+        case 16:
+            s->buffer_budget = v > 0 ? v : 0;
+            buffer_trim(s);
+            break;
+        case 17:
+            s->follow = v != 0;
+            // a followed file is read, not mapped, unless edits hold its rows
+            if (s->follow && s->mapped && !s->changed
+                    && access(s->filename, R_OK) == 0) {
+                file_remap(s);
+            }
+            follow_rows(s, 1);
+            file_reload(s);
+            break;
+        case 18:
+            s->follow_limit = v > 0 ? v : 0;
+            follow_rows(s, s->cy >= s->numrows - 1);
+            break;
+        case 19:
+            s->save_fsync = v != 0;
+            break;
+        case 20:
+            s->autosave = v > 0 ? v : 0;
+            break;
+        case 8:
+            s->numrows = v;
+            break;
+        case 9:
+            s->number_command = v;
+            break;
+        case 10:
+            free(s->filename);
+            s->filename = strdup(str);
+            JS_FreeCString(ctx, str);
+            break;
+    }
+    return JS_UNDEFINED;
+}
+
+
+static JSValue js_erow_check_size(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx,
+            this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    erow *row = editor_row_at(s, s->cy);
+
+    if (row && row->size >= 1) {
+        return JS_TRUE;
+    }
+    return JS_FALSE;
+}
+
+
+static JSValue js_check_row_object(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx,
+            this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    if (s->lines) {
+        return JS_TRUE;
+    }
+    return JS_FALSE;
+}
+
+
+static JSValue js_erow_get_size(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx,
+            this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    int index;
+    JS_ToInt32(ctx, &index, argv[0]);
+
+    erow *row = editor_row_at(s, index);
+
+    return JS_NewInt32(ctx, row ? row->size : 0);
+}
+
+
+/*
+ *  Regex
+ */
+
+
+/*
+ *  A pattern is parsed into a tree, compiled to a Thompson NFA and run
+ *  as a DFA whose states are only built the first time some byte leads
+ *  to them, so each byte of text costs a table lookup and nothing is
+ *  ever tried twice. Literals, ., [...] with ranges and ^, \d \w \s and
+ *  their negations, * + ?, |, ( ) and the line anchors ^ and $ are
+ *  known. Text is matched as bytes, . and negated classes take a whole
+ *  UTF-8 sequence.
+ */
+enum re_type {
+    RE_CLASS,
+    RE_CAT,
+    RE_ALT,
+    RE_STAR,
+    RE_PLUS,
+    RE_QUEST,
+    RE_EMPTY,
+    RE_BOL,
+    RE_EOL
+};
+
+
+struct re_node {
+    int type;
+    int a;
+    int b;
+    int set;  // RE_CLASS: index in sets
+};
+
+
+struct re_parse {
+    const char *p;
+    const char *end;
+    struct re_node *nodes;
+    int n;
+    int cap;
+    unsigned char (*sets)[32];
+    int nsets;
+    int sets_cap;
+    const char *error;
+};
+
+
+/*
+ *  NS_BEGIN and NS_END hold only where the scan starts or ends: ^ and $
+ *  in the forward NFA, $ and ^ in the reversed one.
+ */
+enum re_state_type {
+    NS_CLASS,
+    NS_SPLIT,
+    NS_JUMP,
+    NS_BEGIN,
+    NS_END,
+    NS_MATCH
+};
+
+#define AT_BEGIN 1
+#define AT_END   2
+
+
+/*
+ *  An out that is not patched yet holds -2 - the next unpatched out,
+ *  or -1, so the loose ends of a fragment are a list through them.
+ */
+struct re_state {
+    int type;
+    int set;
+    int out;
+    int out1;
+};
+
+
+struct re_frag {
+    int start;
+    int outs;  // first loose end, as state * 2 + which out
+};
+
+
+/*
+ *  DFA states are sets of NFA states, looked up in an open addressed
+ *  table. Past DFA_MAX_STATES the cache is thrown away and built again,
+ *  which keeps memory bounded for patterns that blow up. NS_END states
+ *  stay in the set until the end of the text, where match_end tells
+ *  whether they lead to a match.
+ */
+#define DFA_MAX_STATES 1024
+#define DFA_TABLE_SIZE (DFA_MAX_STATES * 2)
+
+
+struct dfa_state {
+    int n;
+    int match;
+    int match_end;
+    unsigned int hash;
+    int *set;
+    int next[256];  // -1 until that byte is seen
+};
+
+
+struct re_dfa {
+    struct re_state *nfa;
+    int nnfa;
+    unsigned char (*sets)[32];
+    int floating;  // a match may begin at every byte
+    int start;
+    int start_begin;  // start at the beginning of the text
+    struct dfa_state **states;
+    int nstates;
+    unsigned long flushes;
+    int *table;
+    int *stack;
+    int *list;
+    unsigned int *mark;
+    unsigned int mark_gen;
+    int nfa_start;
+    int *start_set;
+    int start_n;
+    int *begin_set;
+    int begin_n;
+    int match_empty;  // on an empty line, where ^ and $ both hold
+};
+
+
+struct regex {
+    int refs;
+    unsigned long serial;  // new for every compile, keys the match cache
+    char *pattern;
+    unsigned char (*sets)[32];
+    struct re_dfa fwd;
+    struct re_dfa rev;  // the pattern reversed, finds where matches start
+    char *starts;
+    int starts_cap;
+};
+
+
+static unsigned long regex_serial;
+
+
+static int re_node_new(struct re_parse *ps, int type, int a, int b)
+{
+    if (ps->n == ps->cap) {
+        ps->cap = ps->cap ? ps->cap * 2 : 32;
+        ps->nodes = realloc(ps->nodes, ps->cap * sizeof(*ps->nodes));
+        if (ps->nodes == NULL) {
+            die("realloc");
+        }
+    }
+
+    struct re_node *node = &ps->nodes[ps->n];
+
+    node->type = type;
+    node->a    = a;
+    node->b    = b;
+    node->set  = -1;
+    return ps->n++;
+}
+
+
+static int re_class_new(struct re_parse *ps, const unsigned char *set)
+{
+    if (ps->nsets == ps->sets_cap) {
+        ps->sets_cap = ps->sets_cap ? ps->sets_cap * 2 : 16;
+        ps->sets = realloc(ps->sets, ps->sets_cap * sizeof(*ps->sets));
+        if (ps->sets == NULL) {
+            die("realloc");
+        }
+    }
+    memcpy(ps->sets[ps->nsets], set, 32);
+
+    int n = re_node_new(ps, RE_CLASS, -1, -1);
+
+    ps->nodes[n].set = ps->nsets++;
+    return n;
+}
+
+
+static void re_set_range(unsigned char *set, int from, int to)
+{
+    for (int c = from; c <= to; c++) {
+        set[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+
+static int re_range(struct re_parse *ps, int from, int to)
+{
+    unsigned char set[32] = {0};
+
+    re_set_range(set, from, to);
+    return re_class_new(ps, set);
+}
+
+
+/*
+ *  Any UTF-8 sequence of two to four bytes.
+ */
+static int re_multibyte(struct re_parse *ps)
+{
+    int two   = re_node_new(ps, RE_CAT, re_range(ps, 0xc0, 0xdf),
+            re_range(ps, 0x80, 0xbf));
+    int three = re_node_new(ps, RE_CAT, re_range(ps, 0xe0, 0xef),
+            re_node_new(ps, RE_CAT, re_range(ps, 0x80, 0xbf),
+                re_range(ps, 0x80, 0xbf)));
+    int four  = re_node_new(ps, RE_CAT, re_range(ps, 0xf0, 0xf7),
+            re_node_new(ps, RE_CAT, re_range(ps, 0x80, 0xbf),
+                re_node_new(ps, RE_CAT, re_range(ps, 0x80, 0xbf),
+                    re_range(ps, 0x80, 0xbf))));
+
+    return re_node_new(ps, RE_ALT, two, re_node_new(ps, RE_ALT, three, four));
+}
+
+
+/*
+ *  A class given as ASCII bytes; negated, it takes every other ASCII
+ *  byte and any multi-byte character.
+ */
+static int re_class(struct re_parse *ps, unsigned char *set, int negate)
+{
+    if (!negate) {
+        return re_class_new(ps, set);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        set[i] = ~set[i];
+    }
+    memset(set + 16, 0, 16);
+    return re_node_new(ps, RE_ALT, re_class_new(ps, set), re_multibyte(ps));
+}
+
+
+/*
+ *  Add the bytes of \d \w \s to set, return 1 when c is one of their
+ *  negated forms, -1 when c is none of them.
+ */
+static int re_escape_class(int c, unsigned char *set)
+{
+    switch (tolower(c)) {
+        case 'd':
+            re_set_range(set, '0', '9');
+            break;
+        case 'w':
+            re_set_range(set, '0', '9');
+            re_set_range(set, 'A', 'Z');
+            re_set_range(set, 'a', 'z');
+            re_set_range(set, '_', '_');
+            break;
+        case 's':
+            re_set_range(set, '\t', '\r');
+            re_set_range(set, ' ', ' ');
+            break;
+        default:
+            return -1;
+    }
+    return isupper(c) ? 1 : 0;
+}
+
+
+static int re_escape_char(int c)
+{
+    switch (c) {
+        case 't':
+            return '\t';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        default:
+            return c;
+    }
+}
+
+
+static int re_bracket(struct re_parse *ps)
+{
+    unsigned char set[32] = {0};
+    int negate = 0;
+
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+
+    int first = 1;
+
+    while (ps->p < ps->end && (*ps->p != ']' || first)) {
+        int c = (unsigned char)*ps->p++;
+
+        first = 0;
+        if (c == '\\' && ps->p < ps->end) {
+            c = (unsigned char)*ps->p++;
+
+            unsigned char escape[32] = {0};
+            int negated = re_escape_class(c, escape);
+
+            if (negated == 1) {
+                ps->error = "negated escape in []";
+                return -1;
+            }
+            if (negated == 0) {
+                for (int i = 0; i < 32; i++) {
+                    set[i] |= escape[i];
+                }
+                continue;
+            }
+            c = re_escape_char(c);
+        }
+
+        int to = c;
+
+        if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+            to = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (to == '\\' && ps->p < ps->end) {
+                to = re_escape_char((unsigned char)*ps->p++);
+            }
+            if (to < c) {
+                ps->error = "bad range in []";
+                return -1;
+            }
+        }
+        re_set_range(set, c, to);
+    }
+
+    if (ps->p == ps->end) {
+        ps->error = "missing ]";
+        return -1;
+    }
+    ps->p++;
+    return re_class(ps, set, negate);
+}
+
+
+static int re_alt(struct re_parse *ps);
+
+
+static int re_atom(struct re_parse *ps)
+{
+    int c = (unsigned char)*ps->p++;
+    int n;
+
+    switch (c) {
+        case '(':
+            n = re_alt(ps);
+            if (n < 0) {
+                return -1;
+            }
+            if (ps->p == ps->end || *ps->p != ')') {
+                ps->error = "missing )";
+                return -1;
+            }
+            ps->p++;
+            return n;
+        case '[':
+            return re_bracket(ps);
+        case '.':
+            return re_node_new(ps, RE_ALT, re_range(ps, 0, 0x7f),
+                    re_multibyte(ps));
+        case '^':
+            return re_node_new(ps, RE_BOL, -1, -1);
+        case '$':
+            return re_node_new(ps, RE_EOL, -1, -1);
+        case '*':
+        case '+':
+        case '?':
+            ps->error = "nothing to repeat";
+            return -1;
+        case '\\': {
+            if (ps->p == ps->end) {
+                ps->error = "trailing \\";
+                return -1;
+            }
+            c = (unsigned char)*ps->p++;
+
+            unsigned char set[32] = {0};
+            int negated = re_escape_class(c, set);
+
+            if (negated >= 0) {
+                return re_class(ps, set, negated);
+            }
+            return re_range(ps, re_escape_char(c), re_escape_char(c));
+        }
+        default:
+            return re_range(ps, c, c);
+    }
+}
+
+
+static int re_repeat(struct re_parse *ps)
+{
+    int n = re_atom(ps);
+
+    while (n >= 0 && ps->p < ps->end) {
+        if (*ps->p == '*') {
+            n = re_node_new(ps, RE_STAR, n, -1);
+        }
+        else if (*ps->p == '+') {
+            n = re_node_new(ps, RE_PLUS, n, -1);
+        }
+        else if (*ps->p == '?') {
+            n = re_node_new(ps, RE_QUEST, n, -1);
+        }
+        else {
+            break;
+        }
+        ps->p++;
+    }
+    return n;
+}
+
+
+static int re_concat(struct re_parse *ps)
+{
+    int n = -1;
+
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        int m = re_repeat(ps);
+
+        if (m < 0) {
+            return -1;
+        }
+        n = n < 0 ? m : re_node_new(ps, RE_CAT, n, m);
+    }
+    return n < 0 ? re_node_new(ps, RE_EMPTY, -1, -1) : n;
+}
+
+
+static int re_alt(struct re_parse *ps)
+{
+    int n = re_concat(ps);
+
+    while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+
+        int m = re_concat(ps);
+
+        if (m < 0) {
+            return -1;
+        }
+        n = re_node_new(ps, RE_ALT, n, m);
+    }
+    return n;
+}
+
+
+static int re_state_new(struct re_dfa *d, int *cap, int type,
+        int out, int out1)
+{
+    if (d->nnfa == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        d->nfa = realloc(d->nfa, *cap * sizeof(*d->nfa));
+        if (d->nfa == NULL) {
+            die("realloc");
+        }
+    }
+
+    struct re_state *s = &d->nfa[d->nnfa];
+
+    s->type = type;
+    s->set  = -1;
+    s->out  = out;
+    s->out1 = out1;
+    return d->nnfa++;
+}
+
+
+static int *re_out(struct re_dfa *d, int slot)
+{
+    return slot & 1 ? &d->nfa[slot >> 1].out1 : &d->nfa[slot >> 1].out;
+}
+
+
+static void re_patch(struct re_dfa *d, int outs, int to)
+{
+    while (outs >= 0) {
+        int *out = re_out(d, outs);
+
+        outs = -2 - *out;
+        *out = to;
+    }
+}
+
+
+static int re_append(struct re_dfa *d, int outs, int more)
+{
+    if (outs < 0) {
+        return more;
+    }
+
+    int slot = outs;
+
+    while (*re_out(d, slot) != -1) {
+        slot = -2 - *re_out(d, slot);
+    }
+    *re_out(d, slot) = -2 - more;
+    return outs;
+}
+
+
+/*
+ *  Thompson's construction; reverse builds the NFA of the pattern read
+ *  backwards, concatenations simply swap their halves.
+ */
+static struct re_frag re_compile_node(struct re_dfa *d, int *cap,
+        struct re_node *nodes, int i, int reverse)
+{
+    struct re_node *node = &nodes[i];
+    struct re_frag f, g;
+    int s;
+
+    switch (node->type) {
+        case RE_CLASS:
+            s = re_state_new(d, cap, NS_CLASS, -1, -1);
+            d->nfa[s].set = node->set;
+            return (struct re_frag){ s, s * 2 };
+        case RE_EMPTY:
+            s = re_state_new(d, cap, NS_JUMP, -1, -1);
+            return (struct re_frag){ s, s * 2 };
+        case RE_BOL:
+        case RE_EOL:
+            s = re_state_new(d, cap,
+                    (node->type == RE_BOL) == !reverse ? NS_BEGIN : NS_END,
+                    -1, -1);
+            return (struct re_frag){ s, s * 2 };
+        case RE_CAT:
+            f = re_compile_node(d, cap, nodes, reverse ? node->b : node->a,
+                    reverse);
+            g = re_compile_node(d, cap, nodes, reverse ? node->a : node->b,
+                    reverse);
+            re_patch(d, f.outs, g.start);
+            return (struct re_frag){ f.start, g.outs };
+        case RE_ALT:
+            f = re_compile_node(d, cap, nodes, node->a, reverse);
+            g = re_compile_node(d, cap, nodes, node->b, reverse);
+            s = re_state_new(d, cap, NS_SPLIT, f.start, g.start);
+            return (struct re_frag){ s, re_append(d, f.outs, g.outs) };
+        case RE_STAR:
+            f = re_compile_node(d, cap, nodes, node->a, reverse);
+            s = re_state_new(d, cap, NS_SPLIT, f.start, -1);
+            re_patch(d, f.outs, s);
+            return (struct re_frag){ s, s * 2 + 1 };
+        case RE_PLUS:
+            f = re_compile_node(d, cap, nodes, node->a, reverse);
+            s = re_state_new(d, cap, NS_SPLIT, f.start, -1);
+            re_patch(d, f.outs, s);
+            return (struct re_frag){ f.start, s * 2 + 1 };
+        default:  // RE_QUEST
+            f = re_compile_node(d, cap, nodes, node->a, reverse);
+            s = re_state_new(d, cap, NS_SPLIT, f.start, -1);
+            return (struct re_frag){ s, re_append(d, f.outs, s * 2 + 1) };
+    }
+}
+
+
+/*
+ *  Add NFA state s and everything it reaches without reading a byte to
+ *  d->list, following ^ and $ only where `at` says they hold. States
+ *  that read a byte, match or wait for the end are kept.
+ */
+static void dfa_closure(struct re_dfa *d, int s, int *n, int at)
+{
+    int top = 0;
+
+    d->stack[top++] = s;
+    while (top > 0) {
+        s = d->stack[--top];
+        if (s < 0 || d->mark[s] == d->mark_gen) {
+            continue;
+        }
+        d->mark[s] = d->mark_gen;
+
+        struct re_state *st = &d->nfa[s];
+
+        switch (st->type) {
+            case NS_SPLIT:
+                d->stack[top++] = st->out1;
+                d->stack[top++] = st->out;
+                break;
+            case NS_JUMP:
+                d->stack[top++] = st->out;
+                break;
+            case NS_BEGIN:
+                if (at & AT_BEGIN) {
+                    d->stack[top++] = st->out;
+                }
+                break;
+            case NS_END:
+                if (at & AT_END) {
+                    d->stack[top++] = st->out;
+                    break;
+                }
+                d->list[(*n)++] = s;
+                break;
+            default:
+                d->list[(*n)++] = s;
+                break;
+        }
+    }
+}
+
+
+static int int_compare(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+
+/*
+ *  Sorted closure of the start, kept as a copy in set.
+ */
+static int dfa_start_set(struct re_dfa *d, int *set, int at)
+{
+    int n = 0;
+
+    d->mark_gen++;
+    dfa_closure(d, d->nfa_start, &n, at);
+    qsort(d->list, n, sizeof(int), int_compare);
+    memcpy(set, d->list, n * sizeof(int));
+    return n;
+}
+
+
+/*
+ *  Whether the NS_END states of set reach a match once the end is seen.
+ */
+static int dfa_match_end(struct re_dfa *d, const int *set, int n)
+{
+    int top = 0;
+
+    d->mark_gen++;
+    for (int i = 0; i < n; i++) {
+        if (d->nfa[set[i]].type == NS_END) {
+            d->stack[top++] = d->nfa[set[i]].out;
+        }
+    }
+
+    while (top > 0) {
+        int s = d->stack[--top];
+
+        if (s < 0 || d->mark[s] == d->mark_gen) {
+            continue;
+        }
+        d->mark[s] = d->mark_gen;
+
+        struct re_state *st = &d->nfa[s];
+
+        switch (st->type) {
+            case NS_MATCH:
+                return 1;
+            case NS_SPLIT:
+                d->stack[top++] = st->out1;
+                d->stack[top++] = st->out;
+                break;
+            case NS_JUMP:
+            case NS_END:
+                d->stack[top++] = st->out;
+                break;
+        }
+    }
+    return 0;
+}
+
+
+static void dfa_flush(struct re_dfa *d)
+{
+    for (int i = 0; i < d->nstates; i++) {
+        free(d->states[i]);
+    }
+    d->nstates = 0;
+    d->flushes++;
+    for (int i = 0; i < DFA_TABLE_SIZE; i++) {
+        d->table[i] = -1;
+    }
+}
+
+
+/*
+ *  Return the DFA state for the sorted NFA states set[0..n), making it
+ *  when it is new.
+ */
+static int dfa_state_get(struct re_dfa *d, const int *set, int n)
+{
+    unsigned int hash = 2166136261u;
+
+    for (int i = 0; i < n; i++) {
+        hash = (hash ^ (unsigned int)set[i]) * 16777619u;
+    }
+
+    int slot = hash & (DFA_TABLE_SIZE - 1);
+
+    for (; d->table[slot] >= 0; slot = (slot + 1) & (DFA_TABLE_SIZE - 1)) {
+        struct dfa_state *st = d->states[d->table[slot]];
+
+        if (st->hash == hash && st->n == n
+                && memcmp(st->set, set, n * sizeof(int)) == 0) {
+            return d->table[slot];
+        }
+    }
+
+    if (d->nstates == DFA_MAX_STATES) {
+        dfa_flush(d);
+        d->start       = dfa_state_get(d, d->start_set, d->start_n);
+        d->start_begin = dfa_state_get(d, d->begin_set, d->begin_n);
+        return dfa_state_get(d, set, n);
+    }
+
+    struct dfa_state *st = malloc(sizeof(*st) + n * sizeof(int));
+
+    if (st == NULL) {
+        die("malloc");
+    }
+    st->n     = n;
+    st->hash  = hash;
+    st->set   = (int *)(st + 1);
+    st->match = 0;
+    memcpy(st->set, set, n * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        if (d->nfa[set[i]].type == NS_MATCH) {
+            st->match = 1;
+        }
+    }
+    st->match_end = st->match || dfa_match_end(d, set, n);
+    for (int i = 0; i < 256; i++) {
+        st->next[i] = -1;
+    }
+
+    d->states[d->nstates] = st;
+    d->table[slot] = d->nstates;
+    return d->nstates++;
+}
+
+
+/*
+ *  The slow path of dfa_next: work out where state `from` goes on c.
+ */
+static int dfa_build(struct re_dfa *d, int from, unsigned char c)
+{
+    struct dfa_state *st = d->states[from];
+    int n = 0;
+
+    d->mark_gen++;
+    for (int i = 0; i < st->n; i++) {
+        struct re_state *s = &d->nfa[st->set[i]];
+
+        if (s->type == NS_CLASS && (d->sets[s->set][c >> 3] & (1 << (c & 7)))) {
+            dfa_closure(d, s->out, &n, 0);
+        }
+    }
+    if (d->floating) {
+        for (int i = 0; i < d->start_n; i++) {
+            if (d->mark[d->start_set[i]] != d->mark_gen) {
+                d->mark[d->start_set[i]] = d->mark_gen;
+                d->list[n++] = d->start_set[i];
+            }
+        }
+    }
+    qsort(d->list, n, sizeof(int), int_compare);
+
+    unsigned long flushes = d->flushes;
+    int to = dfa_state_get(d, d->list, n);
+
+    if (flushes == d->flushes) {
+        st->next[c] = to;
+    }
+    return to;
+}
+
+
+static int dfa_next(struct re_dfa *d, int from, unsigned char c)
+{
+    int to = d->states[from]->next[c];
+
+    return to >= 0 ? to : dfa_build(d, from, c);
+}
+
+
+static void dfa_init(struct re_dfa *d, unsigned char (*sets)[32],
+        int start, int floating)
+{
+    d->sets      = sets;
+    d->floating  = floating;
+    d->nfa_start = start;
+    d->nstates   = 0;
+    d->flushes   = 0;
+    d->mark_gen  = 0;
+    d->states    = malloc(DFA_MAX_STATES * sizeof(*d->states));
+    d->table     = malloc(DFA_TABLE_SIZE * sizeof(int));
+    d->stack     = malloc((d->nnfa * 2 + 1) * sizeof(int));
+    d->list      = malloc(d->nnfa * sizeof(int));
+    d->mark      = calloc(d->nnfa, sizeof(int));
+    d->start_set = malloc(d->nnfa * sizeof(int));
+    d->begin_set = malloc(d->nnfa * sizeof(int));
+    if (!d->states || !d->table || !d->stack || !d->list
+            || !d->mark || !d->start_set || !d->begin_set) {
+        die("malloc");
+    }
+    for (int i = 0; i < DFA_TABLE_SIZE; i++) {
+        d->table[i] = -1;
+    }
+
+    int n = dfa_start_set(d, d->start_set, AT_BEGIN | AT_END);
+
+    d->match_empty = 0;
+    for (int i = 0; i < n; i++) {
+        if (d->nfa[d->start_set[i]].type == NS_MATCH) {
+            d->match_empty = 1;
+        }
+    }
+
+    d->start_n     = dfa_start_set(d, d->start_set, 0);
+    d->begin_n     = dfa_start_set(d, d->begin_set, AT_BEGIN);
+    d->start       = dfa_state_get(d, d->start_set, d->start_n);
+    d->start_begin = dfa_state_get(d, d->begin_set, d->begin_n);
+}
+
+
+static void dfa_free(struct re_dfa *d)
+{
+    if (d->states) {
+        dfa_flush(d);
+    }
+    free(d->states);
+    free(d->table);
+    free(d->stack);
+    free(d->list);
+    free(d->mark);
+    free(d->start_set);
+    free(d->begin_set);
+    free(d->nfa);
+}
+
+
+static void regex_unref(struct regex *re)
+{
+    if (re == NULL || --re->refs > 0) {
+        return;
+    }
+
+    dfa_free(&re->fwd);
+    dfa_free(&re->rev);
+    free(re->sets);
+    free(re->starts);
+    free(re->pattern);
+    free(re);
+}
+
+
+static struct regex *regex_ref(struct regex *re)
+{
+    re->refs++;
+    return re;
+}
+
+
+/*
+ *  Compile s[0..len), on a syntax error return NULL with *error set.
+ */
+static struct regex *regex_compile(const char *s, int len,
+        const char **error)
+{
+    struct re_parse ps = {0};
+
+    ps.p = s;
+    ps.end = s + len;
+
+    int root = re_alt(&ps);
+
+    if (root >= 0 && ps.p < ps.end) {
+        ps.error = "unmatched )";
+        root = -1;
+    }
+    if (root < 0) {
+        *error = ps.error;
+        free(ps.nodes);
+        free(ps.sets);
+        return NULL;
+    }
+
+    struct regex *re = calloc(1, sizeof(*re));
+
+    if (re == NULL) {
+        die("calloc");
+    }
+    re->serial  = ++regex_serial;
+    re->sets    = ps.sets;
+    re->pattern = malloc(len + 1);
+    if (re->pattern == NULL) {
+        die("malloc");
+    }
+    memcpy(re->pattern, s, len);
+    re->pattern[len] = '\0';
+
+    struct re_dfa *dirs[2] = { &re->fwd, &re->rev };
+
+    for (int k = 0; k < 2; k++) {
+        int cap = 0;
+        struct re_frag f = re_compile_node(dirs[k], &cap, ps.nodes, root, k);
+
+        re_patch(dirs[k], f.outs, re_state_new(dirs[k], &cap,
+                    NS_MATCH, -1, -1));
+        dfa_init(dirs[k], ps.sets, f.start, k == 1);
+    }
+    free(ps.nodes);
+
+    return regex_ref(re);
+}
+
+
+/*
+ *  End of the longest match starting at s[at], -1 when there is none.
+ */
+static int regex_longest(struct regex *re, const char *s, int len, int at)
+{
+    struct re_dfa *d = &re->fwd;
+    int st = at == 0 ? d->start_begin : d->start;
+    int end = -1;
+
+    if (len == 0) {
+        return d->match_empty ? 0 : -1;
+    }
+    if (d->states[st]->match || (at == len && d->states[st]->match_end)) {
+        end = at;
+    }
+    for (int i = at; i < len; i++) {
+        st = dfa_next(d, st, s[i]);
+
+        struct dfa_state *state = d->states[st];
+
+        if (state->n == 0) {
+            break;
+        }
+        if (state->match || (i + 1 == len && state->match_end)) {
+            end = i + 1;
+        }
+    }
+    return end;
+}
+
+
+/*
+ *  Mark in re->starts every byte of s[from..len] some match starts at,
+ *  by one pass of the reversed pattern from the end of the line.
+ */
+static void regex_mark_starts(struct regex *re, const char *s, int len,
+        int from)
+{
+    struct re_dfa *d = &re->rev;
+
+    if (re->starts_cap < len + 1) {
+        re->starts_cap = len + 1;
+        free(re->starts);
+        re->starts = malloc(re->starts_cap);
+        if (re->starts == NULL) {
+            die("malloc");
+        }
+    }
+
+    int st = d->start_begin;
+
+    re->starts[len] = len == 0 ? d->match_empty : d->states[st]->match;
+    for (int p = len - 1; p >= from; p--) {
+        st = dfa_next(d, st, s[p]);
+        re->starts[p] = d->states[st]->match
+            || (p == 0 && d->states[st]->match_end);
+    }
+}
+
+
+/*
+ *  Leftmost-longest matches of s[0..len) that start at or after from
+ *  and do not overlap, at most max of them as start, end pairs.
+ */
+static int regex_spans(struct regex *re, const char *s, int len,
+        int from, int *spans, int max)
+{
+    int n = 0;
+
+    if (from > len || max == 0) {
+        return 0;
+    }
+    regex_mark_starts(re, s, len, from);
+
+    for (int p = from; p <= len && n < max; ) {
+        char *q = memchr(re->starts + p, 1, len + 1 - p);
+
+        if (q == NULL) {
             break;
-        case 7:
-            v = JS_NewInt32(ctx, s->changed);
+        }
+        p = q - re->starts;
+
+        int end = regex_longest(re, s, len, p);
+
+        spans[n * 2]     = p;
+        spans[n * 2 + 1] = end;
+        n++;
+        p = end > p ? end : p + 1;
+    }
+    return n;
+}
+
+
+/*
+ *  Start of the first match at or after from, -1 when there is none.
+ */
+static int regex_find(struct regex *re, const char *s, int len, int from)
+{
+    int span[2];
+
+    return regex_spans(re, s, len, from, span, 1) ? span[0] : -1;
+}
+
+
+/*
+ *  Start of the last match that starts before limit, -1 when none.
+ */
+static int regex_find_last(struct regex *re, const char *s, int len,
+        int limit)
+{
+    int last = -1;
+
+    regex_mark_starts(re, s, len, 0);
+    for (int p = 0; p <= len && p < limit; ) {
+        if (!re->starts[p]) {
+            p++;
+            continue;
+        }
+        last = p;
+
+        int end = regex_longest(re, s, len, p);
+
+        p = end > p ? end : p + 1;
+    }
+    return last;
+}
+
+
+/*
+ *  Search
+ */
+
+
+/*
+ *  Find needle in s. Candidates are positions where both the first and
+ *  the last byte of needle match, tested 16 at a time; only those get
+ *  a full compare. Short tails fall back to memchr on the first byte.
+ */
+static const char *search_mem(const char *s, size_t n,
+        const char *needle, size_t m)
+{
+    size_t i = 0;
+
+    if (m == 0 || n < m) {
+        return NULL;
+    }
+    if (m == 1) {
+        return memchr(s, needle[0], n);
+    }
+
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last  = _mm_set1_epi8(needle[m - 1]);
+
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            int k = __builtin_ctz(mask);
+
+            if (memcmp(s + i + k + 1, needle + 1, m - 2) == 0) {
+                return s + i + k;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    const char *p = s + i;
+    const char *end = s + n - m + 1;
+
+    while (p < end && (p = memchr(p, needle[0], end - p)) != NULL) {
+        if (memcmp(p + 1, needle + 1, m - 1) == 0) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+
+/*
+ *  Bytes of a loaded row in one piece, the gap is moved out of the way.
+ */
+static const char *search_row_text(erow *row)
+{
+    if (erow_is_gap(row)) {
+        erow_gap_move(row, row->size);
+    }
+    return row->chars;
+}
+
+
+/*
+ *  Lines of a lazy leaf are searched straight in their block, a run of
+ *  them at once. Return the start of line index of the leaf.
+ */
+static char *search_lazy_line(struct line_node *leaf, int index, char **end)
+{
+    char *p = leaf->block->base + leaf->offset;
+    int len;
+
+    *end = leaf->block->base + leaf->block->len;
+    while (index-- > 0) {
+        p = line_next(p, *end, &len);
+    }
+    return p;
+}
+
+
+/*
+ *  Find the first match in the lines from p on, all of them before
+ *  end, where row y starts at p. Matches may not run into the '\r' of
+ *  a line, those are skipped.
+ */
+static int search_lines(struct editor_config *E, char *p, char *end,
+        char *from, int y, int *my, int *mx)
+{
+    const char *hit = from;
+
+    while ((hit = search_mem(hit, end - hit,
+                    E->search, E->search_len)) != NULL) {
+        char *line = p;
+        int len;
+        char *next = line_next(line, end, &len);
+
+        while (next <= hit && next < end) {
+            line = next;
+            next = line_next(line, end, &len);
+            y++;
+        }
+        p = line;
+
+        if (hit + E->search_len <= line + len) {
+            *my = y;
+            *mx = hit - line;
+            return 1;
+        }
+        hit++;
+    }
+    return 0;
+}
+
+
+/*
+ *  First match in text[from..len) of re, or of the literal pattern when
+ *  re is NULL. Return where it starts, -1 when there is none.
+ */
+static int search_text(struct editor_config *E, struct regex *re,
+        const char *text, int len, int from)
+{
+    if (re) {
+        return regex_find(re, text, len, from);
+    }
+
+    const char *hit = search_mem(text + from, len - from,
+            E->search, E->search_len);
+
+    return hit ? hit - text : -1;
+}
+
+
+/*
+ *  Last match in text that starts before limit, -1 when there is none.
+ */
+static int search_text_last(struct editor_config *E, struct regex *re,
+        const char *text, int len, int limit)
+{
+    if (re) {
+        return regex_find_last(re, text, len, limit);
+    }
+
+    const char *hit = text;
+    int last = -1;
+
+    while ((hit = search_mem(hit, len - (hit - text),
+                    E->search, E->search_len)) != NULL
+            && hit - text < limit) {
+        last = hit - text;
+        hit++;
+    }
+    return last;
+}
+
+
+/*
+ *  First match at or after byte x of row y.
+ */
+static int search_forward(struct editor_config *E, struct regex *re,
+        int y, int x, int *my, int *mx)
+{
+    for (int j = y; j < E->numrows; ) {
+        int index;
+        struct line_node *leaf = line_tree_peek(E->lines, j, &index);
+        int count = leaf->n - index;
+
+        if (leaf->rows) {
+            for (int i = 0; i < count; i++) {
+                erow *row = &leaf->rows[index + i];
+                int from = j + i == y ? x : 0;
+
+                if (from > row->size) {
+                    continue;
+                }
+
+                const char *text = search_row_text(row);
+                int at = search_text(E, re, text, row->size, from);
+
+                if (at >= 0) {
+                    *my = j + i;
+                    *mx = at;
+                    return 1;
+                }
+            }
+        }
+        else if (re) {
+            char *end;
+            char *p = search_lazy_line(leaf, index, &end);
+
+            for (int i = 0; i < count; i++) {
+                int len;
+                char *next = line_next(p, end, &len);
+                int from = j + i == y ? x : 0;
+                int at = from <= len ? regex_find(re, p, len, from) : -1;
+
+                if (at >= 0) {
+                    *my = j + i;
+                    *mx = at;
+                    return 1;
+                }
+                p = next;
+            }
+        }
+        else {
+            char *end;
+            char *p = search_lazy_line(leaf, index, &end);
+            char *q = p;
+            int len;
+
+            for (int i = 0; i < count; i++) {
+                q = line_next(q, end, &len);
+            }
+
+            int first_len;
+            line_next(p, end, &first_len);
+
+            char *from = p + (j == y ? (x < first_len ? x : first_len) : 0);
+
+            if (search_lines(E, p, q, from, j, my, mx)) {
+                return 1;
+            }
+        }
+        j += count;
+    }
+    return 0;
+}
+
+
+/*
+ *  Last match that starts before byte x of row y.
+ */
+static int search_backward(struct editor_config *E, struct regex *re,
+        int y, int x, int *my, int *mx)
+{
+    int found = 0;
+
+    if (y >= E->numrows) {
+        y = E->numrows - 1;
+        x = INT_MAX;
+    }
+
+    for (int j = y; j >= 0 && !found; ) {
+        int index;
+        struct line_node *leaf = line_tree_peek(E->lines, j, &index);
+        int first = j - index;
+
+        if (leaf->rows) {
+            for (int r = j; r >= first && !found; r--) {
+                erow *row = &leaf->rows[r - first];
+                int limit = r == y ? x : row->size;
+                const char *text = search_row_text(row);
+                int at = search_text_last(E, re, text, row->size, limit);
+
+                if (at >= 0) {
+                    *my = r;
+                    *mx = at;
+                    found = 1;
+                }
+            }
+        }
+        else if (re) {
+            char *end;
+            char *p = search_lazy_line(leaf, 0, &end);
+
+            for (int r = first; r <= j; r++) {
+                int len;
+                char *next = line_next(p, end, &len);
+                int at = regex_find_last(re, p, len, r == y ? x : INT_MAX);
+
+                if (at >= 0) {
+                    *my = r;
+                    *mx = at;
+                    found = 1;
+                }
+                p = next;
+            }
+        }
+        else {
+            char *end;
+            char *p = search_lazy_line(leaf, 0, &end);
+            char *q = p;
+            int len;
+            int y1, x1;
+
+            for (int i = first; i <= j; i++) {
+                q = line_next(q, end, &len);
+            }
+
+            // the last row only counts up to x
+            char *from = p;
+
+            while (search_lines(E, p, q, from, first, &y1, &x1)
+                    && (y1 < y || x1 < x)) {
+                *my = y1;
+                *mx = x1;
+                found = 1;
+                from = search_lazy_line(leaf, y1 - first, &end) + x1 + 1;
+            }
+        }
+        j = first - 1;
+    }
+    return found;
+}
+
+
+/*
+ *  Move the cursor to the next match of re, or of the literal pattern
+ *  when re is NULL, wrapping around the end of the buffer. Return 0
+ *  when there is none.
+ */
+static int c_search(struct editor_config *E, struct regex *re, int backward)
+{
+    int y = E->cy;
+    int x = E->cx;
+    int my, mx;
+    int found;
+
+    if ((re == NULL && E->search == NULL) || E->numrows == 0) {
+        return 0;
+    }
+
+    if (backward) {
+        found = search_backward(E, re, y, x, &my, &mx);
+        if (!found) {
+            found = search_backward(E, re, E->numrows, 0, &my, &mx);
+            if (found) {
+                c_echo_status_message(E, "search hit TOP, continuing at BOTTOM");
+            }
+        }
+    }
+    else {
+        found = search_forward(E, re, y, x + 1, &my, &mx);
+        if (!found) {
+            found = search_forward(E, re, 0, 0, &my, &mx);
+            if (found) {
+                c_echo_status_message(E, "search hit BOTTOM, continuing at TOP");
+            }
+        }
+    }
+
+    if (!found) {
+        c_echo_status_message(E, "Pattern not found: %s",
+                re ? re->pattern : E->search);
+        return 0;
+    }
+
+    E->cy = my;
+    E->cx = mx;
+    E->search_y = my;
+    E->search_x = mx;
+    return 1;
+}
+
+
+static void search_set(struct editor_config *E, const char *s, int len)
+{
+    free(E->search);
+    E->search = NULL;
+    E->search_len = 0;
+
+    if (len > 0) {
+        E->search = malloc(len + 1);
+        if (E->search == NULL) {
+            die("malloc");
+        }
+        memcpy(E->search, s, len);
+        E->search[len] = '\0';
+        E->search_len = len;
+    }
+}
+
+
+/*
+ *  A compiled pattern handed to JS. Compiling again swaps re, so one
+ *  object can follow a pattern while it is typed and then serve every
+ *  next and previous after that.
+ */
+struct js_regex {
+    struct regex *re;
+    int highlight;  // keep E->highlight on re
+    struct editor_config *E;
+    JSValue terminal;  // keeps E alive
+};
+
+
+static void js_regex_set(struct js_regex *r, struct regex *re)
+{
+    struct editor_config *E = r->E;
+
+    if (r->highlight && E->highlight == r->re) {
+        regex_unref(E->highlight);
+        E->highlight = re ? regex_ref(re) : NULL;
+    }
+    regex_unref(r->re);
+    r->re = re;
+}
+
+
+/*
+ *  Incremental search: every key typed searches again from where the
+ *  prompt was opened, arrows step through the matches and escape puts
+ *  the cursor back.
+ */
+struct search_origin {
+    int cx;
+    int cy;
+    int row_offset;
+    int col_offset;
+    struct js_regex *regex;  // NULL for a literal search
+};
+
+static struct search_origin search_origin;
+
+
+static void search_prompt_callback(struct editor_config *E,
+        char *buf, int key)
+{
+    if (key == '\x1b') {
+        E->cx         = search_origin.cx;
+        E->cy         = search_origin.cy;
+        E->row_offset = search_origin.row_offset;
+        E->col_offset = search_origin.col_offset;
+        return;
+    }
+    if (key == '\r') {
+        return;
+    }
+
+    struct js_regex *r = search_origin.regex;
+
+    if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        c_search(E, r ? r->re : NULL, 0);
+        return;
+    }
+    if (key == ARROW_LEFT || key == ARROW_UP) {
+        c_search(E, r ? r->re : NULL, 1);
+        return;
+    }
+
+    if (r) {
+        const char *error;
+        struct regex *re = regex_compile(buf, strlen(buf), &error);
+
+        // a half typed pattern keeps the last one that compiled
+        if (re == NULL) {
+            return;
+        }
+        js_regex_set(r, re);
+    }
+    else {
+        search_set(E, buf, strlen(buf));
+    }
+    E->cx = search_origin.cx - 1;
+    E->cy = search_origin.cy;
+    if (!c_search(E, r ? r->re : NULL, 0)) {
+        E->cx = search_origin.cx;
+    }
+}
+
+
+static JSValue js_search(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    size_t len;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    const char *str = JS_ToCStringLen(ctx, &len, argv[0]);
+
+    if (str == NULL) {
+        return JS_EXCEPTION;
+    }
+    search_set(s, str, len);
+    JS_FreeCString(ctx, str);
+
+    return JS_NewBool(ctx, c_search(s, NULL, 0));
+}
+
+
+static JSValue js_search_next(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    return JS_NewBool(ctx, c_search(s, NULL, 0));
+}
+
+
+static JSValue js_search_previous(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    return JS_NewBool(ctx, c_search(s, NULL, 1));
+}
+
+
+static JSValue js_search_prompt(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    search_origin.cx         = s->cx;
+    search_origin.cy         = s->cy;
+    search_origin.row_offset = s->row_offset;
+    search_origin.col_offset = s->col_offset;
+    search_origin.regex      = NULL;
+
+    char *result = editor_prompt(s, "/%s", search_prompt_callback, NULL);
+
+    free(result);
+    return JS_UNDEFINED;
+}
+
+
+static void js_regex_finalizer(JSRuntime *rt, JSValue val)
+{
+    struct js_regex *r = JS_GetOpaque(val, js_regex_class_id);
+
+    regex_unref(r->re);
+    JS_FreeValueRT(rt, r->terminal);
+    js_free_rt(rt, r);
+}
+
+
+static void js_regex_mark(JSRuntime *rt, JSValueConst val,
+        JS_MarkFunc *mark_func)
+{
+    struct js_regex *r = JS_GetOpaque(val, js_regex_class_id);
+
+    JS_MarkValue(rt, r->terminal, mark_func);
+}
+
+
+static JSClassDef js_regex_class = {
+    "VT100Regex",
+    .finalizer = js_regex_finalizer,
+    .gc_mark = js_regex_mark,
+};
+
+
+/*
+ *  Compile argv[0] into r, throw a SyntaxError when it is no regex.
+ */
+static int js_regex_compile_value(JSContext *ctx, struct js_regex *r,
+        JSValueConst pattern)
+{
+    size_t len;
+    const char *error = NULL;
+    const char *str = JS_ToCStringLen(ctx, &len, pattern);
+
+    if (str == NULL) {
+        return -1;
+    }
+
+    struct regex *re = regex_compile(str, len, &error);
+
+    JS_FreeCString(ctx, str);
+    if (re == NULL) {
+        JS_ThrowSyntaxError(ctx, "regex: %s", error);
+        return -1;
+    }
+    js_regex_set(r, re);
+    return 0;
+}
+
+
+/*
+ *  terminal.regex(pattern): a search object for this editor, pattern
+ *  may be left out and given later with compile or prompt.
+ */
+static JSValue js_regex_new(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    struct js_regex *r = js_mallocz(ctx, sizeof(*r));
+    if (!r) {
+        return JS_EXCEPTION;
+    }
+    r->E        = s;
+    r->terminal = JS_DupValue(ctx, this_val);
+
+    JSValue obj = JS_NewObjectClass(ctx, js_regex_class_id);
+    if (JS_IsException(obj)) {
+        JS_FreeValue(ctx, r->terminal);
+        js_free(ctx, r);
+        return obj;
+    }
+    JS_SetOpaque(obj, r);
+
+    if (argc > 0 && !JS_IsUndefined(argv[0])
+            && js_regex_compile_value(ctx, r, argv[0])) {
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    return obj;
+}
+
+
+static JSValue js_regex_compile(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct js_regex *r = JS_GetOpaque2(ctx, this_val, js_regex_class_id);
+    if (!r) {
+        return JS_EXCEPTION;
+    }
+
+    if (js_regex_compile_value(ctx, r, argv[0])) {
+        return JS_EXCEPTION;
+    }
+    return JS_UNDEFINED;
+}
+
+
+static JSValue js_regex_next(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv, int backward)
+{
+    struct js_regex *r = JS_GetOpaque2(ctx, this_val, js_regex_class_id);
+    if (!r) {
+        return JS_EXCEPTION;
+    }
+
+    if (r->re == NULL) {
+        return JS_FALSE;
+    }
+    return JS_NewBool(ctx, c_search(r->E, r->re, backward));
+}
+
+
+/*
+ *  Read the pattern on the message bar, searching as it is typed.
+ */
+static JSValue js_regex_prompt(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct js_regex *r = JS_GetOpaque2(ctx, this_val, js_regex_class_id);
+    if (!r) {
+        return JS_EXCEPTION;
+    }
+
+    struct editor_config *s = r->E;
+
+    search_origin.cx         = s->cx;
+    search_origin.cy         = s->cy;
+    search_origin.row_offset = s->row_offset;
+    search_origin.col_offset = s->col_offset;
+    search_origin.regex      = r;
+
+    char *result = editor_prompt(s, "?%s", search_prompt_callback, NULL);
+
+    int entered = result != NULL;
+
+    search_origin.regex = NULL;
+    free(result);
+    return JS_NewBool(ctx, entered);
+}
+
+
+/*
+ *  Show the matches of this pattern on screen, or stop showing them.
+ */
+static JSValue js_regex_highlight(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct js_regex *r = JS_GetOpaque2(ctx, this_val, js_regex_class_id);
+    if (!r) {
+        return JS_EXCEPTION;
+    }
+
+    struct editor_config *s = r->E;
+    int on = JS_ToBool(ctx, argv[0]);
+
+    if (on) {
+        regex_unref(s->highlight);
+        s->highlight = r->re ? regex_ref(r->re) : NULL;
+    }
+    else if (r->highlight && s->highlight == r->re) {
+        regex_unref(s->highlight);
+        s->highlight = NULL;
+    }
+    r->highlight = on;
+    return JS_UNDEFINED;
+}
+
+
+static JSValue js_regex_test(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct js_regex *r = JS_GetOpaque2(ctx, this_val, js_regex_class_id);
+    size_t len;
+
+    if (!r) {
+        return JS_EXCEPTION;
+    }
+    if (r->re == NULL) {
+        return JS_FALSE;
+    }
+
+    const char *str = JS_ToCStringLen(ctx, &len, argv[0]);
+
+    if (str == NULL) {
+        return JS_EXCEPTION;
+    }
+
+    int found = regex_find(r->re, str, len, 0) >= 0;
+
+    JS_FreeCString(ctx, str);
+    return JS_NewBool(ctx, found);
+}
+
+
+static JSValue js_regex_pattern_get(JSContext *ctx, JSValueConst this_val)
+{
+    struct js_regex *r = JS_GetOpaque2(ctx, this_val, js_regex_class_id);
+    if (!r) {
+        return JS_EXCEPTION;
+    }
+
+    if (r->re == NULL) {
+        return JS_NULL;
+    }
+    return JS_NewString(ctx, r->re->pattern);
+}
+
+
+static const JSCFunctionListEntry js_regex_proto_funcs[] = {
+    JS_CFUNC_DEF("compile", 1, js_regex_compile),
+    JS_CFUNC_MAGIC_DEF("next", 0, js_regex_next, 0),
+    JS_CFUNC_MAGIC_DEF("previous", 0, js_regex_next, 1),
+    JS_CFUNC_DEF("prompt", 0, js_regex_prompt),
+    JS_CFUNC_DEF("highlight", 1, js_regex_highlight),
+    JS_CFUNC_DEF("test", 1, js_regex_test),
+    JS_CGETSET_DEF("pattern", js_regex_pattern_get, NULL),
+};
+
+
+/*
+ *  Replace
+ */
+
+
+/*
+ *  Buffers with at least this many rows are split across threads.
+ */
+#define REPLACE_SPLIT   (64 << 10)
+#define REPLACE_THREADS 8
+
+
+/*
+ *  One worker's share of a replace: rows from..to-1 are only read, and
+ *  the new text of every row that matched goes to text, which becomes
+ *  the block those rows borrow once all workers are done.
+ */
+struct replace_chunk {
+    struct editor_config *E;
+    struct regex *re;  // own copy, its DFA grows while matching
+    const char *with;
+    int with_len;
+    int from;
+    int to;
+    int *rows;        // rows that changed
+    size_t *offsets;  // where each starts in text, nrows + 1 of them
+    int nrows;
+    int rows_cap;
+    char *text;
+    size_t len;
+    size_t cap;
+    long count;
+    char *line;       // a gap row copied in one piece
+    int line_cap;
+    int *spans;
+    int spans_cap;    // pairs
+    int done;
+};
+
+
+static int replace_cancel;
+
+
+static void replace_spans_grow(struct replace_chunk *c)
+{
+    c->spans_cap = c->spans_cap ? c->spans_cap * 2 : 16;
+    c->spans = realloc(c->spans, c->spans_cap * 2 * sizeof(int));
+    if (c->spans == NULL) {
+        die("realloc");
+    }
+}
+
+
+/*
+ *  Matches of s as start, end pairs in c->spans.
+ */
+static int replace_find(struct replace_chunk *c, const char *s, int len)
+{
+    int n = 0;
+
+    if (c->re) {
+        while ((n = regex_spans(c->re, s, len, 0,
+                        c->spans, c->spans_cap)) == c->spans_cap) {
+            replace_spans_grow(c);
+        }
+        return n;
+    }
+
+    struct editor_config *E = c->E;
+    const char *hit;
+    int at = 0;
+
+    while ((hit = search_mem(s + at, len - at,
+                    E->search, E->search_len)) != NULL) {
+        if (n == c->spans_cap) {
+            replace_spans_grow(c);
+        }
+        c->spans[n * 2]     = hit - s;
+        c->spans[n * 2 + 1] = hit - s + E->search_len;
+        at = c->spans[n * 2 + 1];
+        n++;
+    }
+    return n;
+}
+
+
+static void replace_line(struct replace_chunk *c, int y,
+        const char *s, int len)
+{
+    int n = replace_find(c, s, len);
+
+    if (n == 0) {
+        return;
+    }
+
+    size_t size = len + (size_t)n * c->with_len;
+
+    for (int i = 0; i < n; i++) {
+        size -= c->spans[i * 2 + 1] - c->spans[i * 2];
+    }
+
+    if (c->nrows == c->rows_cap) {
+        c->rows_cap = c->rows_cap ? c->rows_cap * 2 : 256;
+        c->rows = realloc(c->rows, c->rows_cap * sizeof(int));
+        c->offsets = realloc(c->offsets, (c->rows_cap + 1) * sizeof(size_t));
+        if (c->rows == NULL || c->offsets == NULL) {
+            die("realloc");
+        }
+    }
+    if (c->len + size > c->cap) {
+        c->cap = c->len + size > c->cap * 2 ? c->len + size : c->cap * 2;
+        c->text = realloc(c->text, c->cap);
+        if (c->text == NULL) {
+            die("realloc");
+        }
+    }
+
+    char *p = c->text + c->len;
+    int at = 0;
+
+    for (int i = 0; i < n; i++) {
+        memcpy(p, s + at, c->spans[i * 2] - at);
+        p += c->spans[i * 2] - at;
+        memcpy(p, c->with, c->with_len);
+        p += c->with_len;
+        at = c->spans[i * 2 + 1];
+    }
+    memcpy(p, s + at, len - at);
+
+    c->rows[c->nrows] = y;
+    c->offsets[c->nrows] = c->len;
+    c->nrows++;
+    c->len += size;
+    c->offsets[c->nrows] = c->len;
+    c->count += n;
+}
+
+
+/*
+ *  Text of a loaded row in one piece, without moving its gap: other
+ *  workers may read the same leaf.
+ */
+static const char *replace_row_text(struct replace_chunk *c, erow *row)
+{
+    int len0, len1;
+    char *p = erow_span(row, 0, &len0);
+
+    if (erow_nspans(row) < 2 || row->size == 0) {
+        return p;
+    }
+
+    char *q = erow_span(row, 1, &len1);
+
+    if (c->line_cap < row->size) {
+        c->line_cap = row->size;
+        free(c->line);
+        c->line = malloc(c->line_cap);
+        if (c->line == NULL) {
+            die("malloc");
+        }
+    }
+    memcpy(c->line, p, len0);
+    memcpy(c->line + len0, q, len1);
+    return c->line;
+}
+
+
+static void *replace_run(void *arg)
+{
+    struct replace_chunk *c = arg;
+    struct editor_config *E = c->E;
+
+    for (int j = c->from; j < c->to; ) {
+        if (__atomic_load_n(&replace_cancel, __ATOMIC_RELAXED)) {
             break;
-        case 8:
-            v = JS_NewInt32(ctx, s->numrows);
+        }
+
+        int index;
+        struct line_node *leaf = line_tree_peek(E->lines, j, &index);
+        int count = leaf->n - index;
+
+        if (count > c->to - j) {
+            count = c->to - j;
+        }
+
+        if (leaf->rows) {
+            for (int i = 0; i < count; i++) {
+                erow *row = &leaf->rows[index + i];
+
+                replace_line(c, j + i, replace_row_text(c, row), row->size);
+            }
+        }
+        else {
+            char *end;
+            char *p = search_lazy_line(leaf, index, &end);
+
+            for (int i = 0; i < count; i++) {
+                int len;
+                char *next = line_next(p, end, &len);
+
+                replace_line(c, j + i, p, len);
+                p = next;
+            }
+        }
+        j += count;
+    }
+
+    __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+
+static void replace_chunk_free(struct replace_chunk *c)
+{
+    regex_unref(c->re);
+    free(c->rows);
+    free(c->offsets);
+    free(c->line);
+    free(c->spans);
+}
+
+
+/*
+ *  Rows that changed become views of their chunk's text, in one walk
+ *  down the buffer. What they held before goes to undo.
+ */
+static void replace_splice(struct editor_config *E, struct replace_chunk *c,
+        struct undo_rows *undo)
+{
+    if (c->nrows == 0) {
+        free(c->text);
+        return;
+    }
+
+    struct text_block *b = text_block_ref(text_block_new(c->text, c->len, 0));
+
+    for (int i = 0; i < c->nrows; i++) {
+        erow *row = editor_row_at(E, c->rows[i]);
+        size_t size = c->offsets[i + 1] - c->offsets[i];
+
+        undo->ys[undo->n]   = c->rows[i];
+        undo->rows[undo->n] = *row;
+        undo->n++;
+
+        row->size    = size;
+        row->chars   = NULL;
+        row->block   = NULL;
+        row->gap     = 0;
+        row->gap_len = 0;
+        if (size > 0) {
+            row->chars = c->text + c->offsets[i];
+            row->block = text_block_ref(b);
+        }
+        editor_row_update(row);
+    }
+    text_block_unref(b);
+}
+
+
+/*
+ *  Replace every match of re, or of the literal pattern when re is
+ *  NULL, by with. The rows are split among threads that only read the
+ *  buffer, while this thread waits for them and for Ctrl-C. Return how
+ *  many matches were replaced, -1 when Ctrl-C stopped it before the
+ *  buffer was touched.
+ */
+static long c_replace_all(struct editor_config *E, struct regex *re,
+        const char *with, int with_len)
+{
+    struct replace_chunk chunk[REPLACE_THREADS];
+    pthread_t tid[REPLACE_THREADS];
+    int started[REPLACE_THREADS];
+    int workers = 1;
+
+    if ((re == NULL && E->search == NULL) || E->numrows == 0) {
+        return 0;
+    }
+
+    if (E->numrows >= REPLACE_SPLIT) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers < 1) {
+            workers = 1;
+        }
+        if (workers > REPLACE_THREADS) {
+            workers = REPLACE_THREADS;
+        }
+    }
+
+    replace_cancel = 0;
+    for (int w = 0; w < workers; w++) {
+        const char *error;
+
+        memset(&chunk[w], 0, sizeof(chunk[w]));
+        chunk[w].E        = E;
+        chunk[w].with     = with;
+        chunk[w].with_len = with_len;
+        chunk[w].from     = (long)E->numrows * w / workers;
+        chunk[w].to       = (long)E->numrows * (w + 1) / workers;
+        if (re) {
+            chunk[w].re = regex_compile(re->pattern, strlen(re->pattern),
+                    &error);
+        }
+        started[w] = pthread_create(&tid[w], NULL,
+                replace_run, &chunk[w]) == 0;
+        if (!started[w]) {
+            replace_run(&chunk[w]);
+        }
+    }
+
+    int cancelled = 0;
+
+    for (int w = 0; w < workers; w++) {
+        while (!__atomic_load_n(&chunk[w].done, __ATOMIC_ACQUIRE)) {
+            if (input_interrupted(20)) {
+                __atomic_store_n(&replace_cancel, 1, __ATOMIC_RELAXED);
+                cancelled = 1;
+                break;
+            }
+        }
+        if (cancelled) {
             break;
-        case 9:
-            v = JS_NewInt32(ctx, s->number_command);
+        }
+    }
+
+    long count = 0;
+    int lines = 0;
+    struct undo_rows *undo = calloc(1, sizeof(*undo));
+
+    if (undo == NULL) {
+        die("calloc");
+    }
+
+    for (int w = 0; w < workers; w++) {
+        if (started[w]) {
+            pthread_join(tid[w], NULL);
+        }
+        if (!cancelled) {
+            lines += chunk[w].nrows;
+        }
+    }
+    if (!cancelled && lines > 0) {
+        undo->ys   = malloc(lines * sizeof(*undo->ys));
+        undo->rows = malloc(lines * sizeof(*undo->rows));
+        if (undo->ys == NULL || undo->rows == NULL) {
+            die("malloc");
+        }
+    }
+
+    for (int w = 0; w < workers; w++) {
+        if (cancelled) {
+            free(chunk[w].text);
+        }
+        else {
+            replace_splice(E, &chunk[w], undo);
+            count += chunk[w].count;
+        }
+        replace_chunk_free(&chunk[w]);
+    }
+
+    if (cancelled) {
+        undo_rows_free(undo);
+        c_echo_status_message(E, "Replace cancelled");
+        return -1;
+    }
+    undo_record_rows(E, undo);
+
+    if (count > 0) {
+        E->changed++;
+    }
+    if (E->cy < E->numrows) {
+        erow *row = editor_row_at(E, E->cy);
+
+        if (E->cx > row->size) {
+            E->cx = row->size;
+        }
+    }
+    c_echo_status_message(E, "%ld substitutions on %d lines", count, lines);
+    return count;
+}
+
+
+/*
+ *  terminal.replace_all(pattern, with): pattern is a search object from
+ *  terminal.regex() or a string, taken literally.
+ */
+static JSValue js_replace_all(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    struct regex *re = NULL;
+    size_t len;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    struct js_regex *r = JS_GetOpaque(argv[0], js_regex_class_id);
+
+    if (r) {
+        if (r->re == NULL) {
+            return JS_NewInt32(ctx, 0);
+        }
+        re = r->re;
+    }
+    else {
+        const char *str = JS_ToCStringLen(ctx, &len, argv[0]);
+
+        if (str == NULL) {
+            return JS_EXCEPTION;
+        }
+        search_set(s, str, len);
+        JS_FreeCString(ctx, str);
+    }
+
+    const char *with = JS_ToCStringLen(ctx, &len, argv[1]);
+
+    if (with == NULL) {
+        return JS_EXCEPTION;
+    }
+
+    long count = c_replace_all(s, re, with, len);
+
+    JS_FreeCString(ctx, with);
+    return JS_NewInt64(ctx, count);
+}
+
+
+/*
+ *  Lines
+ */
+
+
+/*
+ *  An ArrayBuffer that borrows the bytes of a block holds a reference
+ *  to it, dropped once JS lets go of the buffer.
+ */
+static void lines_buffer_free(JSRuntime *rt, void *opaque, void *ptr)
+{
+    text_block_unref(opaque);
+}
+
+
+/*
+ *  len bytes at p, from block b or from a gap row when b is NULL, as a
+ *  string or an ArrayBuffer. Heap blocks never change once written, so
+ *  a buffer can borrow them; a mapping is read-only and may be saved
+ *  over, and a gap row changes with the next edit, those are copied.
+ */
+static JSValue lines_value(JSContext *ctx, const char *p, int len,
+        struct text_block *b, int buffers)
+{
+    if (!buffers) {
+        return JS_NewStringLen(ctx, len > 0 ? p : "", len);
+    }
+    if (b && !b->mapped && len > 0) {
+        return JS_NewArrayBuffer(ctx, (uint8_t *)p, len,
+                lines_buffer_free, text_block_ref(b), 0);
+    }
+    return JS_NewArrayBufferCopy(ctx, (const uint8_t *)p, len);
+}
+
+
+/*
+ *  terminal.get_lines(start, count, buffers): rows start..start+count-1
+ *  as strings, or as ArrayBuffers when buffers is set. Buffers may
+ *  share bytes with the rows and must not be written to. Lazy leaves
+ *  are read in place, without turning them into rows.
+ */
+static JSValue js_get_lines(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    int start, count, index;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (JS_ToInt32(ctx, &start, argv[0])
+            || JS_ToInt32(ctx, &count, argv[1])) {
+        return JS_EXCEPTION;
+    }
+
+    int buffers = argc > 2 && JS_ToBool(ctx, argv[2]);
+
+    if (start < 0) {
+        start = 0;
+    }
+    if (start > s->numrows) {
+        start = s->numrows;
+    }
+    if (count > s->numrows - start) {
+        count = s->numrows - start;
+    }
+
+    JSValue lines = JS_NewArray(ctx);
+
+    if (JS_IsException(lines)) {
+        return lines;
+    }
+
+    for (int n = 0; n < count; n += index) {
+        struct line_node *leaf = line_tree_peek(s->lines, start + n, &index);
+        int last = leaf->n - index < count - n ? leaf->n : index + count - n;
+        char *p = NULL, *end = NULL;
+
+        if (leaf->rows == NULL) {
+            p = search_lazy_line(leaf, index, &end);
+        }
+
+        for (int i = index; i < last; i++) {
+            JSValue v;
+
+            if (leaf->rows) {
+                erow *row = &leaf->rows[i];
+
+                v = lines_value(ctx, search_row_text(row), row->size,
+                        row->block, buffers);
+            }
+            else {
+                int len;
+                char *next = line_next(p, end, &len);
+
+                v = lines_value(ctx, p, len, leaf->block, buffers);
+                p = next;
+            }
+            if (JS_IsException(v)
+                    || JS_SetPropertyUint32(ctx, lines, n + i - index, v) < 0) {
+                JS_FreeValue(ctx, lines);
+                return JS_EXCEPTION;
+            }
+        }
+        index = last - index;
+    }
+    return lines;
+}
+
+
+/*
+ *  Log rows from..to-1 as the text that was put in, or is about to be
+ *  taken out: each line and its break, or the break before them when
+ *  no row follows.
+ */
+static void undo_lines(struct editor_config *E, int type, int from, int to)
+{
+    if (from >= to) {
+        return;
+    }
+
+    size_t len = editor_rows_copy(E, from, to, NULL);
+    char *buf = malloc(len + 1);
+
+    if (buf == NULL) {
+        die("malloc");
+    }
+    editor_rows_copy(E, from, to, buf + 1);
+
+    if (to < E->numrows) {
+        undo_record(E, type, from, 0, buf + 1, len);
+    }
+    else if (from > 0) {
+        buf[0] = '\n';
+        undo_record(E, type, from - 1,
+                editor_row_at(E, from - 1)->size, buf, len);
+    }
+    else {
+        undo_record(E, type, 0, 0, buf + 1, len - 1);
+    }
+    free(buf);
+}
+
+
+struct line_text {
+    const char *p;
+    size_t len;
+    const char *str;  // freed afterwards, when converted from a string
+};
+
+
+/*
+ *  Bytes of a line handed in from JS: an ArrayBuffer or typed array is
+ *  read where it is, anything else is converted to a string.
+ */
+static int line_text_get(JSContext *ctx, JSValueConst v,
+        struct line_text *t)
+{
+    size_t offset, size;
+
+    t->str = NULL;
+    if (!JS_IsObject(v)) {
+        t->str = JS_ToCStringLen(ctx, &t->len, v);
+        t->p   = t->str;
+        return t->str ? 0 : -1;
+    }
+
+    t->p = (const char *)JS_GetArrayBuffer(ctx, &t->len, v);
+    if (t->p) {
+        return 0;
+    }
+    JS_FreeValue(ctx, JS_GetException(ctx));
+
+    JSValue buf = JS_GetTypedArrayBuffer(ctx, v, &offset, &t->len, NULL);
+
+    if (JS_IsException(buf)) {
+        return -1;
+    }
+    t->p = (const char *)JS_GetArrayBuffer(ctx, &size, buf);
+    JS_FreeValue(ctx, buf);
+    if (t->p == NULL) {
+        return -1;
+    }
+    t->p += offset;
+    return 0;
+}
+
+
+/*
+ *  Put rows start..start+count-1 out and lines in their place, as one
+ *  undo step and one bump of changed; lines with \n in them become
+ *  several rows. Nothing is drawn here, the next refresh redraws only
+ *  the screen lines whose rows changed. Returns the rows put in.
+ */
+static int c_set_lines(struct editor_config *E, int start, int count,
+        struct line_text *lines, int n)
+{
+    int changed = E->changed;
+    int at = start;
+
+    undo_seal(E);
+    undo_lines(E, UNDO_DELETE, start, start + count);
+    for (int i = 0; i < count; i++) {
+        editor_row_delete(E, start);
+    }
+
+    for (int i = 0; i < n; i++) {
+        const char *p   = lines[i].p;
+        const char *end = p + lines[i].len;
+
+        // a \r stays in its row unless it ends the line, like line_next
+        for (;;) {
+            const char *q = line_break(p, end, 1);
+            int len = q - p;
+
+            if (q < end && len > 0 && p[len - 1] == '\r') {
+                len--;
+            }
+            editor_row_insert(E, at++, p, len);
+            if (q == end) {
+                break;
+            }
+            p = q + 1;
+        }
+    }
+    undo_lines(E, UNDO_INSERT, start, at);
+    undo_seal(E);
+    E->changed = changed + 1;
+
+    cursor_clamp(E);
+    return at - start;
+}
+
+
+/*
+ *  terminal.set_lines(start, count, lines): lines is an array of
+ *  strings, ArrayBuffers or typed arrays, see c_set_lines.
+ */
+static JSValue js_set_lines(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    int start, count, n;
+
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+    if (JS_ToInt32(ctx, &start, argv[0])
+            || JS_ToInt32(ctx, &count, argv[1])) {
+        return JS_EXCEPTION;
+    }
+    if (start < 0 || start > s->numrows) {
+        return JS_ThrowRangeError(ctx, "set_lines: no line %d", start);
+    }
+    if (count < 0) {
+        count = 0;
+    }
+    if (count > s->numrows - start) {
+        count = s->numrows - start;
+    }
+
+    JSValue length = JS_GetPropertyStr(ctx, argv[2], "length");
+
+    if (JS_ToInt32(ctx, &n, length)) {
+        JS_FreeValue(ctx, length);
+        return JS_EXCEPTION;
+    }
+    JS_FreeValue(ctx, length);
+    if (n < 0) {
+        n = 0;
+    }
+
+    struct line_text *lines = calloc(n + 1, sizeof(*lines));
+    int got = 0;
+
+    if (lines == NULL) {
+        die("calloc");
+    }
+
+    // every line is read first, so a bad one leaves the rows untouched
+    for (; got < n; got++) {
+        JSValue v = JS_GetPropertyUint32(ctx, argv[2], got);
+        int r = line_text_get(ctx, v, &lines[got]);
+
+        JS_FreeValue(ctx, v);
+        if (r < 0) {
             break;
-        case 10:
-            {
-                if (s->filename) {
-                    v = JS_NewString(ctx, s->filename);
+        }
+    }
+
+    JSValue ret = JS_EXCEPTION;
+
+    if (got == n) {
+        ret = JS_NewInt32(ctx, c_set_lines(s, start, count, lines, n));
+    }
+    for (int i = 0; i < got; i++) {
+        if (lines[i].str) {
+            JS_FreeCString(ctx, lines[i].str);
+        }
+    }
+    free(lines);
+    return ret;
+}
+
+
+/*
+ *  Output
+ */
+JSValue editor_scroll (struct editor_config *s)
+{
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    erow *row = s->cy < s->numrows ? editor_row_at(s, s->cy) : NULL;
+    int width = 1;  // of the character under the cursor
+
+    s->rx = 0;
+    if (row) {
+        unsigned int cp;
+
+        s->rx = editor_convert_cx_to_rx(s, row, s->cx);
+        if (s->cx < row->size) {
+            erow_decode(row, s->cx, &cp);
+            width = cp == '\t' ? 1 : utf8_width(cp);
+        }
+    }
+
+    if (s->cy < s->row_offset) {
+        s->row_offset = s->cy;
+    }
+    if (s->cy >= s->row_offset + s->rows) {
+        s->row_offset = s->cy - s->rows + 1;
+    }
+    if (s->rx < s->col_offset) {
+        s->col_offset = s->rx;
+    }
+    if (s->rx + width > s->col_offset + s->cols) {
+        s->col_offset = s->rx + width - s->cols;
+    }
+
+    // the view starts after a wide character, not in the middle of it
+    if (row && s->col_offset > 0) {
+        unsigned int cp;
+        int start;
+        int at = editor_convert_rx_to_cx(s, row, s->col_offset, &start);
+
+        if (start < s->col_offset && at < row->size) {
+            erow_decode(row, at, &cp);
+            if (cp != '\t') {
+                s->col_offset = start + utf8_width(cp);
+            }
+        }
+    }
+    return JS_UNDEFINED;
+}
+
+
+/*
+ *  Tab expanded text of a row is kept only for what is on screen: the
+ *  columns col_offset..col_offset+cols-1, in a small cache keyed by the
+ *  row's stamp and the window. Each set of ways is evicted LRU first.
+ */
+#define RENDER_CACHE_SETS 64
+#define RENDER_CACHE_WAYS 4
+
+
+struct render_line {
+    unsigned long gen;  // 0 for an empty slot
+    unsigned long used;
+    int col_offset;
+    int cols;
+    int len;
+    int cap;
+    char *text;
+};
+
+
+static void render_cache_free(struct editor_config *E)
+{
+    if (E->render_cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < RENDER_CACHE_SETS * RENDER_CACHE_WAYS; i++) {
+        free(E->render_cache[i].text);
+    }
+    free(E->render_cache);
+
+    E->render_cache = NULL;
+    E->render_bytes = 0;
+}
+
+
+/*
+ *  Draw columns col_offset..col_offset+cols-1 of row into buf and
+ *  return its length. Tabs and wide characters cut by an edge become
+ *  spaces, malformed bytes U+FFFD, and the bytes of spans, when given,
+ *  are in reverse video. Every column takes at most 4 bytes of buf, 8
+ *  with spans, and 16 more are needed.
+ */
+static int editor_row_draw(struct editor_config *E, erow *row,
+        const int *spans, int n, char *buf, int cap)
+{
+    int from = E->col_offset;
+    int to = E->col_offset + E->cols;
+    int room = spans ? 8 : 4;
+    int col;
+    int at = editor_convert_rx_to_cx(E, row, from, &col);
+    int k = 0;
+    int inside = 0;
+    int shown = 0;
+    int glyph = 0;  // the last character was drawn, its marks can follow
+    int len = 0;
+
+    while (at < row->size && col < to) {
+        char tmp[4];
+        int avail;
+        const char *p = erow_bytes(row, at, &avail, tmp);
+
+        if (spans) {
+            while (k < n && spans[k * 2 + 1] <= at) {
+                k++;
+            }
+            inside = k < n && spans[k * 2] <= at;
+        }
+
+        int run = ascii_run(p, avail);
+
+        if (run > to - col) {
+            run = to - col;
+        }
+        if (k < n && run > spans[k * 2 + inside] - at) {
+            run = spans[k * 2 + inside] - at;
+        }
+
+        unsigned int cp = 0;
+        int bytes = run;
+        int w = run;
+
+        if (run == 0) {
+            bytes = utf8_decode((const unsigned char *) p, avail, &cp);
+            w = cp == '\t' ? WOE_TAB - col % WOE_TAB : utf8_width(cp);
+        }
+
+        // a mark is drawn with its character, or not at all
+        if (w == 0 && (!glyph
+                    || len + 4 + bytes + room * (to - col) + 3 > cap)) {
+            at += bytes;
+            continue;
+        }
+
+        if (inside != shown) {
+            memcpy(buf + len, inside ? "\x1b[7m" : "\x1b[m", inside ? 4 : 3);
+            len += inside ? 4 : 3;
+            shown = inside;
+        }
+
+        if (w > 0 && (cp == '\t' || col < from || col + w > to)) {
+            for (int x = col; x < col + w; x++) {
+                if (x >= from && x < to) {
+                    buf[len++] = ' ';
                 }
-                else {
-                    v = JS_NewString(ctx, "[No name]");
+            }
+            glyph = 0;
+        }
+        else if (cp == 0xfffd && bytes == 1) {
+            memcpy(buf + len, "\xef\xbf\xbd", 3);
+            len += 3;
+            glyph = 1;
+        }
+        else {
+            memcpy(buf + len, p, bytes);
+            len += bytes;
+            glyph |= w > 0;
+        }
+
+        at += bytes;
+        col += w;
+    }
+
+    if (shown) {
+        memcpy(buf + len, "\x1b[m", 3);
+        len += 3;
+    }
+    return len;
+}
+
+
+static char *editor_row_render(struct editor_config *E,
+        erow *row, int *len)
+{
+    if (E->render_cache == NULL) {
+        E->render_cache = calloc(RENDER_CACHE_SETS * RENDER_CACHE_WAYS,
+                sizeof(struct render_line));
+        if (E->render_cache == NULL) {
+            die("calloc");
+        }
+    }
+
+    struct render_line *set = &E->render_cache[
+        (row->gen % RENDER_CACHE_SETS) * RENDER_CACHE_WAYS];
+    struct render_line *line = &set[0];
+
+    for (int i = 0; i < RENDER_CACHE_WAYS; i++) {
+        if (set[i].gen == row->gen && set[i].col_offset == E->col_offset
+                && set[i].cols == E->cols) {
+            set[i].used = ++E->render_tick;
+            *len = set[i].len;
+            return set[i].text;
+        }
+        if (set[i].used < line->used) {
+            line = &set[i];
+        }
+    }
+
+    int cap = E->cols * 4 + 16;
+
+    if (line->cap < cap || line->text == NULL) {
+        free(line->text);
+        line->text = malloc(cap);
+        if (line->text == NULL) {
+            die("malloc");
+        }
+        E->render_bytes += cap - line->cap;
+        line->cap = cap;
+    }
+
+    int n = editor_row_draw(E, row, NULL, 0, line->text, cap);
+
+    line->gen        = row->gen;
+    line->used       = ++E->render_tick;
+    line->col_offset = E->col_offset;
+    line->cols       = E->cols;
+    line->len        = n;
+
+    *len = n;
+    return line->text;
+}
+
+
+/*
+ *  Where the highlighted pattern matches rows on screen, kept by row
+ *  stamp and pattern so redrawing does not scan them again. Every row
+ *  edit stamps the row anew, which is what drops its entry.
+ */
+#define MATCH_CACHE_LINES 256
+
+
+struct match_line {
+    unsigned long gen;
+    unsigned long serial;  // of the regex, 0 for an empty slot
+    int n;
+    int cap;  // pairs spans has room for
+    int *spans;
+};
+
+
+static void match_cache_free(struct editor_config *E)
+{
+    if (E->match_cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < MATCH_CACHE_LINES; i++) {
+        free(E->match_cache[i].spans);
+    }
+    free(E->match_cache);
+    E->match_cache = NULL;
+}
+
+
+/*
+ *  Non-empty matches of E->highlight in row, as start, end byte pairs.
+ */
+static int *editor_row_matches(struct editor_config *E, erow *row, int *n)
+{
+    struct regex *re = E->highlight;
+
+    if (E->match_cache == NULL) {
+        E->match_cache = calloc(MATCH_CACHE_LINES, sizeof(struct match_line));
+        if (E->match_cache == NULL) {
+            die("calloc");
+        }
+    }
+
+    struct match_line *line = &E->match_cache[row->gen % MATCH_CACHE_LINES];
+
+    if (line->gen == row->gen && line->serial == re->serial) {
+        *n = line->n;
+        return line->spans;
+    }
+
+    const char *text = search_row_text(row);
+    int count;
+
+    while ((count = regex_spans(re, text, row->size, 0,
+                    line->spans, line->cap)) == line->cap) {
+        line->cap = line->cap ? line->cap * 2 : 8;
+        line->spans = realloc(line->spans, line->cap * 2 * sizeof(int));
+        if (line->spans == NULL) {
+            die("realloc");
+        }
+    }
+
+    int kept = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (line->spans[i * 2] < line->spans[i * 2 + 1]) {
+            line->spans[kept * 2]     = line->spans[i * 2];
+            line->spans[kept * 2 + 1] = line->spans[i * 2 + 1];
+            kept++;
+        }
+    }
+
+    line->gen    = row->gen;
+    line->serial = re->serial;
+    line->n      = kept;
+
+    *n = kept;
+    return line->spans;
+}
+
+
+/*
+ *  Append what editor_row_render would give for row, with the bytes of
+ *  spans in reverse video. Only the spans are cached, not this.
+ */
+static void editor_row_render_matches(struct editor_config *E,
+        erow *row, const int *spans, int n, struct abuf *ab)
+{
+    int cap = E->cols * 8 + 16;
+    char *buf = malloc(cap);
+
+    if (buf == NULL) {
+        die("malloc");
+    }
+
+    int len = editor_row_draw(E, row, spans, n, buf, cap);
+
+    abuf_append(ab, buf, len);
+    free(buf);
+}
+
+
+/*
+ *  Append screen line y of the text area, without clearing the rest.
+ */
+void editor_draw_row(struct editor_config *s,
+        int y, struct abuf *ab)
+{
+    int file_row = y + s->row_offset;
+
+    if (file_row >= s->numrows) {
+        if (s->numrows == 0 && y == s->rows / 3) {
+            char welcome[80];
+            int welcome_len = snprintf(welcome, sizeof(welcome),
+                    "Woe -- version %s", WOE_VERSION);
+
+            if (welcome_len > s->cols) {
+                welcome_len = s->cols;
+            }
+
+            int padding = (s->cols - welcome_len) / 2;
+            if (padding) {
+                abuf_append(ab, "~", 1);
+                padding--;
+            }
+            while (padding--) {
+                abuf_append(ab, " ", 1);
+            }
+
+            abuf_append(ab, welcome, welcome_len);
+        }
+        else {
+            abuf_append(ab, "~", 1);
+        }
+    }
+    else {
+        erow *row = editor_row_at(s, file_row);
+        int n = 0;
+        int *spans = s->highlight ? editor_row_matches(s, row, &n) : NULL;
+
+        if (n > 0) {
+            editor_row_render_matches(s, row, spans, n, ab);
+        }
+        else {
+            int len;
+            char *render = editor_row_render(s, row, &len);
+
+            abuf_append(ab, render, len);
+        }
+    }
+}
+
+
+/*
+ *  The status bar can be drawn from a template set once, so a frame
+ *  needs no call into JS:
+ *
+ *      %f  file name       %l  lines
+ *      %x  column from 1   %X  bytes in the cursor's row
+ *      %y  line from 1     %m  "(modified)" when changed
+ *      %M  mode name       %%  a %
+ *      %=  spaces that fill the bar to the window width
+ *
+ *  A width, as in %20f, pads or cuts the field to that many columns.
+ */
+#define STATUS_MAX 1024
+
+
+static void status_clear(struct editor_config *E)
+{
+    free(E->status_format);
+    for (int i = 0; i < E->status_nmodes; i++) {
+        free(E->status_modes[i]);
+    }
+    free(E->status_modes);
+
+    E->status_format = NULL;
+    E->status_modes  = NULL;
+    E->status_nmodes = 0;
+}
+
+
+/*
+ *  Append len bytes of s, cut or padded to width columns when width is
+ *  not 0.
+ */
+static void status_put(char *buf, int *len, const char *s, int n, int width)
+{
+    int cols = 0;
+
+    if (width > 0) {
+        n = utf8_text_clip(s, n, width);
+        cols = utf8_text_width(s, n);
+    }
+    if (n > STATUS_MAX - 1 - *len) {
+        n = STATUS_MAX - 1 - *len;
+    }
+    memcpy(buf + *len, s, n);
+    *len += n;
+
+    while (cols < width && *len < STATUS_MAX - 1) {
+        buf[(*len)++] = ' ';
+        cols++;
+    }
+}
+
+
+/*
+ *  Fill buf, STATUS_MAX bytes, from the template and return its length,
+ *  never more than fits in the window.
+ */
+static int editor_status_format(struct editor_config *E, char *buf)
+{
+    erow *row = editor_row_at(E, E->cy);
+    const char *p = E->status_format;
+    int fill = -1;
+    int len = 0;
+
+    while (*p) {
+        char num[24];
+        const char *s = num;
+        int n = 0;
+        int width = 0;
+
+        if (*p != '%') {
+            const char *q = strchr(p, '%');
+
+            n = q ? q - p : (int) strlen(p);
+            status_put(buf, &len, p, n, 0);
+            p += n;
+            continue;
+        }
+
+        p++;
+        while (*p >= '0' && *p <= '9') {
+            width = width * 10 + (*p++ - '0');
+        }
+
+        switch (*p) {
+            case 'f':
+                s = E->filename ? E->filename : "";
+                n = strlen(s);
+                break;
+            case 'l':
+                n = snprintf(num, sizeof(num), "%d", E->numrows);
+                break;
+            case 'x':
+                n = snprintf(num, sizeof(num), "%d", E->cx + 1);
+                break;
+            case 'X':
+                n = snprintf(num, sizeof(num), "%d", row ? row->size : 0);
+                break;
+            case 'y':
+                n = snprintf(num, sizeof(num), "%d", E->cy + 1);
+                break;
+            case 'm':
+                s = E->changed ? "(modified)" : "";
+                n = strlen(s);
+                break;
+            case 'M':
+                if (E->mode >= 0 && E->mode < E->status_nmodes
+                        && E->status_modes[E->mode]) {
+                    s = E->status_modes[E->mode];
+                    n = strlen(s);
                 }
-            }
-            break;
+                break;
+            case '=':
+                fill = len;
+                break;
+            case '%':
+                s = "%";
+                n = 1;
+                break;
+            case '\0':
+                continue;
+        }
+        p++;
+
+        if (n > 0 || width > 0) {
+            status_put(buf, &len, s, n, width);
+        }
     }
-    return v;
+
+    int cols = utf8_text_width(buf, len);
+
+    if (fill >= 0 && cols < E->cols) {
+        int pad = E->cols - cols;
+
+        if (pad > STATUS_MAX - 1 - len) {
+            pad = STATUS_MAX - 1 - len;
+        }
+        memmove(buf + fill + pad, buf + fill, len - fill);
+        memset(buf + fill, ' ', pad);
+        len += pad;
+    }
+    return utf8_text_clip(buf, len, E->cols);
 }
 
 
-static JSValue js_editor_config_attr_set(JSContext *ctx,
+/*
+ *  terminal.status_format(template, names): draw the status bar from
+ *  template when refresh_woe_ui() is given no text, names[mode] is
+ *  what %M shows. null goes back to text from JS only.
+ */
+static JSValue js_status_format(JSContext *ctx,
         JSValueConst this_val,
-        JSValue val,
-        int magic)
+        int argc, JSValueConst *argv)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx,
-            this_val, js_vt100_class_id);
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    int n = 0;
 
-    int v;
     if (!s) {
         return JS_EXCEPTION;
     }
 
-    const char *str = NULL;
-    if (magic == 10) {
-        str = JS_ToCString(ctx, val);
+    status_clear(s);
+    if (argc < 1 || !JS_IsString(argv[0])) {
+        return JS_UNDEFINED;
     }
-    else {
-        if (JS_ToInt32(ctx, &v, val)) {
-            return JS_EXCEPTION;
+
+    const char *str = JS_ToCString(ctx, argv[0]);
+
+    if (str == NULL) {
+        return JS_EXCEPTION;
+    }
+    s->status_format = strdup(str);
+    JS_FreeCString(ctx, str);
+
+    if (argc > 1 && JS_IsArray(ctx, argv[1])) {
+        JSValue length = JS_GetPropertyStr(ctx, argv[1], "length");
+
+        JS_ToInt32(ctx, &n, length);
+        JS_FreeValue(ctx, length);
+    }
+    if (n > 0) {
+        s->status_modes = calloc(n, sizeof(char *));
+        if (s->status_modes == NULL) {
+            die("calloc");
         }
+        s->status_nmodes = n;
     }
 
-    switch (magic) {
-        case 0:
-            s->cx = v;
-            break;
-        case 1:
-            s->cy = v;
-            break;
-        case 2:
-            s->rx = v;
-            break;
-        case 3:
-            s->rows = v;
-            break;
-        case 4:
-            s->cols = v;
-            break;
-        case 5:
-            s->row_offset = v;
-            break;
-        case 6:
-            s->col_offset = v;
-            break;
-        case 7: // variable changed can not modified by user.
-            break;
-        case 8:
-            s->numrows = v;
-            break;
-        case 9:
-            s->number_command = v;
-            break;
-        case 10:
-            free(s->filename);
-            s->filename = strdup(str);
+    for (int i = 0; i < n; i++) {
+        JSValue v = JS_GetPropertyUint32(ctx, argv[1], i);
+
+        if (JS_IsString(v)) {
+            str = JS_ToCString(ctx, v);
+            s->status_modes[i] = strdup(str);
             JS_FreeCString(ctx, str);
-            break;
+        }
+        JS_FreeValue(ctx, v);
     }
     return JS_UNDEFINED;
 }
 
 
-static JSValue js_erow_check_size(JSContext *ctx,
+/*
+ *  terminal.snapshot(obj): the editor state in one call, written into
+ *  obj when given so a frame can reuse it.
+ */
+static JSValue js_snapshot(JSContext *ctx,
         JSValueConst this_val,
         int argc, JSValueConst *argv)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx,
-            this_val, js_vt100_class_id);
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+
     if (!s) {
         return JS_EXCEPTION;
     }
 
-    if (&s->row_obj[s->cy]) {
-        if (s->row_obj[s->cy].size >= 1) {
-            return JS_TRUE;
-        }
-    }
-    return JS_FALSE;
+    JSValue obj = argc > 0 && JS_IsObject(argv[0])
+        ? JS_DupValue(ctx, argv[0]) : JS_NewObject(ctx);
+    erow *row = editor_row_at(s, s->cy);
+
+    JS_SetPropertyStr(ctx, obj, "cx", JS_NewInt32(ctx, s->cx));
+    JS_SetPropertyStr(ctx, obj, "cy", JS_NewInt32(ctx, s->cy));
+    JS_SetPropertyStr(ctx, obj, "rx", JS_NewInt32(ctx, s->rx));
+    JS_SetPropertyStr(ctx, obj, "rows", JS_NewInt32(ctx, s->rows));
+    JS_SetPropertyStr(ctx, obj, "cols", JS_NewInt32(ctx, s->cols));
+    JS_SetPropertyStr(ctx, obj, "row_offset", JS_NewInt32(ctx, s->row_offset));
+    JS_SetPropertyStr(ctx, obj, "col_offset", JS_NewInt32(ctx, s->col_offset));
+    JS_SetPropertyStr(ctx, obj, "numrows", JS_NewInt32(ctx, s->numrows));
+    JS_SetPropertyStr(ctx, obj, "mode", JS_NewInt32(ctx, s->mode));
+    JS_SetPropertyStr(ctx, obj, "number_command",
+            JS_NewInt32(ctx, s->number_command));
+    JS_SetPropertyStr(ctx, obj, "changed", JS_NewInt32(ctx, s->changed));
+    JS_SetPropertyStr(ctx, obj, "has_row", JS_NewBool(ctx, row != NULL));
+    JS_SetPropertyStr(ctx, obj, "row_size",
+            JS_NewInt32(ctx, row ? row->size : 0));
+    JS_SetPropertyStr(ctx, obj, "filename",
+            JS_NewString(ctx, s->filename ? s->filename : ""));
+    return obj;
 }
 
 
-static JSValue js_check_row_object(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+void editor_draw_status_bar(struct editor_config *s,
+        struct abuf *ab, const char *str)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx,
-            this_val, js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
+    abuf_append(ab, "\x1b[7m", 4); // turn reverse video on;
+    if (str) {
+        abuf_append(ab, str, strlen(str));
     }
+    else if (s->status_format) {
+        char buf[STATUS_MAX];
 
-    if (s->row_obj) {
-        return JS_TRUE;
+        abuf_append(ab, buf, editor_status_format(s, buf));
     }
-    return JS_FALSE;
+    abuf_append(ab, "\x1b[m", 3);
 }
 
-
-static JSValue js_erow_get_size(JSContext *ctx,
-        JSValueConst this_val,
-        int argc, JSValueConst *argv)
+void editor_draw_message_bar(struct editor_config *s,
+        struct abuf *ab)
 {
-    struct editor_config *s = JS_GetOpaque2(ctx,
-            this_val, js_vt100_class_id);
-    if (!s) {
-        return JS_EXCEPTION;
-    }
-    JSValue v;
-    int index;
-    JS_ToInt32(ctx, &index, argv[0]);
+    int msg_len = utf8_text_clip(s->status_msg, strlen(s->status_msg),
+            s->cols);
 
-    if (s->row_obj) {
-        v = JS_NewInt32(ctx, s->row_obj[index].size);
+    if (msg_len && time(NULL) - s->status_msg_time < WOE_MSG_TIME) {
+        abuf_append(ab, s->status_msg, msg_len);
     }
-    return v;
 }
 
 
 /*
- *  Output
+ *  The screen as last written is kept as one hash per line. A refresh
+ *  draws every line but only sends the ones whose hash changed, and a
+ *  frame where nothing changed but the cursor is a single cursor move.
  */
-JSValue editor_scroll (struct editor_config *s)
+static void frame_invalidate(struct editor_config *E)
 {
-    if (!s) {
-        return JS_EXCEPTION;
-    }
+    E->frame_rows = -1;
+}
 
-    s->rx = 0;
-    if (s->cy < s->numrows) {
-        s->rx = editor_convert_cx_to_rx(&(s->row_obj[s->cy]), s->cx);
-    }
 
-    if (s->cy < s->row_offset) {
-        s->row_offset = s->cy;
-    }
-    if (s->cy >= s->row_offset + s->rows) {
-        s->row_offset = s->cy - s->rows + 1;
-    }
-    if (s->rx < s->col_offset) {
-        s->col_offset = s->rx;
-    }
-    if (s->rx >= s->col_offset + s->cols) {
-        s->col_offset = s->rx - s->cols + 1;
+static unsigned long frame_hash(const char *s, int len)
+{
+    unsigned long h = 14695981039346656037UL;
+
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211UL;
     }
-    return JS_UNDEFINED;
+    return h;
 }
 
 
-void editor_draw_rows(struct editor_config *s,
-        struct abuf *ab)
+/*
+ *  When text moved up or down, after scrolling or inserting or deleting
+ *  lines, shift what the terminal already shows inside a scroll region
+ *  (DECSTBM, then SU or SD) instead of redrawing it. Every shift of the
+ *  lines from the first changed one to the bottom of the text area is
+ *  tried, and the one saving the most bytes wins.
+ */
+static void frame_scroll(struct editor_config *E, unsigned long *hash,
+        struct abuf *drawn, struct abuf *ab)
 {
-    int y;
+    int rows = E->rows;
+    int top = 0;
 
-    for (y = 0; y < s->rows; y++) {
-        int file_row = y + s->row_offset;
+    while (top < rows && E->frame[top] == hash[top]) {
+        top++;
+    }
+    if (top >= rows - 1) {
+        return;
+    }
 
-        if (file_row >= s->numrows) {
-            if (s->numrows == 0 && y == s->rows / 3) {
-                char welcome[80];
-                int welcome_len = snprintf(welcome, sizeof(welcome),
-                        "Woe -- version %s", WOE_VERSION);
+    int best = 0;
+    int best_gain = 24;  // about what the escape sequences cost
 
-                if (welcome_len > s->cols) {
-                    welcome_len = s->cols;
-                }
+    for (int shift = top - rows + 1; shift < rows - top; shift++) {
+        int gain = 0;
 
-                int padding = (s->cols - welcome_len) / 2;
-                if (padding) {
-                    abuf_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) {
-                    abuf_append(ab, " ", 1);
-                }
+        for (int y = top; y < rows && shift != 0; y++) {
+            int from = y + shift;
 
-                abuf_append(ab, welcome, welcome_len);
-            }
-            else {
-                abuf_append(ab, "~", 1);
+            if (from < top || from >= rows) {
+                continue;
             }
-        }
-        else {
-            int len = s->row_obj[file_row].rsize - s->col_offset;
 
-            if (len < 0) {
-                len = 0;
+            // a line costs its text plus the cursor move and clear
+            if (E->frame[from] == hash[y] && E->frame[y] != hash[y]) {
+                gain += drawn[y].len + 10;
             }
-            if (len > s->cols) {
-                len = s->cols;
+            else if (E->frame[from] != hash[y] && E->frame[y] == hash[y]) {
+                gain -= drawn[y].len + 10;
             }
-            abuf_append(ab,
-                    &s->row_obj[file_row].render[s->col_offset],
-                    len);
         }
 
-        abuf_append(ab, "\x1b[K", 3);
-        abuf_append(ab, "\r\n", 2);
+        if (gain > best_gain) {
+            best = shift;
+            best_gain = gain;
+        }
+    }
+
+    if (best == 0) {
+        return;
     }
-}
 
+    char buf[48];
 
-void editor_draw_status_bar(struct editor_config *s,
-        struct abuf *ab, const char *str)
-{
-    abuf_append(ab, "\x1b[7m", 4); // turn reverse video on;
-    abuf_append(ab, str, strlen(str));
-    abuf_append(ab, "\x1b[m", 3);
-    abuf_append(ab, "\r\n", 2);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c\x1b[r",
+            top + 1, rows, abs(best), best > 0 ? 'S' : 'T');
+    abuf_append(ab, buf, strlen(buf));
+
+    // the shadow moves the same way, lines scrolled in are blank
+    unsigned long blank = frame_hash("", 0);
+
+    if (best > 0) {
+        for (int y = top; y < rows; y++) {
+            E->frame[y] = y + best < rows ? E->frame[y + best] : blank;
+        }
+    }
+    else {
+        for (int y = rows - 1; y >= top; y--) {
+            E->frame[y] = y + best >= top ? E->frame[y + best] : blank;
+        }
+    }
 }
 
-void editor_draw_message_bar(struct editor_config *s,
-        struct abuf *ab)
+
+/*
+ *  Write what is left of the last frame, return how many bytes the
+ *  terminal still has not taken.
+ */
+static int frame_flush(struct editor_config *E)
 {
-    abuf_append(ab, "\x1b[K", 3);
-    int msg_len = strlen(s->status_msg);
+    while (E->out_sent < E->out_len) {
+        int n = write(STDOUT_FILENO, E->out + E->out_sent,
+                E->out_len - E->out_sent);
 
-    if (msg_len > s->cols) {
-        msg_len = s->cols;
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return E->out_len - E->out_sent;
+        }
+        E->out_sent += n;
     }
 
-    if (msg_len && time(NULL) - s->status_msg_time < 5) {
-        abuf_append(ab, s->status_msg, msg_len);
+    free(E->out);
+    E->out = NULL;
+    E->out_len = 0;
+    E->out_sent = 0;
+    return 0;
+}
+
+
+/*
+ *  Queue s behind what is left of the last frame, so it never lands in
+ *  the middle of it, and write what the terminal takes.
+ */
+static void frame_send(struct editor_config *E, const char *s, int len)
+{
+    char *out = realloc(E->out, E->out_len + len);
+
+    if (out == NULL) {
+        die("realloc");
     }
+    memcpy(out + E->out_len, s, len);
+    E->out = out;
+    E->out_len += len;
+    frame_flush(E);
 }
 
 
@@ -1650,24 +11937,101 @@ static void editor_refresh_screen(struct editor_config *E,
 {
     struct abuf ab = ABUF_INIT;
 
+    /*
+     *  The terminal is behind: skip this frame, the next one is drawn
+     *  against the shadow of what is queued and catches up at once.
+     */
+    if (frame_flush(E) > 0) {
+        E->frames_dropped++;
+        E->frame_bytes = 0;
+        return;
+    }
+
+    int lines = E->rows + 2;  // text, status bar, message bar
+    int full = 0;
+    char buf[32];
+
+    if (E->frame_rows != E->rows || E->frame_cols != E->cols) {
+        unsigned long *frame = realloc(E->frame, sizeof(*frame) * lines);
+
+        if (frame == NULL) {
+            die("realloc");
+        }
+        E->frame = frame;
+        E->frame_rows = E->rows;
+        E->frame_cols = E->cols;
+        full = 1;
+    }
+
+    struct abuf *drawn = calloc(lines, sizeof(struct abuf));
+    unsigned long *hash = malloc(sizeof(*hash) * lines);
+
+    if (drawn == NULL || hash == NULL) {
+        die("malloc");
+    }
+
+    for (int y = 0; y < lines; y++) {
+        if (y < E->rows) {
+            editor_draw_row(E, y, &drawn[y]);
+        }
+        else if (y == E->rows) {
+            editor_draw_status_bar(E, &drawn[y], str);
+        }
+        else {
+            editor_draw_message_bar(E, &drawn[y]);
+        }
+        hash[y] = frame_hash(drawn[y].b, drawn[y].len);
+    }
+
+    // the cursor is hidden while lines are redrawn
     abuf_append(&ab, "\x1b[?25l", 6);
-    abuf_append(&ab, "\x1b[H", 3);
 
-    editor_draw_rows(E, &ab);
-    editor_draw_status_bar(E, &ab, str);
-    editor_draw_message_bar(E, &ab);
+    if (!full) {
+        frame_scroll(E, hash, drawn, &ab);
+    }
 
-    char buf[32];
+    for (int y = 0; y < lines; y++) {
+        if (full || E->frame[y] != hash[y]) {
+            E->frame[y] = hash[y];
 
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-            (E->cy - E->row_offset) + 1,
-            (E->rx - E->col_offset) + 1);
-    abuf_append(&ab, buf, strlen(buf));
+            snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+            abuf_append(&ab, buf, strlen(buf));
+            if (drawn[y].len > 0) {
+                abuf_append(&ab, drawn[y].b, drawn[y].len);
+            }
+            abuf_append(&ab, "\x1b[K", 3);
+        }
+        abuf_free(&drawn[y]);
+    }
+    free(drawn);
+    free(hash);
+
+    int x = (E->rx - E->col_offset) + 1;
+    int y = (E->cy - E->row_offset) + 1;
+    int hidden = ab.len > 6;
+    int start = hidden ? 0 : 6;
+
+    if (hidden || x != E->frame_x || y != E->frame_y) {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y, x);
+        abuf_append(&ab, buf, strlen(buf));
+        E->frame_x = x;
+        E->frame_y = y;
+    }
+    if (hidden) {
+        abuf_append(&ab, "\x1b[?25h", 6);
+    }
 
-    abuf_append(&ab, "\x1b[?25h", 6);
+    E->frame_bytes = ab.len - start;
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abuf_free(&ab);
+    if (ab.len > start) {
+        memmove(ab.b, ab.b + start, ab.len - start);
+        E->out = ab.b;
+        E->out_len = ab.len - start;
+        frame_flush(E);
+    }
+    else {
+        abuf_free(&ab);
+    }
 }
 
 
@@ -1679,10 +12043,38 @@ static JSValue js_editor_refresh_screen(
 
     JSValue v = editor_scroll(s);
 
-    const char *str = JS_ToCString(ctx, argv[0]);
+    // no text: the status bar comes from status_format
+    const char *str = NULL;
+
+    if (argc > 0 && !JS_IsUndefined(argv[0])) {
+        str = JS_ToCString(ctx, argv[0]);
+    }
     editor_refresh_screen(s, str);
-    JS_FreeCString(ctx, str);
-    return v;
+    if (str) {
+        JS_FreeCString(ctx, str);
+    }
+
+    if (JS_IsException(v)) {
+        return v;
+    }
+    return JS_NewInt32(ctx, s->out_len - s->out_sent);
+}
+
+
+/*
+ *  Push out the rest of a frame once stdout is writable again, return
+ *  the bytes still pending.
+ */
+static JSValue js_flush_output(JSContext *ctx,
+        JSValueConst this_val,
+        int argc, JSValueConst *argv)
+{
+    struct editor_config *s = JS_GetOpaque2(ctx, this_val, js_vt100_class_id);
+    if (!s) {
+        return JS_EXCEPTION;
+    }
+
+    return JS_NewInt32(ctx, frame_flush(s));
 }
 
 
@@ -1723,15 +12115,68 @@ static const JSCFunctionListEntry js_vt100_proto_funcs[] = {
     JS_CGETSET_MAGIC_DEF("filename",
             js_editor_config_attr_get,
             js_editor_config_attr_set, 10),
+    JS_CGETSET_MAGIC_DEF("render_saved",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 11),
+    JS_CGETSET_MAGIC_DEF("frame_bytes",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 12),
+    JS_CGETSET_MAGIC_DEF("frames_dropped",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 13),
+    JS_CGETSET_MAGIC_DEF("undo_limit",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 14),
+    JS_CGETSET_MAGIC_DEF("undo_bytes",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 15),
+    JS_CGETSET_MAGIC_DEF("buffer_budget",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 16),
+    JS_CGETSET_MAGIC_DEF("follow",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 17),
+    JS_CGETSET_MAGIC_DEF("follow_limit",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 18),
+    JS_CGETSET_MAGIC_DEF("save_fsync",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 19),
+    JS_CGETSET_MAGIC_DEF("autosave",
+            js_editor_config_attr_get,
+            js_editor_config_attr_set, 20),
 
     JS_CFUNC_DEF("enable_rawmode", 0, js_enable_rawmode),
     JS_CFUNC_DEF("disable_rawmode", 0, js_disable_rawmode),
     JS_CFUNC_DEF("next_key", 0, js_editor_read_key),
+    JS_CFUNC_DEF("key_pending", 0, js_key_pending),
+    JS_CFUNC_DEF("skip_repeats", 1, js_skip_repeats),
+    JS_CFUNC_DEF("status_timeout", 0, js_status_timeout),
+    JS_CFUNC_DEF("update_window_size", 0, js_update_window_size),
     JS_CFUNC_DEF("refresh_woe_ui", 1, js_editor_refresh_screen),
+    JS_CFUNC_DEF("status_format", 2, js_status_format),
+    JS_CFUNC_DEF("snapshot", 1, js_snapshot),
+    JS_CFUNC_DEF("flush_output", 0, js_flush_output),
 
     JS_CFUNC_DEF("file_open", 1, js_file_open),
     JS_CFUNC_DEF("file_close", 0, js_file_close),
     JS_CFUNC_DEF("file_save", 0, js_file_save),
+    JS_CFUNC_DEF("buffer_open", 1, js_buffer_open),
+    JS_CFUNC_DEF("buffer_switch", 1, js_buffer_switch),
+    JS_CFUNC_DEF("buffers", 0, js_buffers),
+    JS_CFUNC_DEF("file_exists", 1, js_file_exists),
+    JS_CFUNC_DEF("file_find", 1, js_file_find),
+    JS_CFUNC_DEF("file_complete", 2, js_file_complete),
+    JS_CFUNC_DEF("file_index_idle", 0, js_file_index_idle),
+    JS_CFUNC_DEF("watch_fd", 0, js_watch_fd),
+    JS_CFUNC_DEF("check_files", 0, js_check_files),
+    JS_CFUNC_DEF("save_fd", 0, js_save_fd),
+    JS_CFUNC_DEF("check_save", 0, js_check_save),
+    JS_CFUNC_DEF("save_wait", 0, js_save_wait),
+    JS_CFUNC_DEF("autosave_tick", 0, js_autosave_tick),
+    JS_CFUNC_DEF("journal_found", 0, js_journal_found),
+    JS_CFUNC_DEF("journal_replay", 0, js_journal_replay),
+    JS_CFUNC_DEF("journal_discard", 0, js_journal_discard),
 
     JS_CFUNC_DEF("clean_screen", 0, js_clean_screen),
     JS_CFUNC_DEF("move_cursur_home", 0, js_move_cursur_home),
@@ -1749,13 +12194,29 @@ static const JSCFunctionListEntry js_vt100_proto_funcs[] = {
     JS_CFUNC_DEF("delete_char", 0, js_delete_char),
     JS_CFUNC_DEF("insert_newline", 0, js_insert_newline),
     JS_CFUNC_DEF("insert_char", 1, js_insert_char),
+    JS_CFUNC_DEF("insert_paste", 0, js_insert_paste),
     JS_CFUNC_DEF("row_insert", 3, js_editor_row_insert),
+    JS_CFUNC_DEF("get_lines", 3, js_get_lines),
+    JS_CFUNC_DEF("set_lines", 3, js_set_lines),
+    JS_CFUNC_DEF("undo", 0, js_undo),
+    JS_CFUNC_DEF("redo", 0, js_redo),
+    JS_CFUNC_DEF("undo_seal", 0, js_undo_seal),
+
+    JS_CFUNC_DEF("bind", 3, js_bind),
+    JS_CFUNC_DEF("dispatch", 2, js_dispatch),
+    JS_CFUNC_DEF("key_stats", 1, js_key_stats),
 
     JS_CFUNC_DEF("get_erow_size_at", 1, js_erow_get_size),
     JS_CFUNC_DEF("check_erow_size", 0, js_erow_check_size),
     JS_CFUNC_DEF("check_row_object", 0, js_check_row_object),
 
-    JS_CFUNC_DEF("prompt", 1, js_editor_prompt),
+    JS_CFUNC_DEF("prompt", 2, js_editor_prompt),
+    JS_CFUNC_DEF("search", 1, js_search),
+    JS_CFUNC_DEF("search_next", 0, js_search_next),
+    JS_CFUNC_DEF("search_previous", 0, js_search_previous),
+    JS_CFUNC_DEF("search_prompt", 0, js_search_prompt),
+    JS_CFUNC_DEF("regex", 1, js_regex_new),
+    JS_CFUNC_DEF("replace_all", 2, js_replace_all),
     JS_CFUNC_DEF("echo_status_message", 0, js_echo_status_message),
 };
 
@@ -1785,12 +12246,63 @@ static JSValue js_vt100_ctor(JSContext *ctx,
     s->number_command  = 0;
     s->row_offset      = 0;
     s->col_offset      = 0;
-    s->row_obj         = NULL;
+    s->lines           = NULL;
+    s->add             = NULL;
+    s->add_cap         = 0;
+    s->render_cache    = NULL;
+    s->render_tick     = 0;
+    s->render_bytes    = 0;
+    s->frame           = NULL;
+    s->frame_rows      = -1;
+    s->frame_cols      = 0;
+    s->frame_x         = 0;
+    s->frame_y         = 0;
+    s->frame_bytes     = 0;
+    s->frames_dropped  = 0;
+    s->search          = NULL;
+    s->search_len      = 0;
+    s->search_y        = -1;
+    s->search_x        = -1;
+    s->highlight       = NULL;
+    s->match_cache     = NULL;
+    s->width_cache     = NULL;
+    s->status_format   = NULL;
+    s->status_modes    = NULL;
+    s->status_nmodes   = 0;
+    s->keymap          = NULL;
+    s->keymap_cap      = 0;
+    s->keymap_used     = 0;
+    s->undo            = NULL;
+    s->undo_limit      = UNDO_LIMIT;
+    s->buffers         = NULL;
+    s->nbuffers        = 0;
+    s->buffer_cap      = 0;
+    s->buffer          = 0;
+    s->buffer_tick     = 0;
+    s->buffer_budget   = BUFFER_BUDGET;
+    s->out             = NULL;
+    s->out_len         = 0;
+    s->out_sent        = 0;
+    s->mapped          = 0;
     s->changed         = 0;
     s->filename        = NULL;
+    s->watch_fd        = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    s->follow          = 0;
+    s->follow_limit    = 0;
+    s->follow_dropped  = 0;
+    s->save_fsync      = 1;
+    s->save            = NULL;
+    s->save_again      = 0;
+    s->save_fd         = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    s->autosave        = 0;
+    s->swap_changed    = 0;
+    s->swap_time       = 0;
+    s->journal         = NULL;
+    s->journal_found   = 0;
     s->status_msg[0]   = '\0';
     s->status_msg_time = 0;
     s->mode            = default_mode;
+    memset(&s->disk, 0, sizeof(s->disk));
 
     if (get_window_size(&(s->rows), &(s->cols)) == -1) {
         die("get_window_size");
@@ -1817,7 +12329,7 @@ fail:
 
 static int js_vt100_init(JSContext *ctx, JSModuleDef *m)
 {
-    JSValue vt100_proto, vt100_class;
+    JSValue vt100_proto, vt100_class, regex_proto;
 
     JS_NewClassID(&js_vt100_class_id);
     JS_NewClass(JS_GetRuntime(ctx), js_vt100_class_id, &js_vt100_class);
@@ -1830,7 +12342,16 @@ static int js_vt100_init(JSContext *ctx, JSModuleDef *m)
     JS_SetConstructor(ctx, vt100_class, vt100_proto);
     JS_SetClassProto(ctx, js_vt100_class_id, vt100_proto);
 
+    JS_NewClassID(&js_regex_class_id);
+    JS_NewClass(JS_GetRuntime(ctx), js_regex_class_id, &js_regex_class);
+
+    regex_proto = JS_NewObject(ctx);
+    JS_SetPropertyFunctionList(ctx, regex_proto, js_regex_proto_funcs, countof(js_regex_proto_funcs));
+    JS_SetClassProto(ctx, js_regex_class_id, regex_proto);
+
     JS_SetModuleExport(ctx, m, "VT100", vt100_class);
+    JS_SetModuleExport(ctx, m, "display_width",
+            JS_NewCFunction(ctx, js_display_width, "display_width", 1));
     return 0;
 }
 
@@ -1843,5 +12364,6 @@ JSModuleDef *js_init_module(JSContext *ctx, const char *module_name)
         return NULL;
     }
     JS_AddModuleExport(ctx, m, "VT100");
+    JS_AddModuleExport(ctx, m, "display_width");
     return m;
 }
@@ -2,8 +2,10 @@
 #define WOE_H
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -12,9 +14,21 @@
 #include <time.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
 
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /*
@@ -8,24 +8,21 @@ export function JSMode() {
 JSMode.prototype.enable = function (terminal, file_storage, argv) {
     terminal.mode = argv.mode.NORMAL;
 
-    if (file_storage.close(terminal, argv.KeyPress('c'))) {
-        let v = this.conf;
+    let v = this.conf;
 
-        let exists = file_storage.find(x => x == v);
+    let exists = file_storage.find(x => x == v);
 
-        if (!exists) {
-            file_storage.push(v);
-        }
-
-        let find_file = std.popen(`find . -name ${v}`, 'r');
+    if (!exists) {
+        file_storage.push(v);
+    }
 
-        if (find_file.getline()) {
-            terminal.file_open(v);
-        }
-        else {
-            terminal.filename = v;
-            terminal.file_save();
-        }
+    if (terminal.file_exists(v)) {
+        terminal.buffer_open(v);
+    }
+    else {
+        terminal.buffer_open(null);
+        terminal.filename = v;
+        terminal.file_save();
     }
     argv.menu.main();
     return argv.editor_mode_normal;
@@ -36,6 +33,7 @@ JSMode.prototype.eval = function (terminal, file_storage, argv) {
     terminal.mode = argv.mode.NORMAL;
 
     terminal.file_save();
+    terminal.save_wait();
 
     let file = std.open(this.conf, 'r');
     try {
@@ -1,12 +1,12 @@
 import * as os from "os";
 import * as std from "std";
 
-import { VT100 } from "./vt100.so";
+import { VT100, display_width } from "./vt100.so";
 import { FileStorage } from 'file_storage.js';
 import { Menu } from 'woe_menu.js';
 
 
-let HELP_MESSAGE = "Help: <leader>q = quit; <leader>h = help; <leader>m = open menu";
+let HELP_MESSAGE = "Help: <leader>q = quit; <leader>h = help; <leader>m = open menu; <leader>r = replace";
 
 
 function CTRL_(key) {
@@ -29,6 +29,7 @@ let special_key = {
     END:       1006,
     PAGE_UP:   1007,
     PAGE_DOWN: 1008,
+    PASTE:     1009,
     properties: {
         127:  {name: "backspace", value: 127},
         1000: {name: "left", value: 1000},
@@ -40,6 +41,7 @@ let special_key = {
         1006: {name: "end", value: 1006},
         1007: {name: "page_up", value: 1007},
         1008: {name: "page_down", value: 1008},
+        1009: {name: "paste", value: 1009},
     }
 };
 
@@ -62,19 +64,6 @@ let mode = {
 
 function vim_to_arrow(key) {
     switch (key) {
-        case KeyPress('h'):
-            return special_key.LEFT;
-            break;
-        case KeyPress('l'):
-            return special_key.RIGHT;
-            break;
-        case KeyPress('k'):
-            return special_key.UP;
-            break;
-        case KeyPress('j'):
-            return special_key.DOWN;
-            break;
-
         case KeyPress('K'):
             return special_key.PAGE_DOWN;
             break;
@@ -85,11 +74,6 @@ function vim_to_arrow(key) {
             return special_key.PAGE_UP;
         case KeyPress('L'):
             return special_key.PAGE_DOWN;
-
-        case KeyPress('^'):
-            return special_key.HOME;
-        case KeyPress('$'):
-            return special_key.END;
     }
     return key;
 }
@@ -126,13 +110,13 @@ function editor_move_cursor(terminal, key) {
 }
 
 
+/*
+ *  Keys bind_keys binds in normal mode are dispatched natively and
+ *  never reach here.
+ */
 function editor_mode_normal(terminal, key) {
     let next_function = editor_mode_normal;
 
-    if (editor_mode_special_move(terminal, key)) {
-        return [true, next_function];
-    }
-
     switch (key) {
         case KeyPress(' '):
             terminal.mode = mode.COMMAND;
@@ -187,16 +171,6 @@ function editor_mode_normal(terminal, key) {
             return editor_mode_number_command(terminal, key);
             break;
 
-        case KeyPress('h'):
-        case KeyPress('l'):
-        case KeyPress('k'):
-        case KeyPress('j'):
-            {
-                let v = vim_to_arrow(key);
-                editor_move_cursor(terminal, v);
-            }
-            break;
-
         case KeyPress('K'):
         case KeyPress('J'):
             {
@@ -233,23 +207,6 @@ function editor_mode_normal(terminal, key) {
             }
             break;
 
-        case KeyPress('^'):
-            terminal.move_to_line_of_start();
-            break;
-        case KeyPress('$'):
-            terminal.move_to_line_of_end();
-            break;
-
-        case KeyPress('x'):
-            terminal.move_cursur_right();
-            terminal.delete_char();
-            terminal.fix_position();
-            break;
-        case KeyPress('X'):
-            terminal.delete_char();
-            terminal.fix_position();
-            break;
-
         case KeyPress('g'):
             next_function = function(terminal, key) {
                 let run_forever = true;
@@ -263,17 +220,35 @@ function editor_mode_normal(terminal, key) {
                 return [run_forever, next_function];
             };
             break;
-        case KeyPress('G'):
-            terminal.move_to_line(terminal.numrows);
+        case KeyPress('/'):
+            use_regex = false;
+            terminal.search_prompt();
+            break;
+        case KeyPress('?'):
+            // one compiled search object, kept for n and p
+            if (regex_search === null) {
+                regex_search = terminal.regex();
+                regex_search.highlight(true);
+            }
+            use_regex = true;
+            regex_search.prompt();
             break;
-            /*
-        case 'n':
-            terminal.search_next();
+        case KeyPress('n'):
+            if (use_regex) {
+                regex_search.next();
+            }
+            else {
+                terminal.search_next();
+            }
             break;
-        case 'p':
-            terminal.search_previous();
+        case KeyPress('p'):
+            if (use_regex) {
+                regex_search.previous();
+            }
+            else {
+                terminal.search_previous();
+            }
             break;
-            */
     }
     return [true, next_function];
 }
@@ -287,7 +262,7 @@ function editor_mode_command(terminal, key) {
 
     switch (key) {
         case KeyPress('q'):
-            if (terminal.changed) {
+            if (terminal.buffers().some(b => b.changed) || terminal.changed) {
                 terminal.echo_status_message("Use <leader>Q force leave");
             }
             else {
@@ -307,6 +282,26 @@ function editor_mode_command(terminal, key) {
             terminal.echo_status_message(HELP_MESSAGE);
             break;
 
+        case KeyPress('r'): {
+            let pattern = terminal.prompt("Replace: %s");
+            if (pattern === undefined) {
+                break;
+            }
+
+            let with_text = terminal.prompt("With: %s");
+            if (with_text === undefined) {
+                break;
+            }
+
+            try {
+                terminal.replace_all(terminal.regex(pattern), with_text);
+            }
+            catch (e) {
+                terminal.echo_status_message(e.message);
+            }
+            break;
+        }
+
         case KeyPress('m'):
             terminal.mode = mode.MENU;
             next_function = editor_mode_menu;
@@ -407,6 +402,9 @@ function editor_mode_special_move(terminal, key) {
         case special_key.PAGE_DOWN:
             terminal.page_down();
             break;
+        case special_key.PASTE:
+            terminal.insert_paste();
+            break;
         case special_key.HOME:
             terminal.move_to_line_of_start();
             break;
@@ -439,6 +437,7 @@ function editor_mode_insert(terminal, key) {
             break;
         case CTRL_('c'):
             terminal.mode = mode.NORMAL;
+            terminal.undo_seal();
             if (terminal.cx <= 0) {
                 terminal.cx = 0;
             }
@@ -451,6 +450,7 @@ function editor_mode_insert(terminal, key) {
         case CTRL_('l'):
         case KeyPress('\x1b'):
             terminal.mode = mode.NORMAL;
+            terminal.undo_seal();
             if (terminal.cx <= 0) {
                 terminal.cx = 0;
             }
@@ -547,85 +547,302 @@ function Counter() {
     this.sum = 0;
 }
 
+// columns str takes on the terminal, wide characters count twice
 Counter.prototype.length = function (str) {
-    this.sum = 0;
-    for (let i = 0; i < str.length; i++) {
-        if (str.charCodeAt(i) > 128) {
-            this.sum += 2;
-        }
-        else {
-            this.sum += 1;
-        }
-    }
+    this.sum = display_width(str);
     return this.sum;
 }
 
 
+/*
+ *  The status bar is drawn natively from status_template; set it to
+ *  null to build the text here instead, from one snapshot per frame.
+ */
+let status_template = "%20f - %l lines %m%=%M %x/%X %y/%l";
+let bar_state = {};
+
+
 function bar_status(terminal) {
-    let origin_filename = terminal.filename;
+    let state = terminal.snapshot(bar_state);
+    let origin_filename = state.filename;
 
     let max_repeat_space = 20;
-    let repeat_space     = max_repeat_space;
+    let filename_length = bar_counter.length(origin_filename);
+    let repeat_space = Math.max(max_repeat_space - filename_length, 0);
+
+    let filename = origin_filename.slice(0, max_repeat_space) + ' '.repeat(repeat_space);
+
+    let changed = state.changed ? "(modified)" : "";
+    let right = `${filename} - ${state.numrows} lines ${changed}`;
+
+    let current_mode = mode.properties[state.mode].name;
+    let left = `${current_mode} ${state.cx + 1}/${state.row_size} ${state.cy + 1}/${state.numrows}`
 
-    if (bar_counter.length(origin_filename) >= max_repeat_space) {
-        repeat_space = 0;
+    let space = ' '.repeat(Math.max(state.cols
+        - bar_counter.length(right) - bar_counter.length(left), 0));
+
+    return right + space + left;
+}
+
+
+/*
+ *  Keys bound here run natively in vt100.so, the mode functions above
+ *  only see the rest. Keys that switch modes stay in JS.
+ */
+function bind_keys(terminal) {
+    let both = [
+        [special_key.UP, "move_up"],
+        [special_key.DOWN, "move_down"],
+        [special_key.LEFT, "move_left"],
+        [special_key.RIGHT, "move_right"],
+        [special_key.PAGE_UP, "page_up"],
+        [special_key.PAGE_DOWN, "page_down"],
+        [special_key.HOME, "line_start"],
+        [special_key.END, "line_end"],
+        [special_key.DELETE, "delete"],
+        [special_key.BACKSPACE, "backspace"],
+        [CTRL_('h'), "backspace"],
+        [special_key.PASTE, "paste"],
+    ];
+    let normal = [
+        [KeyPress('h'), "move_left"],
+        [KeyPress('j'), "move_down"],
+        [KeyPress('k'), "move_up"],
+        [KeyPress('l'), "move_right"],
+        [KeyPress('^'), "line_start"],
+        [KeyPress('$'), "line_end"],
+        [KeyPress('G'), "bottom"],
+        [KeyPress('x'), "delete_under"],
+        [KeyPress('X'), "delete_before"],
+        [KeyPress('u'), "undo"],
+        [CTRL_('r'), "redo"],
+    ];
+
+    for (let [key, action] of both) {
+        terminal.bind(mode.NORMAL, key, action);
+        terminal.bind(mode.INSERT, key, action);
     }
-    else {
-        repeat_space -= bar_counter.length(origin_filename);
+    for (let [key, action] of normal) {
+        terminal.bind(mode.NORMAL, key, action);
     }
 
-    let filename = origin_filename.slice(0, max_repeat_space) + ' '.repeat(repeat_space);
+    terminal.bind(mode.INSERT, null, "insert_char");
+    terminal.bind(mode.INSERT, KeyPress('\r'), "insert_newline");
+    for (let key of [CTRL_('c'), CTRL_('l'), KeyPress('\x1b')]) {
+        terminal.bind(mode.INSERT, key, editor_mode_insert);
+    }
+}
 
-    let changed = terminal.changed ? "(modified)" : "";
-    let right = `${filename} - ${terminal.numrows} lines ${changed}`;
 
-    let current_mode = mode.properties[terminal.mode].name;
-    let cx = terminal.cx + 1;
-    let cy = terminal.cy + 1;
+const SIGWINCH = 28;
 
-    let cx_size = 0;
-    if (terminal.check_row_object()) {
-        cx_size = terminal.get_erow_size_at(terminal.cy);
-    }
-    else {
-        cx_size = 0;
+// frames per second at most, WOE_FPS overrides it
+let frame_interval = 1000 / (Number(std.getenv("WOE_FPS")) || 60);
+
+
+/*
+ *  j/k and up/down queued behind each other in normal mode move the
+ *  cursor as one jump, so a held key over a slow link does not pile up.
+ */
+function coalesce_motion(terminal, f, key) {
+    let step = 0;
+
+    if (f !== editor_mode_normal) {
+        return false;
     }
 
-    let left = `${current_mode} ${cx}/${cx_size} ${cy}/${terminal.numrows}`
+    switch (key) {
+        case KeyPress('j'):
+        case special_key.DOWN:
+            step = 1;
+            break;
+        case KeyPress('k'):
+        case special_key.UP:
+            step = -1;
+            break;
+        default:
+            return false;
+    }
 
-    let space = ' '.repeat(80
-        - bar_counter.length(right) - bar_counter.length(left));
+    let cy = terminal.cy + step * (1 + terminal.skip_repeats(key));
 
-    let v = right + space + left;
-    return v;
+    if (cy > terminal.numrows - 1) {
+        cy = terminal.numrows - 1;
+    }
+    if (cy < 0) {
+        cy = 0;
+    }
+    terminal.cy = cy;
+    terminal.fix_position();
+    return true;
 }
 
 
 function main() {
-    let run_forever = true;
     let f = editor_mode_normal;
+    let status_timer = null;
+    let frame_timer = null;
+    let last_frame = 0;
 
     let terminal = new VT100(mode.NORMAL);
     terminal.enable_rawmode();
 
-    if (scriptArgs.length >= 2) {
-        terminal.file_open(scriptArgs[1]);
+    if (status_template !== null) {
+        let names = [];
+
+        for (let key in mode.properties) {
+            names[key] = mode.properties[key].name;
+        }
+        terminal.status_format(status_template, names);
+    }
+
+    let opened = scriptArgs.length < 2 || terminal.file_open(scriptArgs[1]);
+
+    bind_keys(terminal);
+    if (opened) {
+        terminal.echo_status_message(HELP_MESSAGE);
+    }
+    file_storage.recover(terminal);
+
+    /*
+     *  Nothing is polled: the screen is redrawn after input, when the
+     *  status message expires and on resize, the os loop sleeps between.
+     */
+    function draw() {
+        last_frame = Date.now();
+
+        // the terminal has not taken the last frame, try once it can
+        let bar = status_template === null ? bar_status(terminal) : undefined;
+
+        if (terminal.refresh_woe_ui(bar) > 0) {
+            os.setWriteHandler(1, function () {
+                if (terminal.flush_output() == 0) {
+                    os.setWriteHandler(1, null);
+                    refresh();
+                }
+            });
+        }
+
+        if (status_timer !== null) {
+            os.clearTimeout(status_timer);
+            status_timer = null;
+        }
+
+        let timeout = terminal.status_timeout();
+        if (timeout >= 0) {
+            status_timer = os.setTimeout(function () {
+                status_timer = null;
+                refresh();
+            }, timeout);
+        }
     }
 
-    terminal.echo_status_message(HELP_MESSAGE);
+    // ask for a frame, at most one per frame_interval is drawn
+    function refresh() {
+        if (frame_timer !== null) {
+            return;
+        }
 
-    while (run_forever) {
-        let status_message = bar_status(terminal);
-        terminal.refresh_woe_ui(status_message);
+        let wait = last_frame + frame_interval - Date.now();
+        if (wait > 0) {
+            frame_timer = os.setTimeout(function () {
+                frame_timer = null;
+                draw();
+            }, wait);
+            return;
+        }
+        draw();
+    }
 
-        let v = terminal.next_key();
-        [run_forever, f] = f(terminal, v);
+    function quit() {
+        os.setReadHandler(0, null);
+        os.setWriteHandler(1, null);
+        os.signal(SIGWINCH, null);
+        if (watch >= 0) {
+            os.setReadHandler(watch, null);
+        }
+        if (saving >= 0) {
+            os.setReadHandler(saving, null);
+        }
+        os.clearTimeout(autosave_timer);
+        terminal.save_wait();
+        if (status_timer !== null) {
+            os.clearTimeout(status_timer);
+        }
+        if (frame_timer !== null) {
+            os.clearTimeout(frame_timer);
+        }
+        terminal.disable_rawmode();
     }
-    terminal.disable_rawmode();
+
+    os.setReadHandler(0, function () {
+        let run_forever = true;
+
+        // drain all typeahead, then draw once
+        do {
+            let key = terminal.next_key();
+
+            if (!coalesce_motion(terminal, f, key)) {
+                // a command waiting for its next key, e.g. g, sees it first
+                let r = f === editor_mode_normal || f === editor_mode_insert
+                    ? terminal.dispatch(key, f)
+                    : f(terminal, key);
+
+                if (r !== true) {
+                    [run_forever, f] = r;
+                }
+            }
+            if (!run_forever) {
+                quit();
+                return;
+            }
+        } while (terminal.key_pending());
+
+        refresh();
+    });
+
+    os.signal(SIGWINCH, function () {
+        terminal.update_window_size();
+        refresh();
+    });
+
+    // open files changed by someone else are reloaded in place
+    let watch = terminal.watch_fd();
+    if (watch >= 0) {
+        os.setReadHandler(watch, function () {
+            if (terminal.check_files()) {
+                refresh();
+            }
+        });
+    }
+
+    // saves are written by a thread, it reports how far it got
+    let saving = terminal.save_fd();
+    if (saving >= 0) {
+        os.setReadHandler(saving, function () {
+            if (terminal.check_save()) {
+                refresh();
+            }
+        });
+    }
+
+    // edits go to a swap file every terminal.autosave seconds, when set,
+    // and an unused file index gives its directory watches back
+    let autosave_timer = null;
+    function autosave() {
+        terminal.autosave_tick();
+        terminal.file_index_idle();
+        autosave_timer = os.setTimeout(autosave, 1000);
+    }
+    autosave();
+
+    refresh();
 }
 
 
 var woe_menu = new Menu();
 var file_storage = new FileStorage();
 var bar_counter = new Counter();
+var regex_search = null;
+var use_regex = false;
 main();
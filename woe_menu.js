@@ -45,6 +45,7 @@ var files_submenu = {
     SWITCH:      4,
     CLOSE:       5,
     FORCE_CLOSE: 6,
+    FOLLOW:      7,
     CANCEL:      0,
     name: "files_submenu",
     main: false,
@@ -56,6 +57,7 @@ var files_submenu = {
         4: {name: "Switch", value: 4, submenu: false, do_job: file_switch},
         5: {name: "Close", value: 5, submenu: false, do_job: close_file},
         6: {name: "Force Close", value: 6, submenu: false, do_job: force_close_file},
+        7: {name: "Follow", value: 7, submenu: false, do_job: follow_file},
     },
 };
 
@@ -157,6 +159,16 @@ function save_file(terminal, file_storage, argv) {
 }
 
 
+// like tail -f: new lines of the file show up, the view stays at the end
+function follow_file(terminal, file_storage, argv) {
+    terminal.follow = !terminal.follow;
+    terminal.echo_status_message(terminal.follow ? 'follow on' : 'follow off');
+    terminal.mode = argv.mode.NORMAL;
+    argv.menu.main();
+    return argv.editor_mode_normal;
+}
+
+
 function file_switch(terminal, file_storage, argv) {
     terminal.mode = argv.mode.MENU;
     let next_function = argv.editor_mode_menu;
@@ -198,13 +210,13 @@ function file_switch(terminal, file_storage, argv) {
                 break;
         }
 
-        if (f) {
-            terminal.file_close();
-            terminal.file_open(f.name);
-        }
+        // a file that cannot be read leaves its message up
+        let opened = !f || terminal.buffer_open(f.name) >= 0;
 
         terminal.mode = argv.mode.NORMAL;
-        terminal.echo_status_message('');
+        if (opened) {
+            terminal.echo_status_message('');
+        }
 
         argv.menu.main();
         return [run_forever, next_function];